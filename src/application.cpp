@@ -5,14 +5,29 @@
  *      Author: unreality
  */
 
+#include <cstdlib>
+#include <sstream>
+
 #include "application.hpp"
 
 using namespace gfsfcgi;
 
-gfsfcgi::Factory::Factory(int argc, char** argv) : app(NULL),
-        connection(true)
+gfsfcgi::Factory::Factory(int argc, char** argv) : replicaSet(NULL),
+        metadataCache(NULL),
+        chunkCache(NULL),
+        fetchPool(NULL),
+        app(NULL)
 {
     this->options = ConfigOptions(argc, argv);
+    this->createReplicaSet();
+
+    this->metadataCache = new MetadataCache(
+        this->getSizeOption("cache.metadata-size", MetadataCache::DEFAULT_BUDGET),
+        this->getSizeOption("cache.metadata-ttl", MetadataCache::DEFAULT_TTL)
+    );
+
+    this->chunkCache = new ChunkCache(this->getSizeOption("cache.chunk-size", ChunkCache::DEFAULT_BUDGET));
+    this->fetchPool = new FetchPool(this->getSizeOption("readahead.threads", FetchPool::DEFAULT_THREADS));
 }
 
 gfsfcgi::Factory::~Factory()
@@ -20,6 +35,35 @@ gfsfcgi::Factory::~Factory()
     if (this->app != NULL) {
         delete this->app;
     }
+
+    // Fetches use the caches and the replica set
+    if (this->fetchPool != NULL) {
+        delete this->fetchPool;
+    }
+
+    if (this->chunkCache != NULL) {
+        delete this->chunkCache;
+    }
+
+    if (this->metadataCache != NULL) {
+        delete this->metadataCache;
+    }
+
+    if (this->replicaSet != NULL) {
+        delete this->replicaSet;
+    }
+}
+
+std::string gfsfcgi::Factory::getOption(const std::string& name, const std::string& defaultValue) const
+{
+    Options::const_iterator option = this->options.find(name);
+    return ((option != this->options.end()) && !option->second.empty())? option->second : defaultValue;
+}
+
+size_t gfsfcgi::Factory::getSizeOption(const std::string& name, size_t defaultValue) const
+{
+    std::string value = this->getOption(name, "");
+    return value.empty()? defaultValue : strtoul(value.c_str(), NULL, 10);
 }
 
 Application& gfsfcgi::Factory::getApplication()
@@ -31,20 +75,51 @@ Application& gfsfcgi::Factory::getApplication()
     return *(this->app);
 }
 
-void gfsfcgi::Factory::createConnection()
+void gfsfcgi::Factory::createReplicaSet()
 {
-    if (this->connection != NULL) {
+    if (this->replicaSet != NULL) {
         return;
     }
 
-    this->connection = new mongo::DBClientConnection(true);
-    this->connection->connect(this->options[""]);
+    std::vector<std::string> seeds;
+    std::istringstream hosts(this->getOption("mongodb.host", "localhost"));
+    std::string host;
+
+    while (std::getline(hosts, host, ',')) {
+        if (!host.empty()) {
+            seeds.push_back(host);
+        }
+    }
+
+    this->replicaSet = new ReplicaSet(
+        seeds,
+        this->getOption("mongodb.replica-set", ""),
+        this->getOption("mongodb.database", "test"),
+        this->getSizeOption("mongodb.pool-size", ConnectionPool::DEFAULT_MAX_SIZE)
+    );
+
+    this->replicaSet->setReadPreference(ReplicaSet::parseReadPreference(this->getOption("mongodb.read-preference", "primary")));
+    this->replicaSet->setAcquireTimeout(this->getSizeOption("mongodb.pool-timeout", ConnectionPool::DEFAULT_ACQUIRE_TIMEOUT));
+    this->replicaSet->discover();
+
+    // Connect before the first request, failures show up in the pool metrics
+    this->replicaSet->warmUp(this->getSizeOption("mongodb.pool-warmup", 1));
+}
+
+ReplicaSet& gfsfcgi::Factory::getReplicaSet()
+{
+    this->createReplicaSet();
+    return *(this->replicaSet);
+}
+
+MetadataCache& gfsfcgi::Factory::getMetadataCache()
+{
+    return *(this->metadataCache);
 }
 
-mongo::DBClientConnection& gfsfcgi::Factory::getMongoConnection()
+ChunkCache& gfsfcgi::Factory::getChunkCache()
 {
-    this->createConnection();
-    return *(this->connection);
+    return *(this->chunkCache);
 }
 
 gfsfcgi::Application::Application(Options options)
@@ -65,4 +140,5 @@ gfsfcgi::ConfigOptions::ConfigOptions(int argc, char** argv)
 
 RequestHandler* gfsfcgi::Factory::createRequestHandler() const
 {
+    return new RequestHandler(*(this->replicaSet), *(this->metadataCache), *(this->chunkCache), *(this->fetchPool));
 }
@@ -3,6 +3,10 @@
 #include <string>
 #include <mongo/client/dbclientinterface.h>
 
+#include "replicaset.hpp"
+#include "metadatacache.hpp"
+#include "chunkcache.hpp"
+#include "fetchpool.hpp"
 #include "requesthandler.hpp"
 
 namespace gfsfcgi
@@ -50,22 +54,49 @@ namespace gfsfcgi
 
     /**
      * Dependency factory class
+     *
+     * MongoDB options:
+     *   mongodb.host             Comma separated seed hosts, host[:port] (default localhost)
+     *   mongodb.replica-set      Replica set name, empty for a standalone server
+     *   mongodb.read-preference  primary, primaryPreferred, secondary, secondaryPreferred
+     *                            or nearest (default primary)
+     *   mongodb.database         GridFS database (default test)
+     *   mongodb.pool-size        Maximum number of connections per member
+     *   mongodb.pool-warmup      Connections per member opened at startup
+     *   mongodb.pool-timeout     Milliseconds to wait for a free connection
+     *
+     * Cache options:
+     *   cache.metadata-size      Memory budget of the file metadata cache in bytes
+     *   cache.metadata-ttl       Seconds file metadata is cached
+     *   cache.chunk-size         Memory budget of the chunk cache in bytes
+     *   readahead.threads        Threads fetching chunks ahead of the clients
      */
     class Factory : public RequestHandlerFactoryInterface
     {
         protected:
             Options options;
-            mongo::DBClientConnection* connection;
+            ReplicaSet* replicaSet;
+            MetadataCache* metadataCache;
+            ChunkCache* chunkCache;
+            FetchPool* fetchPool;
             Application* app;
 
-            virtual void createConnection();
+            /**
+             * Get an option or its default if it is not set
+             */
+            std::string getOption(const std::string& name, const std::string& defaultValue) const;
+            size_t getSizeOption(const std::string& name, size_t defaultValue) const;
+
+            virtual void createReplicaSet();
 
         public:
             Factory(int argc, char** argv);
             virtual ~Factory();
 
             Application& getApplication();
-            inline mongo::DBClientConnection& getMongoConnection();
+            ReplicaSet& getReplicaSet();
+            MetadataCache& getMetadataCache();
+            ChunkCache& getChunkCache();
 
             RequestHandler* createRequestHandler() const;
     };
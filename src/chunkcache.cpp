@@ -0,0 +1,274 @@
+/*
+ * chunkcache.cpp
+ */
+
+#include "chunkcache.hpp"
+
+using namespace gfsfcgi;
+
+const size_t gfsfcgi::FrequencySketch::DEPTH;
+const uint8_t gfsfcgi::FrequencySketch::MAX_COUNT;
+
+const size_t gfsfcgi::ChunkCache::SHARD_COUNT;
+const size_t gfsfcgi::ChunkCache::DEFAULT_BUDGET;
+const size_t gfsfcgi::ChunkCache::EXPECTED_CHUNK_SIZE;
+const unsigned gfsfcgi::ChunkCache::WINDOW_PERCENT;
+const unsigned gfsfcgi::ChunkCache::PROTECTED_PERCENT;
+
+////////////////////////////////////////
+// Chunks
+
+ChunkPtr gfsfcgi::Chunk::fromBSON(const mongo::BSONObj& document)
+{
+    std::shared_ptr<Chunk> chunk = std::make_shared<Chunk>();
+    int size = 0;
+
+    chunk->document = document;
+    chunk->data = document["data"].binData(size);
+    chunk->size = (size > 0)? size : 0;
+
+    return chunk;
+}
+
+gfsfcgi::ChunkKey::ChunkKey(const mongo::BSONObj& id, unsigned int n) :
+        filesId(id.objdata(), id.objsize()),
+        n(n)
+{
+}
+
+size_t gfsfcgi::ChunkKey::hash() const
+{
+    return std::hash<std::string>()(this->filesId) ^ (this->n * 0x9e3779b97f4a7c15ULL);
+}
+
+////////////////////////////////////////
+// Frequency sketch
+
+gfsfcgi::FrequencySketch::FrequencySketch(size_t capacity) :
+        width(16),
+        additions(0)
+{
+    while (this->width < capacity) {
+        this->width <<= 1;
+    }
+
+    this->table.resize(DEPTH * this->width, 0);
+    this->sampleSize = 10 * this->width;
+}
+
+void gfsfcgi::FrequencySketch::increment(size_t hash)
+{
+    for (size_t row = 0; row < DEPTH; row++) {
+        uint8_t& counter = this->table[this->getIndex(hash, row)];
+
+        if (counter < MAX_COUNT) {
+            counter++;
+        }
+    }
+
+    if (++this->additions >= this->sampleSize) {
+        this->halve();
+    }
+}
+
+unsigned int gfsfcgi::FrequencySketch::estimate(size_t hash) const
+{
+    unsigned int count = MAX_COUNT;
+
+    for (size_t row = 0; row < DEPTH; row++) {
+        unsigned int counter = this->table[this->getIndex(hash, row)];
+
+        if (counter < count) {
+            count = counter;
+        }
+    }
+
+    return count;
+}
+
+void gfsfcgi::FrequencySketch::halve()
+{
+    for (auto& counter : this->table) {
+        counter >>= 1;
+    }
+
+    this->additions /= 2;
+}
+
+////////////////////////////////////////
+// Cache
+
+gfsfcgi::ChunkCache::ChunkCache(size_t budget) :
+        hits(0),
+        misses(0),
+        admitted(0),
+        rejected(0),
+        evictions(0)
+{
+    size_t shardBudget = budget / SHARD_COUNT;
+    size_t capacity = shardBudget / EXPECTED_CHUNK_SIZE + 1;
+
+    this->windowBudget = shardBudget * WINDOW_PERCENT / 100;
+    this->mainBudget = shardBudget - this->windowBudget;
+    this->protectedBudget = this->mainBudget * PROTECTED_PERCENT / 100;
+
+    for (size_t i = 0; i < SHARD_COUNT; i++) {
+        this->shards.push_back(new Shard(capacity));
+    }
+}
+
+gfsfcgi::ChunkCache::~ChunkCache()
+{
+    for (auto shard : this->shards) {
+        delete shard;
+    }
+
+    this->shards.clear();
+}
+
+void gfsfcgi::ChunkCache::move(Shard& shard, EntryList::iterator entry, Segment segment)
+{
+    size_t size = entry->chunk->size;
+
+    shard.sizes[entry->segment] -= size;
+    shard.sizes[segment] += size;
+    shard.lists[segment].splice(shard.lists[segment].begin(), shard.lists[entry->segment], entry);
+
+    entry->segment = segment;
+}
+
+void gfsfcgi::ChunkCache::erase(Shard& shard, EntryList::iterator entry)
+{
+    shard.sizes[entry->segment] -= entry->chunk->size;
+    shard.index.erase(entry->key);
+    shard.lists[entry->segment].erase(entry);
+}
+
+ChunkPtr gfsfcgi::ChunkCache::get(const ChunkKey& key)
+{
+    size_t hash = key.hash();
+    Shard& shard = this->getShard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    shard.sketch.increment(hash);
+
+    auto found = shard.index.find(key);
+
+    if (found == shard.index.end()) {
+        this->misses++;
+        return ChunkPtr();
+    }
+
+    EntryList::iterator entry = found->second;
+
+    // Second hit in the main area protects the chunk
+    if (entry->segment == WINDOW) {
+        this->move(shard, entry, WINDOW);
+    } else {
+        this->move(shard, entry, PROTECTED);
+
+        while (shard.sizes[PROTECTED] > this->protectedBudget) {
+            this->move(shard, --shard.lists[PROTECTED].end(), PROBATION);
+        }
+    }
+
+    this->hits++;
+    return entry->chunk;
+}
+
+void gfsfcgi::ChunkCache::put(const ChunkKey& key, const ChunkPtr& chunk)
+{
+    if (chunk->size > this->mainBudget) {
+        return;
+    }
+
+    size_t hash = key.hash();
+    Shard& shard = this->getShard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    // Loaded by another request meanwhile
+    if (shard.index.find(key) != shard.index.end()) {
+        return;
+    }
+
+    Entry entry = { key, chunk, hash, WINDOW };
+
+    shard.lists[WINDOW].push_front(entry);
+    shard.sizes[WINDOW] += chunk->size;
+    shard.index[key] = shard.lists[WINDOW].begin();
+
+    this->evictWindow(shard);
+}
+
+void gfsfcgi::ChunkCache::evictWindow(Shard& shard)
+{
+    EntryList& window = shard.lists[WINDOW];
+    std::vector<EntryList::iterator> victims;
+
+    // The newest chunk always gets its turn in the window
+    while ((shard.sizes[WINDOW] > this->windowBudget) && (window.size() > 1)) {
+        EntryList::iterator candidate = --window.end();
+        unsigned int frequency = shard.sketch.estimate(candidate->hash);
+        size_t used = shard.sizes[PROBATION] + shard.sizes[PROTECTED];
+        bool admit = true;
+
+        // Pick the victims first, nothing is evicted for a candidate that is rejected
+        victims.clear();
+
+        for (Segment segment : { PROBATION, PROTECTED }) {
+            EntryList& list = shard.lists[segment];
+            auto victim = list.rbegin();
+
+            while (admit && ((used + candidate->chunk->size) > this->mainBudget) && (victim != list.rend())) {
+                if (frequency <= shard.sketch.estimate(victim->hash)) {
+                    admit = false;
+                    break;
+                }
+
+                used -= victim->chunk->size;
+                victims.push_back(std::prev((victim++).base()));
+            }
+        }
+
+        // Larger than the main area
+        if ((used + candidate->chunk->size) > this->mainBudget) {
+            admit = false;
+        }
+
+        if (admit) {
+            for (auto victim : victims) {
+                this->erase(shard, victim);
+                this->evictions++;
+            }
+
+            this->move(shard, candidate, PROBATION);
+            this->admitted++;
+        } else {
+            this->erase(shard, candidate);
+            this->rejected++;
+        }
+    }
+}
+
+ChunkCache::Metrics gfsfcgi::ChunkCache::getMetrics()
+{
+    Metrics metrics;
+
+    metrics.entries = 0;
+    metrics.memory = 0;
+
+    for (auto shard : this->shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+
+        metrics.entries += shard->index.size();
+        metrics.memory += shard->sizes[WINDOW] + shard->sizes[PROBATION] + shard->sizes[PROTECTED];
+    }
+
+    metrics.hits = this->hits;
+    metrics.misses = this->misses;
+    metrics.admitted = this->admitted;
+    metrics.rejected = this->rejected;
+    metrics.evictions = this->evictions;
+
+    return metrics;
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <list>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include <mongo/client/dbclientinterface.h>
+
+namespace gfsfcgi
+{
+    /**
+     * A GridFS chunk
+     *
+     * The data points into the chunk document, so it is shared without copying as long
+     * as a reference to the chunk is held (i.e. by a release callback of the output).
+     */
+    struct Chunk {
+        mongo::BSONObj document; ///< Owned chunk document
+        const char* data = NULL;
+        size_t size = 0;
+
+        /**
+         * Take the data of an owned chunk document
+         */
+        static std::shared_ptr<const Chunk> fromBSON(const mongo::BSONObj& document);
+    };
+
+    typedef std::shared_ptr<const Chunk> ChunkPtr;
+
+    /**
+     * Chunk identity: the files_id and the chunk number
+     */
+    struct ChunkKey {
+        std::string filesId; ///< Raw BSON of the file's _id
+        unsigned int n;
+
+        ChunkKey(const mongo::BSONObj& id, unsigned int n);
+
+        inline bool operator==(const ChunkKey& other) const
+        {
+            return (this->n == other.n) && (this->filesId == other.filesId);
+        }
+
+        size_t hash() const;
+    };
+
+    struct ChunkKeyHash {
+        inline size_t operator()(const ChunkKey& key) const
+        {
+            return key.hash();
+        }
+    };
+
+    /**
+     * Count-min sketch of access frequencies with 4 bit counters
+     *
+     * All counters are halved after a sample of accesses, so the estimates follow
+     * changes in popularity.
+     */
+    class FrequencySketch
+    {
+        protected:
+            const static size_t DEPTH = 4;
+            const static uint8_t MAX_COUNT = 15;
+
+            std::vector<uint8_t> table; ///< DEPTH rows
+            size_t width; ///< Counters per row (power of two)
+            size_t additions;
+            size_t sampleSize;
+
+            inline size_t getIndex(size_t hash, size_t row) const
+            {
+                // Derive independent rows from one hash
+                size_t h = (hash + row) * 0x9e3779b97f4a7c15ULL;
+                return row * this->width + ((h >> 17) & (this->width - 1));
+            }
+
+            void halve();
+
+        public:
+            /**
+             * @param[in]  capacity  Expected number of distinct hot items
+             */
+            FrequencySketch(size_t capacity);
+
+            void increment(size_t hash);
+            unsigned int estimate(size_t hash) const;
+    };
+
+    /**
+     * Sharded chunk cache with W-TinyLFU admission
+     *
+     * Each shard is split into a small LRU window for new chunks and a segmented LRU
+     * main area (probation and protected). A chunk leaving the window only enters the
+     * main area if it was requested more often than the chunks it would displace, so
+     * one-off downloads of large files do not flush popular content.
+     */
+    class ChunkCache
+    {
+        public:
+            const static size_t SHARD_COUNT = 16;
+            const static size_t DEFAULT_BUDGET = 256 * 1024 * 1024; ///< Bytes
+            const static size_t EXPECTED_CHUNK_SIZE = 255 * 1024; ///< Sizes the frequency sketch
+            const static unsigned WINDOW_PERCENT = 1;
+            const static unsigned PROTECTED_PERCENT = 80; ///< Share of the main area
+
+            struct Metrics {
+                size_t entries;
+                size_t memory; ///< Bytes of cached chunk data
+                uint64_t hits;
+                uint64_t misses;
+                uint64_t admitted; ///< Chunks moved from the window to the main area
+                uint64_t rejected; ///< Chunks dropped by the admission filter
+                uint64_t evictions; ///< Chunks dropped from the main area
+            };
+
+        protected:
+            enum Segment { WINDOW, PROBATION, PROTECTED };
+
+            struct Entry {
+                ChunkKey key;
+                ChunkPtr chunk;
+                size_t hash;
+                Segment segment;
+            };
+
+            typedef std::list<Entry> EntryList;
+
+            struct Shard {
+                std::mutex mutex;
+                FrequencySketch sketch;
+                std::unordered_map<ChunkKey, EntryList::iterator, ChunkKeyHash> index;
+
+                // Most recently used first
+                EntryList lists[3];
+                size_t sizes[3] = { 0, 0, 0 };
+
+                inline Shard(size_t capacity) : sketch(capacity) {};
+            };
+
+            std::vector<Shard*> shards;
+            size_t windowBudget;
+            size_t mainBudget;
+            size_t protectedBudget;
+
+            std::atomic<uint64_t> hits;
+            std::atomic<uint64_t> misses;
+            std::atomic<uint64_t> admitted;
+            std::atomic<uint64_t> rejected;
+            std::atomic<uint64_t> evictions;
+
+            inline Shard& getShard(size_t hash)
+            {
+                return *(this->shards[(hash >> 7) % SHARD_COUNT]);
+            }
+
+            /**
+             * Move an entry to the front of a segment (call with the shard lock held)
+             */
+            void move(Shard& shard, EntryList::iterator entry, Segment segment);
+            void erase(Shard& shard, EntryList::iterator entry);
+
+            /**
+             * Move chunks from the window to the main area, admitting each one only if
+             * it is more frequent than the chunks it displaces
+             */
+            void evictWindow(Shard& shard);
+
+        public:
+            /**
+             * @param[in]  budget  Memory budget for chunk data in bytes
+             */
+            ChunkCache(size_t budget = DEFAULT_BUDGET);
+            virtual ~ChunkCache();
+
+            /**
+             * Get a cached chunk and count the access
+             *
+             * @return The chunk or an empty pointer on a miss
+             */
+            ChunkPtr get(const ChunkKey& key);
+
+            /**
+             * Add a chunk after a miss
+             */
+            void put(const ChunkKey& key, const ChunkPtr& chunk);
+
+            Metrics getMetrics();
+    };
+}
@@ -0,0 +1,330 @@
+/*
+ * connectionpool.cpp
+ */
+
+#include <vector>
+
+#include "connectionpool.hpp"
+
+using namespace gfsfcgi;
+
+const size_t gfsfcgi::ConnectionPool::DEFAULT_MAX_SIZE;
+const unsigned gfsfcgi::ConnectionPool::DEFAULT_ACQUIRE_TIMEOUT;
+const unsigned gfsfcgi::ConnectionPool::HEALTH_CHECK_INTERVAL;
+
+////////////////////////////////////////
+// Lease
+
+gfsfcgi::ConnectionPool::Lease::Lease(Lease&& other) : pool(other.pool), connection(other.connection)
+{
+    other.pool = NULL;
+    other.connection = NULL;
+}
+
+ConnectionPool::Lease& gfsfcgi::ConnectionPool::Lease::operator=(Lease&& other)
+{
+    if (this != &other) {
+        this->release();
+
+        this->pool = other.pool;
+        this->connection = other.connection;
+        other.pool = NULL;
+        other.connection = NULL;
+    }
+
+    return *this;
+}
+
+mongo::DBClientConnection& gfsfcgi::ConnectionPool::Lease::getClient()
+{
+    if (this->connection == NULL) {
+        throw NullPointerException("connection");
+    }
+
+    return *(this->connection->client);
+}
+
+mongo::GridFS& gfsfcgi::ConnectionPool::Lease::getGridFS()
+{
+    if (this->connection == NULL) {
+        throw NullPointerException("connection");
+    }
+
+    return *(this->connection->gridfs);
+}
+
+int gfsfcgi::ConnectionPool::Lease::getQueryOptions() const
+{
+    return (this->pool != NULL)? this->pool->queryOptions.load() : 0;
+}
+
+void gfsfcgi::ConnectionPool::Lease::invalidate()
+{
+    if (this->connection != NULL) {
+        this->connection->failed = true;
+    }
+}
+
+void gfsfcgi::ConnectionPool::Lease::release()
+{
+    if (this->connection != NULL) {
+        this->pool->release(this->connection);
+        this->pool = NULL;
+        this->connection = NULL;
+    }
+}
+
+////////////////////////////////////////
+// Pool
+
+gfsfcgi::ConnectionPool::ConnectionPool(const std::string& host, const std::string& database, size_t maxSize) :
+        host(host),
+        database(database),
+        maxSize((maxSize > 0)? maxSize : 1),
+        acquireTimeout(std::chrono::milliseconds(DEFAULT_ACQUIRE_TIMEOUT)),
+        queryOptions(0),
+        inUse(0),
+        open(0),
+        acquired(0),
+        waited(0),
+        waitTime(0),
+        maxWaitTime(0),
+        timeouts(0),
+        reconnects(0),
+        failures(0)
+{
+}
+
+gfsfcgi::ConnectionPool::~ConnectionPool()
+{
+    for (auto connection : this->connections) {
+        this->disconnect(connection);
+        delete connection;
+    }
+
+    this->connections.clear();
+}
+
+ConnectionPool::Lease gfsfcgi::ConnectionPool::acquire()
+{
+    Clock::time_point start = Clock::now();
+    Clock::time_point deadline = start + this->acquireTimeout;
+    std::thread::id self = std::this_thread::get_id();
+    Connection* connection = NULL;
+    bool waited = false;
+
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+
+        while (connection == NULL) {
+            // Prefer the connection this thread used last
+            for (auto item : this->connections) {
+                if (item->inUse) {
+                    continue;
+                }
+
+                if ((connection == NULL) || (item->owner == self)) {
+                    connection = item;
+                }
+
+                if (item->owner == self) {
+                    break;
+                }
+            }
+
+            // Connected outside the lock
+            if ((connection == NULL) && (this->connections.size() < this->maxSize)) {
+                connection = new Connection();
+                this->connections.push_back(connection);
+            }
+
+            if (connection != NULL) {
+                break;
+            }
+
+            waited = true;
+
+            if (this->available.wait_until(lock, deadline) == std::cv_status::timeout) {
+                this->timeouts++;
+                throw TimeoutException("Timed out waiting for a MongoDB connection");
+            }
+        }
+
+        connection->inUse = true;
+        connection->owner = self;
+        this->inUse++;
+    }
+
+    if (waited) {
+        this->recordWait(Clock::now() - start);
+    }
+
+    try {
+        this->prepare(connection);
+    } catch (...) {
+        this->release(connection);
+        throw;
+    }
+
+    this->acquired++;
+
+    return Lease(this, connection);
+}
+
+size_t gfsfcgi::ConnectionPool::warmUp(size_t count)
+{
+    std::vector<Lease> leases;
+
+    if (count > this->maxSize) {
+        count = this->maxSize;
+    }
+
+    // Hold all leases so each one opens a new connection
+    try {
+        while (leases.size() < count) {
+            leases.push_back(this->acquire());
+        }
+    } catch (IOException&) {
+    }
+
+    return leases.size();
+}
+
+void gfsfcgi::ConnectionPool::prepare(Connection* connection)
+{
+    if ((connection->client == NULL) || connection->failed || connection->client->isFailed()) {
+        if (connection->client != NULL) {
+            this->reconnects++;
+        }
+
+        this->connect(connection);
+        return;
+    }
+
+    // Sockets idle for a while may have been dropped by the server or a firewall
+    if ((Clock::now() - connection->checkedAt) >= std::chrono::milliseconds(HEALTH_CHECK_INTERVAL)) {
+        if (!this->ping(connection)) {
+            this->reconnects++;
+            this->connect(connection);
+            return;
+        }
+
+        connection->checkedAt = Clock::now();
+    }
+}
+
+void gfsfcgi::ConnectionPool::connect(Connection* connection)
+{
+    std::string error;
+
+    this->disconnect(connection);
+    connection->client = new mongo::DBClientConnection(true);
+
+    try {
+        if (!connection->client->connect(this->host, error)) {
+            throw IOException("Failed to connect to MongoDB");
+        }
+
+        connection->gridfs = new mongo::GridFS(*(connection->client), this->database);
+    } catch (mongo::DBException& e) {
+        this->failures++;
+        this->disconnect(connection);
+
+        throw IOException("Failed to connect to MongoDB");
+    } catch (IOException& e) {
+        this->failures++;
+        this->disconnect(connection);
+
+        throw;
+    }
+
+    connection->failed = false;
+    connection->checkedAt = Clock::now();
+    this->open++;
+}
+
+void gfsfcgi::ConnectionPool::disconnect(Connection* connection)
+{
+    // Only connections that got their GridFS count as open
+    if (connection->gridfs != NULL) {
+        delete connection->gridfs;
+        connection->gridfs = NULL;
+        this->open--;
+    }
+
+    if (connection->client != NULL) {
+        delete connection->client;
+        connection->client = NULL;
+    }
+}
+
+bool gfsfcgi::ConnectionPool::ping(Connection* connection)
+{
+    mongo::BSONObj info;
+
+    try {
+        return connection->client->simpleCommand("admin", &info, "ping");
+    } catch (mongo::DBException& e) {
+        return false;
+    }
+}
+
+void gfsfcgi::ConnectionPool::release(Connection* connection)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+
+        if (!connection->failed && (connection->client != NULL)) {
+            connection->checkedAt = Clock::now();
+        }
+
+        connection->inUse = false;
+        this->inUse--;
+    }
+
+    this->available.notify_one();
+}
+
+void gfsfcgi::ConnectionPool::recordWait(Clock::duration wait)
+{
+    uint64_t usec = std::chrono::duration_cast<std::chrono::microseconds>(wait).count();
+    uint64_t max = this->maxWaitTime;
+
+    this->waited++;
+    this->waitTime += usec;
+
+    while ((usec > max) && !this->maxWaitTime.compare_exchange_weak(max, usec)) {
+    }
+}
+
+void gfsfcgi::ConnectionPool::setAcquireTimeout(unsigned int msec)
+{
+    this->acquireTimeout = std::chrono::milliseconds(msec);
+}
+
+void gfsfcgi::ConnectionPool::setQueryOptions(int options)
+{
+    this->queryOptions = options;
+}
+
+ConnectionPool::Metrics gfsfcgi::ConnectionPool::getMetrics() const
+{
+    Metrics metrics;
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        metrics.inUse = this->inUse;
+    }
+
+    metrics.size = this->open;
+    metrics.maxSize = this->maxSize;
+    metrics.acquired = this->acquired;
+    metrics.waited = this->waited;
+    metrics.waitTime = this->waitTime;
+    metrics.maxWaitTime = this->maxWaitTime;
+    metrics.timeouts = this->timeouts;
+    metrics.reconnects = this->reconnects;
+    metrics.failures = this->failures;
+
+    return metrics;
+}
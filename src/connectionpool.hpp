@@ -0,0 +1,194 @@
+#pragma once
+
+#include <list>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mongo/client/dbclientinterface.h>
+#include <mongo/client/gridfs.h>
+
+#include "exceptions.hpp"
+
+namespace gfsfcgi
+{
+    /**
+     * Bounded pool of MongoDB connections
+     *
+     * Each connection has its own GridFS instance. Threads get back the connection they
+     * used last if it is idle, so a worker keeps its socket warm. Connections that were
+     * idle for HEALTH_CHECK_INTERVAL are pinged before they are handed out, failed ones
+     * are reconnected.
+     */
+    class ConnectionPool
+    {
+        public:
+            typedef std::chrono::steady_clock Clock;
+
+            const static size_t DEFAULT_MAX_SIZE = 16;
+            const static unsigned DEFAULT_ACQUIRE_TIMEOUT = 5000; ///< Milliseconds
+            const static unsigned HEALTH_CHECK_INTERVAL = 10000; ///< Milliseconds idle before a ping
+
+            /**
+             * Pool state and counters
+             */
+            struct Metrics {
+                size_t size; ///< Open connections
+                size_t inUse; ///< Leased connections
+                size_t maxSize;
+                uint64_t acquired; ///< Leases handed out
+                uint64_t waited; ///< Leases that had to wait for a connection
+                uint64_t waitTime; ///< Total time spent waiting (microseconds)
+                uint64_t maxWaitTime; ///< Longest wait (microseconds)
+                uint64_t timeouts; ///< Acquisitions that gave up
+                uint64_t reconnects; ///< Failed connections that were replaced
+                uint64_t failures; ///< Connection attempts that failed
+            };
+
+        protected:
+            struct Connection {
+                mongo::DBClientConnection* client = NULL;
+                mongo::GridFS* gridfs = NULL;
+                std::thread::id owner; ///< The thread that used the connection last
+                Clock::time_point checkedAt; ///< Last use or successful ping
+                bool inUse = false;
+                bool failed = false;
+            };
+
+        public:
+            /**
+             * A connection taken from the pool
+             *
+             * The connection is returned when the lease is released or destroyed.
+             */
+            class Lease
+            {
+                friend class ConnectionPool;
+
+                protected:
+                    ConnectionPool* pool;
+                    Connection* connection;
+
+                    inline Lease(ConnectionPool* pool, Connection* connection) : pool(pool), connection(connection) {};
+
+                public:
+                    inline Lease() : pool(NULL), connection(NULL) {};
+                    Lease(Lease&& other);
+                    Lease(const Lease&) = delete;
+                    inline ~Lease()
+                    {
+                        this->release();
+                    };
+
+                    Lease& operator=(Lease&& other);
+                    Lease& operator=(const Lease&) = delete;
+
+                    inline bool valid() const
+                    {
+                        return this->connection != NULL;
+                    }
+
+                    /**
+                     * The pool the connection came from, NULL if released
+                     */
+                    inline ConnectionPool* getPool() const
+                    {
+                        return this->pool;
+                    }
+
+                    mongo::DBClientConnection& getClient();
+                    mongo::GridFS& getGridFS();
+
+                    /**
+                     * Options for queries on this connection (i.e. QueryOption_SlaveOk on
+                     * replica set secondaries)
+                     */
+                    int getQueryOptions() const;
+
+                    /**
+                     * Mark the connection as failed (i.e. after a mongo::DBException)
+                     *
+                     * It is reconnected before it is leased again.
+                     */
+                    void invalidate();
+
+                    /**
+                     * Return the connection to the pool
+                     */
+                    void release();
+            };
+
+        protected:
+            std::string host;
+            std::string database;
+            size_t maxSize;
+            Clock::duration acquireTimeout;
+            std::atomic<int> queryOptions;
+
+            mutable std::mutex mutex;
+            std::condition_variable available;
+            std::list<Connection*> connections;
+            size_t inUse;
+
+            // Metrics
+            std::atomic<size_t> open;
+            std::atomic<uint64_t> acquired;
+            std::atomic<uint64_t> waited;
+            std::atomic<uint64_t> waitTime;
+            std::atomic<uint64_t> maxWaitTime;
+            std::atomic<uint64_t> timeouts;
+            std::atomic<uint64_t> reconnects;
+            std::atomic<uint64_t> failures;
+
+            /**
+             * Connect or check a leased connection (called without the lock)
+             *
+             * @throws IOException if the connection cannot be established
+             */
+            void prepare(Connection* connection);
+
+            void connect(Connection* connection);
+            void disconnect(Connection* connection);
+            bool ping(Connection* connection);
+
+            void release(Connection* connection);
+            void recordWait(Clock::duration wait);
+
+        public:
+            /**
+             * @param[in]  host      The MongoDB host (host[:port])
+             * @param[in]  database  The GridFS database
+             * @param[in]  maxSize   The maximum number of connections
+             */
+            ConnectionPool(const std::string& host, const std::string& database, size_t maxSize = DEFAULT_MAX_SIZE);
+            virtual ~ConnectionPool();
+
+            /**
+             * Take a connection, waiting up to the acquire timeout if all are leased
+             *
+             * @throws TimeoutException if all connections stay leased
+             * @throws IOException if no connection can be established
+             */
+            Lease acquire();
+
+            /**
+             * Open connections ahead of the first requests
+             *
+             * @param[in]  count  The number of connections (at most the pool size)
+             * @return The number of open connections
+             */
+            size_t warmUp(size_t count);
+
+            void setAcquireTimeout(unsigned int msec);
+            void setQueryOptions(int options);
+
+            inline const std::string& getHost() const
+            {
+                return this->host;
+            }
+
+            Metrics getMetrics() const;
+    };
+}
@@ -65,15 +65,35 @@ namespace gfsfcgi
     class ThreadContextViolatedException : public AbstractException
     {
         GFSFCGI_EXCEPTION_CLASSNAME(NullPointerException);
+
+        public:
+            inline ThreadContextViolatedException(const char* reason) : AbstractException(reason) {};
     };
 
     class RuntimeException : public AbstractException
     {
         GFSFCGI_EXCEPTION_CLASSNAME(RuntimeException);
+
+        public:
+            inline RuntimeException(const char* reason) : AbstractException(reason) {};
     };
 
     class IOException : public AbstractException
     {
         GFSFCGI_EXCEPTION_CLASSNAME(IOException);
+
+        public:
+            inline IOException(const char* reason) : AbstractException(reason) {};
+    };
+
+    /**
+     * Exception class thrown when waiting for a resource timed out
+     */
+    class TimeoutException : public IOException
+    {
+        GFSFCGI_EXCEPTION_CLASSNAME(TimeoutException);
+
+        public:
+            inline TimeoutException(const char* reason) : IOException(reason) {};
     };
 };
@@ -1,9 +1,11 @@
 
+#include <algorithm>
 #include <functional>
 #include <regex>
 #include <sstream>
 #include <signal.h>
 #include <unistd.h>
+#include <sys/resource.h>
 
 #include "fastcgi.hpp"
 
@@ -12,66 +14,45 @@
  */
 namespace fastcgi
 {
-    ////////////////////////////////////////////////////////////////////////////77
+    /////////////////////////////////////////////////////////////////////////////////////
     //
-    // Convert Helper functions
+    // libEvent - Helper functions
     //
 
-    template<typename T> T convertToBigEndian(T value);
-    template<typename T> T convertFromBigEndian(T value);
-
-    void swapBytes(char* from, char* to, size_t size)
+    void Client::eventReadCallback(bufferevent* event, void* arg)
     {
-        char* pValue = from - 1;
-        char* pValueEnd = pValue + size;
-        char* pResult = to + size;
-
-        while(pValue != pValueEnd) {
-            *--pResult = *++pValue;
-        }
-    };
-
-    template<> uint16_t convertFromBigEndian<uint16_t> (uint16_t value);
-    template<> uint32_t convertFromBigEndian<uint32_t> (uint32_t value);
-    template<typename T> T convertFromBigEndian(T value)
-    {
-        #if __BYTE_ORDER == __LITTLE_ENDIAN
-            T result;
-            char *ptr = (char*)&result;
-            swapBytes((char*)&value, ptr, sizeof(T));
-            *ptr = *ptr & 0x7f;
-            return result;
-        #elif __BYTE_ORDER == __BIG_ENDIAN
-            return value;
-        #endif
-    };
+        Client* client = (Client*)arg;
+        client->onRead(event);
+    }
 
-    template<> uint16_t convertToBigEndian<uint16_t> (uint16_t value);
-    template<> uint32_t convertToBigEndian<uint32_t> (uint32_t value);
-    template<typename T> T convertToBigEndian(T value)
+    void Client::eventWriteCallback(bufferevent* event, void* arg)
     {
-        #if __BYTE_ORDER == __LITTLE_ENDIAN
-            T result;
-            char *ptr = (char*)&result;
-            swapBytes((char*)&value, ptr, sizeof(T));
-            *ptr = *ptr | 0x80;
+        Client* client = (Client*)arg;
+        client->onWrite(event);
+    }
 
-            return result;
-        #elif __BYTE_ORDER == __BIG_ENDIAN
-            return value;
-        #endif
-    };
+    void Client::eventCallback(bufferevent* event, short events, void* arg)
+    {
+        Client* client = (Client*)arg;
+        client->onEvent(event, events);
+    }
 
+    void Client::eventOutputCallback(evbuffer* /* buffer */, const evbuffer_cb_info* info, void* arg)
+    {
+        Client* client = (Client*)arg;
 
-    /////////////////////////////////////////////////////////////////////////////////////
-    //
-    // libEvent - Helper functions
-    //
+        // Bytes are accounted when queued, only track what left for the socket
+        if (info->n_deleted > 0) {
+            client->bufferedBytes -= info->n_deleted;
+            client->io.admission.removeBufferedBytes(info->n_deleted);
+            client->resumeParked();
+        }
+    }
 
-    void Client::eventReadCallback(bufferevent* event, void* arg)
+    void Client::eventOutboxCallback(evutil_socket_t /* fd */, short /* eventType */, void* arg)
     {
         Client* client = (Client*)arg;
-        client->onRead(event);
+        client->flushOutbox();
     }
 
 
@@ -79,207 +60,139 @@ namespace fastcgi
     // Client Impl
     //
 
-    Client::Client(IOHandler& io, int socket) : io(io),
-            socket(socket),
-            paddingBytesRead(0),
-            headerBytesRead(0),
-            contentBytesRead(0),
-            contentReady(false),
-            headerReady(false),
-            paddingReady(false),
+    Client::Client(IOHandler& io, int socket, Reactor* reactor) : socket(socket),
+            io(io),
+            reactor(reactor),
             isValid(true),
-            keepConnection(true)
+            isClosing(false),
+            outboxEvent(NULL),
+            outboxPending(false),
+            pendingBytes(0),
+            bufferedBytes(0),
+            outputCallback(NULL),
+            keepConnection(true),
+            recordSize(0)
     {
         if (!IOHandler::setNonBlocking(socket)) {
             throw IOException("Failed to make socket fd non-blocking.");
         }
 
-        this->event = bufferevent_socket_new(io.eventBase, socket, BEV_OPT_DEFER_CALLBACKS | BEV_OPT_CLOSE_ON_FREE | BEV_OPT_THREADSAFE);
+        event_base* base = (reactor != NULL)? reactor->getEventBase() : io.eventBase;
+        this->outboxEvent = event_new(base, -1, 0, Client::eventOutboxCallback, this);
+
+        if (this->outboxEvent == NULL) {
+            throw IOException("Failed to allocate outbox event for client");
+        }
+
+        this->event = io.backend->open(base, socket);
 
         if (this->event == NULL) {
+            event_free(this->outboxEvent);
             throw IOException("Failed to allocate event buffer for client");
         }
 
-        bufferevent_setcb(this->event, Client::eventReadCallback, NULL, NULL, this);
-        bufferevent_enable(this->event, EV_READ|EV_WRITE);
+        // Keep the bufferevent valid until destruction, so writers can reference it
+        // without a lock after the connection was closed
+        bufferevent_incref(this->event);
+
+        if (reactor != NULL) {
+            reactor->attach();
+        }
+
+        bufferevent_setcb(this->event, Client::eventReadCallback, Client::eventWriteCallback, Client::eventCallback, this);
+        bufferevent_setwatermark(this->event, EV_READ, FCGI_HEADER_LEN, 0);
+        bufferevent_setwatermark(this->event, EV_WRITE, OUTPUT_WINDOW / 2, 0);
+        this->outputCallback = evbuffer_add_cb(bufferevent_get_output(this->event), Client::eventOutputCallback, this);
     }
 
     Client::~Client()
     {
         this->destroy();
-    }
-
-    /////////////////////////////////////////////////////////////////
-    // Incomming record preparation (possible big endian conversion)
-    //
-
-    //! Specialization for header segment
-    template<> void Client::prepareInRecordSegment<protocol::Header>(protocol::Header& segment) {
-        segment.contentLength = convertFromBigEndian(segment.contentLength);
-        segment.requestId = convertFromBigEndian(segment.contentLength);
-    };
 
-    //! Specialization for BeginRequestBody
-    template<> void Client::prepareInRecordSegment<protocol::BeginRequestBody>(protocol::BeginRequestBody& body)
-    {
-        body.role = convertFromBigEndian(body.role);
-    };
+        // Nobody writes anymore, but the loop may not have run since the last write
+        this->discardOutbox();
+        event_free(this->outboxEvent);
 
-    //! Specialization for EndRequestBody
-    template<> void Client::prepareInRecordSegment<protocol::EndRequestBody>(protocol::EndRequestBody& segment)
-    {
-        segment.appStatus = convertFromBigEndian(segment.appStatus);
-    };
+        for (auto& queue : this->outputQueues) {
+            evbuffer_free(queue.second.buffer);
+        }
 
-    //! Default implementation
-    template<class T> void Client::prepareInRecordSegment(T& segment)
-    {
-        // NOOP
+        this->outputQueues.clear();
+        bufferevent_decref(this->event);
     }
 
-
-    /////////////////////////////////////////////////////////////////
-    // Outgoing record preparation (possible big endian conversion)
-    //
-
-    template<> void Client::prepareOutRecordSegment<protocol::Header>(protocol::Header& segment) {
-        segment.contentLength = convertToBigEndian(segment.contentLength);
-        segment.requestId = convertToBigEndian(segment.contentLength);
-    };
-
-    template<> void Client::prepareOutRecordSegment<protocol::BeginRequestBody>(protocol::BeginRequestBody& body)
-    {
-        body.role = convertToBigEndian(body.role);
-    };
-
-    template<> void Client::prepareOutRecordSegment<protocol::EndRequestBody>(protocol::EndRequestBody& segment)
+    void Client::start()
     {
-        segment.appStatus = convertToBigEndian(segment.appStatus);
-    };
+        bufferevent* event = this->acquireEvent();
 
-    template<> void Client::prepareOutRecordSegment<protocol::EndRequestRecord>(protocol::EndRequestRecord& segment)
-    {
-        prepareOutRecordSegment(segment.header);
-        prepareOutRecordSegment(segment.body);
-    }
+        if (event == NULL) {
+            return;
+        }
 
-    template<class T> void Client::prepareOutRecordSegment(T& segment)
-    {
+        this->io.backend->start(event);
+        bufferevent_decref(event);
     }
 
-
     /**
-     * Header extraction from data pointer
+     * Record extraction from the input buffer
      */
-    char* Client::extractHeader(char *ptr, size_t &size)
+    bool Client::extractRecord(bufferevent* event)
     {
-        if (this->headerReady) {
-            return ptr;
-        }
-
-        size_t reqBytes = sizeof(this->currentRecord.header) - this->headerBytesRead;
-        char* pTo = (char*)&this->currentRecord.header;
-
-        if (this->headerBytesRead > 0) {
-            pTo += this->headerBytesRead;
-        }
-
-        if (reqBytes < size) {
-            memcpy(pTo, ptr, reqBytes);
-            ptr += reqBytes;
-            size -= reqBytes;
-            this->headerBytesRead += reqBytes;
-        } else {
-            memcpy(pTo, ptr, size);
-            this->headerBytesRead += size;
-            size = 0;
-        }
+        evbuffer* input = bufferevent_get_input(event);
+        size_t available = evbuffer_get_length(input);
 
-        if (this->headerBytesRead >= sizeof(this->currentRecord.header)) {
-            this->headerReady = true;
+        if (available < FCGI_HEADER_LEN) {
+            return false;
         }
 
-        return ptr;
-    };
+        protocol::Header& header(this->currentRecord.header);
+        evbuffer_iovec segment;
 
-    /**
-     * Content extraction from data pointer
-     */
-    char* Client::extractContent(char* buffer, size_t& size)
-    {
-        if (!this->headerReady || (size <= 0)) {
-            return buffer;
+        // Decode the header in place unless it spans buffer segments
+        if ((evbuffer_peek(input, FCGI_HEADER_LEN, NULL, &segment, 1) > 0) && (segment.iov_len >= FCGI_HEADER_LEN)) {
+            memcpy(&header, segment.iov_base, FCGI_HEADER_LEN);
+        } else {
+            evbuffer_copyout(input, &header, FCGI_HEADER_LEN);
         }
 
-        if (this->currentRecord.header.contentLength == 0) {
-            this->contentReady = true;
-            return buffer;
-        }
+        header = protocol::decode(header);
+        this->recordSize = FCGI_HEADER_LEN + header.contentLength + header.paddingLength;
 
-        if (this->currentRecord.content == NULL) {
-            this->currentRecord.content = new char[this->currentRecord.header.contentLength];
+        if (available < this->recordSize) {
+            // Don't wake up again until the whole record arrived
+            bufferevent_setwatermark(event, EV_READ, this->recordSize, 0);
+            return false;
         }
 
-        char* pTo = this->currentRecord.content;
-        size_t reqSize = this->currentRecord.header.contentLength - this->contentBytesRead;
+        if (header.contentLength > 0) {
+            // Only linearizes the buffer when the record spans multiple segments
+            unsigned char* data = evbuffer_pullup(input, FCGI_HEADER_LEN + header.contentLength);
 
-        if (this->contentBytesRead) {
-            pTo += this->contentBytesRead;
-        }
-
-        if (size > reqSize) {
-            memcpy(pTo, buffer, reqSize);
-            buffer += reqSize;
-            size -= reqSize;
-            this->contentBytesRead += reqSize;
-        } else {
-            memcpy(pTo, buffer, size);
-            size = 0;
-            this->contentBytesRead += size;
-        }
+            if (data == NULL) {
+                throw IOException("Failed to access record content in the input buffer");
+            }
 
-        if (this->contentBytesRead >= this->currentRecord.header.contentLength) {
-            this->contentReady = true;
+            this->currentRecord.content = (const char*)data + FCGI_HEADER_LEN;
         }
 
-        return buffer;
+        return true;
     };
 
     /**
-     * Padding extraction from header
+     * Drop the current record from the input buffer
      */
-    char* Client::extractPadding(char* buffer, size_t& size)
+    void Client::consumeRecord(bufferevent* event)
     {
-        if (!this->headerReady || !this->contentReady || (size <= 0)) {
-            return buffer;
-        }
-
-        size_t padSize = this->currentRecord.header.paddingLength - this->paddingBytesRead;
-
-        if (size >= padSize) {
-            if (padSize && (size > padSize)) {
-                buffer += padSize;
-            }
-
-            size -= padSize;
-            this->paddingReady = true;
-        } else {
-            this->paddingBytesRead += size;
-            size = 0;
-        }
+        evbuffer_drain(bufferevent_get_input(event), this->recordSize);
+        bufferevent_setwatermark(event, EV_READ, FCGI_HEADER_LEN, 0);
 
-        return buffer;
-    };
+        this->resetRecordState();
+    }
 
     void Client::dispatch()
     {
         if (this->currentRecord.header.type == FCGI_GET_VALUES) {
-            streams::OutStream s(ClientPtr(this), FCGI_NULL_REQUEST_ID, streams::OutStreamBuffer::role_t::VALUES_RESULT);
-
-            protocol::Variable _var(FCGI_MPXS_CONNS, "1");
-            s << _var;
-            s.close();
-
+            this->sendValues();
             return;
         }
 
@@ -292,8 +205,6 @@ namespace fastcgi
             return;
         }
 
-        // FIXME: Race contition
-
         if (this->currentRecord.header.type == FCGI_BEGIN_REQUEST) {
             if (this->hasRequest(id)) {
                 std::ostringstream msg;
@@ -305,51 +216,98 @@ namespace fastcgi
                 throw IOSegmentViolationException("Bad content length for begin request record!");
             }
 
-            protocol::BeginRequestBody* body = (protocol::BeginRequestBody*)this->currentRecord.content;
-            prepareInRecordSegment(*body);
+            protocol::BeginRequestBody body;
+            memcpy(&body, this->currentRecord.content, sizeof(body));
+            body = protocol::decode(body);
 
-            if (!this->io.isRoleAccepted(body->role)) {
+            if (!this->io.isRoleAccepted(body.role)) {
                 // TODO: unaccepted role
                 return;
             }
 
-            if ((body->flags & FCGI_KEEP_CONN) == 0) {
-                this->keepConnection = false;
+            // The flag applies per request, the server may change its mind on the next one
+            this->keepConnection = ((body.flags & FCGI_KEEP_CONN) != 0);
+
+            if (!this->io.admission.admit()) {
+                // Let the web server fail over instead of queueing behind us
+                protocol::EndRequestMessage overloaded(id, 0, FCGI_OVERLOADED);
+                this->write(overloaded);
+
+                return;
             }
 
-            this->requests[id] = std::make_shared<Request>(id, body->role, *this);
-            this->requests[id]->setHandler(this->io.getHandlerFactory(body->role)->factory(*this->requests[id]));
+            RequestPtr request = std::make_shared<Request>(id, (Request::Role)body.role, this->shared_from_this());
+            request->setHandler(this->io.getHandlerFactory(body.role)->factory(*request));
+
+            std::lock_guard<std::mutex> lock(this->requestsMutex);
+            this->requests[id] = request;
 
             return;
         }
 
-        if (!this->hasRequest(id)) {
-            std::ostringstream msg;
-            msg << "Request (" << id << ") was not started with FCGI_BEGIN_REQUEST";
-            throw IOSegmentViolationException(msg.str());
+        // Keep a reference, the request may finish while processing the record
+        RequestPtr request = this->getRequest(id);
+
+        // The handler may finish before the web server sent the rest of the request
+        // (i.e. the empty STDIN record), records of inactive requests are ignored
+        if (request == NULL) {
+            return;
         }
 
-        this->requests[id]->processIncommingRecord(this->currentRecord);
+        bool wasReady = request->ready;
+        request->processIncommingRecord(this->currentRecord);
+
+        if (!wasReady && request->ready && request->isValid()) {
+            this->io.schedule(request);
+        }
     };
 
     /**
-     * reset the record state
+     * Answer the requested management variables
      */
-    void Client::resetRecordState()
+    void Client::sendValues()
     {
-        if (this->currentRecord.content != NULL) {
-            delete[] this->currentRecord.content;
+        std::string result;
+        protocol::ParamsDecoder requested;
+
+        requested.append(this->currentRecord.content, this->currentRecord.header.contentLength);
+        requested.finish();
+
+        for (size_t i = 0; i < requested.size(); i++) {
+            std::string name = requested.name(i).str();
+            std::ostringstream value;
+
+            if (name == FCGI_MAX_CONNS) {
+                value << this->io.admission.getMaxConnections();
+            } else if (name == FCGI_MAX_REQS) {
+                value << this->io.admission.getMaxRequests();
+            } else if (name == FCGI_MPXS_CONNS) {
+                value << 1;
+            } else {
+                // Unknown variables are omitted from the reply
+                continue;
+            }
+
+            protocol::Variable answer(name, value.str());
+            size_t offset = result.size();
+
+            result.resize(offset + answer.getSize());
+            answer.putData(&result[offset]);
         }
 
-        memset(&this->currentRecord, 0, sizeof(this->currentRecord));
+        protocol::GenericMessage message(FCGI_NULL_REQUEST_ID, FCGI_GET_VALUES_RESULT, result.data(), result.size());
+        this->write(message);
+    }
+
+    /**
+     * reset the record state
+     */
+    void Client::resetRecordState()
+    {
+        memset(&this->currentRecord.header, 0, sizeof(this->currentRecord.header));
 
         this->currentRecord.content = NULL;
-        this->headerReady = false;
-        this->contentReady = false;
-        this->paddingReady = false;
-        this->headerBytesRead = 0;
-        this->contentBytesRead = 0;
-        this->paddingBytesRead = 0;
+        this->recordSize = 0;
     }
 
     /**
@@ -361,36 +319,103 @@ namespace fastcgi
             return;
         }
 
-        char buffer[1024];
-        size_t size = 0;
-
-        while ((0 < (size = (size_t)bufferevent_read(event, (void*)&buffer, 1024))) && this->valid()) {
-            char *pFrom = (char*)&buffer;
-
-            while (size && this->valid()) {
-                pFrom = this->extractHeader(pFrom, size);
-                pFrom = this->extractContent(pFrom, size);
-                pFrom = this->extractPadding(pFrom, size);
-
-                if (this->paddingReady) {
-                    try {
-                        this->dispatch();
-                    } catch (IOException& e) {
-                        std::cerr << "Client (" << this->socket << "): IOException: " << e.what() << std::endl;
-                        this->destroy();
-                        return;
-                    }
-
-                    this->resetRecordState();
-                }
+        // libevent holds a reference on the bufferevent while the callback runs,
+        // even if a worker destroys this client concurrently
+        try {
+            while (this->valid() && this->extractRecord(event)) {
+                this->dispatch();
+                this->consumeRecord(event);
             }
+        } catch (IOException& e) {
+            std::cerr << "Client (" << this->socket << "): IOException: " << e.what() << std::endl;
+            this->destroy();
         }
     };
 
     bool Client::hasRequest(uint16_t id)
     {
+        return (this->getRequest(id) != NULL);
+    }
+
+    RequestPtr Client::getRequest(uint16_t id)
+    {
+        std::lock_guard<std::mutex> lock(this->requestsMutex);
         auto result = this->requests.find(id);
-        return ((result != this->requests.end()) && (result->second != NULL) && result->second->isValid());
+
+        if ((result == this->requests.end()) || (result->second == NULL) || !result->second->isValid()) {
+            return RequestPtr();
+        }
+
+        return result->second;
+    }
+
+    /**
+     * Output buffer drained below the low watermark
+     */
+    void Client::onWrite(bufferevent* event)
+    {
+        this->pumpOutput(event);
+
+        if (this->isClosing && this->isFlushed(event)) {
+            this->destroy();
+        }
+    }
+
+    /**
+     * Connection closed by the web server or failed
+     */
+    void Client::onEvent(bufferevent* /* event */, short events)
+    {
+        // Nobody is left to receive the output, running requests are cancelled
+        if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+            this->destroy();
+        }
+    }
+
+    /**
+     * Reset the per-request state after END_REQUEST
+     */
+    void Client::onEndRequest(uint16_t id)
+    {
+        bool idle = false;
+
+        {
+            // Pending handler callbacks hold their own reference to the request
+            std::lock_guard<std::mutex> lock(this->requestsMutex);
+            this->io.admission.release(this->requests.erase(id));
+            idle = this->requests.empty();
+        }
+
+        // Multiplexed requests may still be running on this connection
+        if (!this->keepConnection && idle) {
+            this->closeWhenFlushed();
+        }
+    }
+
+    /**
+     * Defer closing the connection until all output is sent
+     */
+    void Client::closeWhenFlushed()
+    {
+        bufferevent* event = this->acquireEvent();
+
+        if (event == NULL) {
+            return;
+        }
+
+        bufferevent_lock(event);
+
+        this->isClosing = true;
+        bufferevent_disable(event, EV_READ);
+        bool flushed = this->isFlushed(event);
+
+        bufferevent_unlock(event);
+        bufferevent_decref(event);
+
+        // Otherwise the write callback closes the connection once the output is drained
+        if (flushed) {
+            this->destroy();
+        }
     }
 
     /**
@@ -398,19 +423,46 @@ namespace fastcgi
      */
     void Client::destroy()
     {
-        std::lock_guard<std::mutex> guard(this->socketMutex);
+        bufferevent* event = this->event;
+        std::list<WorkerCallbackPtr> parked;
 
-        this->isValid = false;
-        this->resetRecordState();
+        // The socket is closed by the first call, writers may still hold a reference
+        if (this->isValid.exchange(false)) {
+            bufferevent_lock(event);
+
+            // No more output, release what was never sent
+            this->isClosing = true;
+            evbuffer_remove_cb_entry(bufferevent_get_output(event), this->outputCallback);
+            this->io.admission.removeBufferedBytes(this->bufferedBytes);
+            this->bufferedBytes = 0;
+
+            // Parked handlers hold their request, drop them outside the lock
+            parked.swap(this->parked);
+
+            bufferevent_unlock(event);
+
+            bufferevent_disable(event, EV_READ | EV_WRITE);
+            this->io.backend->close(event);
+
+            if (this->reactor != NULL) {
+                this->reactor->detach();
+            }
+
+            this->io.admission.disconnect();
+        }
+
+        // Requests reference their client, break the cycle
+        std::lock_guard<std::mutex> lock(this->requestsMutex);
 
-        if (this->event != NULL) {
-            bufferevent_disable(this->event, EV_READ | EV_WRITE);
-            bufferevent_free(this->event);
-            this->event = NULL;
+        for (auto& entry : this->requests) {
+            entry.second->cancel();
         }
+
+        this->io.admission.release(this->requests.size());
+        this->requests.clear();
     }
 
-    void Client::eventGcCallback(int fd, short eventType, void* ptr)
+    void Client::eventGcCallback(int /* fd */, short /* eventType */, void* ptr)
     {
         ((Client*)ptr)->gc();
     }
@@ -418,13 +470,14 @@ namespace fastcgi
     // Perform garbage collection
     void Client::gc()
     {
-        // FIXME: Race condition
+        std::lock_guard<std::mutex> lock(this->requestsMutex);
 
         auto iterator = this->requests.begin();
 
         while (iterator != this->requests.end()) {
             if ((iterator->second == NULL) || !iterator->second->isValid()) {
                 this->requests.erase(iterator++);
+                this->io.admission.release();
             } else {
                 iterator++;
             }
@@ -432,523 +485,1914 @@ namespace fastcgi
     }
 
     /**
-     * Write chunk implementation
+     * Zero block used for record padding (paddingLength is a single byte)
      */
-    void Client::write(protocol::Message &message)
+    static const char recordPadding[256] = { 0 };
+
+    /**
+     * Append vectors to an evbuffer
+     *
+     * evbuffer_add_iovec() returns the number of bytes added, so a failure shows as a short count
+     */
+    static void addVectors(evbuffer* target, evbuffer_iovec* vectors, int count)
     {
-        std::unique_lock<std::mutex> guard(this->socketMutex);
-        guard.lock();
+        size_t size = 0;
 
-        if (!this->valid()) {
-            return;
+        for (int i = 0; i < count; i++) {
+            size += vectors[i].iov_len;
         }
 
-        const char *raw = message.raw();
-        if (raw != NULL) {
-            bufferevent_write(this->event, raw, message.getSize());
-            return;
+        if (evbuffer_add_iovec(target, vectors, count) != size) {
+            throw IOException("Failed to append records to the output buffer");
         }
+    }
 
-        protocol::Header header = message.getHeader();
-        header.version = FCGI_VERSION_1;
-        prepareOutRecordSegment(header);
-
-        bufferevent_write(this->event, &header, sizeof(header));
+    /**
+     * Frame messages as a single vectored append
+     */
+    void Client::frameMessages(evbuffer* target, protocol::Message* const* messages, size_t count, std::vector<size_t>* records)
+    {
+        const size_t batchSize = 32;
 
-        if (message.getContentSize()) {
-            bufferevent_write(this->event, message.getData(), message.getContentSize());
-        }
+        protocol::Header headers[batchSize];
+        evbuffer_iovec vectors[batchSize * 3];
 
-        if (message.getPaddingSize()) {
-            char* padding = new char[message.getPaddingSize()];
-            memset(padding, 0, message.getPaddingSize());
+        while (count > 0) {
+            size_t n = (count > batchSize)? batchSize : count;
+            int vectorCount = 0;
 
-            bufferevent_write(this->event, padding, message.getPaddingSize());
-            delete [] padding;
-        }
+            for (size_t i = 0; i < n; i++) {
+                protocol::Message& message(*messages[i]);
+                const char *raw = message.raw();
 
-        guard.unlock();
+                if (records != NULL) {
+                    records->push_back(message.getSize());
+                }
 
-        if (message.getHeader().type == FCGI_END_REQUEST) {
-            this->destroy();
-        }
-    };
+                if (raw != NULL) {
+                    vectors[vectorCount].iov_base = (void*)raw;
+                    vectors[vectorCount++].iov_len = message.getSize();
+                    continue;
+                }
 
-    ///////////////////////////////////////////////////
-    // Request Impl
-    //
-    void Request::processIncommingRecord(const protocol::Record& record)
-    {
-        if (!this->valid) {
-            return;
-        }
+                headers[i] = message.getHeader();
+                headers[i].version = FCGI_VERSION_1;
+                headers[i] = protocol::encode(headers[i]);
 
-        streams::InStreamBuffer* buf = NULL;
+                vectors[vectorCount].iov_base = &headers[i];
+                vectors[vectorCount++].iov_len = sizeof(headers[i]);
 
-        switch (record.header.type) {
-            case FCGI_ABORT_REQUEST:
-                this->valid = true;
-                break;
+                protocol::ContentReference* reference = message.getContentReference();
 
-            case FCGI_PARAMS:
-                buf = dynamic_cast<streams::InStreamBuffer*>(this->paramStream.rdbuf());
-                if (buf == NULL) {
-                    break;
-                }
+                if ((reference != NULL) && message.getContentSize()) {
+                    // Flush what we have, the content is linked in place
+                    addVectors(target, vectors, vectorCount);
 
-                buf->addChunk(record);
+                    vectorCount = 0;
+                    reference->acquire();
 
-                if (this->paramStream.isReady()) {
-                    for (auto p : protocol::Variable::parseFromStream(this->paramStream)) {
-                        this->params[p.name()] = p.value();
+                    if (evbuffer_add_reference(target, message.getData(), message.getContentSize(), protocol::ContentReference::cleanup, reference) != 0) {
+                        reference->release();
+                        throw IOException("Failed to append records to the output buffer");
                     }
+                } else if (message.getContentSize()) {
+                    vectors[vectorCount].iov_base = (void*)message.getData();
+                    vectors[vectorCount++].iov_len = message.getContentSize();
+                }
 
-                    this->ready = true;
+                if (message.getPaddingSize()) {
+                    vectors[vectorCount].iov_base = (void*)recordPadding;
+                    vectors[vectorCount++].iov_len = message.getPaddingSize();
                 }
+            }
 
-                break;
+            addVectors(target, vectors, vectorCount);
 
-            case FCGI_STDIN: // break intentionally omitted
-            case FCGI_DATA:
-                if (!this->ready) {
-                    std::ostringstream msg;
-                    msg << "Invalid stream record order. FastCGI PARAMS is not complete, yet - thus the request is not ready.";
-                    throw IOSegmentViolationException(msg.str());
-                }
+            messages += n;
+            count -= n;
+        }
+    }
 
-                buf = (record.header.type == FCGI_STDIN)?
-                    dynamic_cast<streams::InStreamBuffer*>(this->_stdin.rdbuf()) :
-                    dynamic_cast<streams::InStreamBuffer*>(this->_datain.rdbuf());
+    /**
+     * Queue a batch per request
+     */
+    void Client::queueBatch(bufferevent* event, OutputBatch& batch)
+    {
+        evbuffer* output = bufferevent_get_output(event);
+        auto queue = this->outputQueues.find(batch.requestId);
 
-                if (buf == NULL) {
-                    break;
-                }
+        this->bufferedBytes += evbuffer_get_length(batch.buffer);
 
-                buf->addChunk(record);
+        if (this->outputSchedule.empty() && (evbuffer_get_length(output) < OUTPUT_WINDOW)) {
+            // Nobody is waiting for the socket: write through (chains are moved, not copied)
+            evbuffer_add_buffer(output, batch.buffer);
 
-                if (this->handler != NULL) {
-                    this->handler->onReceiveData(record);
-                }
+            if (batch.ended && (queue != this->outputQueues.end())) {
+                evbuffer_free(queue->second.buffer);
+                this->outputQueues.erase(queue);
+            }
 
-                break;
+            return;
+        }
 
-            case FCGI_ABORT_REQUEST:
-                if (this->handler) {
-                    this->handler->onAbort();
-                } else {
-                    this->finish(1);
-                }
+        if (queue == this->outputQueues.end()) {
+            queue = this->outputQueues.insert(std::make_pair(batch.requestId, OutputQueue())).first;
+            queue->second.buffer = evbuffer_new();
+        }
 
-                break;
+        OutputQueue& pending(queue->second);
 
-            default:
+        if (pending.records.empty()) {
+            this->outputSchedule.push_back(batch.requestId);
+        }
+
+        evbuffer_add_buffer(pending.buffer, batch.buffer);
+
+        for (auto size : batch.records) {
+            pending.records.push(size);
+        }
+
+        pending.ended = batch.ended;
+    }
+
+    /**
+     * Drain the outbox on the owning loop
+     */
+    void Client::flushOutbox()
+    {
+        // Clear first, writers pushing from now on wake us up again
+        this->outboxPending = false;
+
+        bufferevent* event = this->acquireEvent();
+        std::vector<uint16_t> ended;
+        OutputBatch* batch;
+
+        if (event == NULL) {
+            this->discardOutbox();
+            return;
+        }
+
+        bufferevent_lock(event);
+
+        while ((batch = this->outbox.pop()) != NULL) {
+            size_t size = evbuffer_get_length(batch->buffer);
+            this->pendingBytes -= size;
+
+            if (this->isClosing) {
+                this->io.admission.removeBufferedBytes(size);
+            } else {
+                this->queueBatch(event, *batch);
+            }
+
+            if (batch->ended) {
+                ended.push_back(batch->requestId);
+            }
+
+            OutputBatchPool::release(batch);
+        }
+
+        this->pumpOutput(event);
+
+        bufferevent_unlock(event);
+        bufferevent_decref(event);
+
+        for (auto id : ended) {
+            this->onEndRequest(id);
+        }
+    }
+
+    /**
+     * Drop queued output of a closed connection
+     */
+    void Client::discardOutbox()
+    {
+        OutputBatch* batch;
+
+        while ((batch = this->outbox.pop()) != NULL) {
+            size_t size = evbuffer_get_length(batch->buffer);
+
+            this->pendingBytes -= size;
+            this->io.admission.removeBufferedBytes(size);
+
+            OutputBatchPool::release(batch);
+        }
+    }
+
+    /**
+     * Move queued records to the socket (round robin, one record per request and turn)
+     */
+    void Client::pumpOutput(bufferevent* event)
+    {
+        evbuffer* output = bufferevent_get_output(event);
+
+        while (!this->outputSchedule.empty() && (evbuffer_get_length(output) < OUTPUT_WINDOW)) {
+            uint16_t id = this->outputSchedule.front();
+            this->outputSchedule.pop_front();
+
+            auto queue = this->outputQueues.find(id);
+
+            if (queue == this->outputQueues.end()) {
+                continue;
+            }
+
+            OutputQueue& pending(queue->second);
+
+            evbuffer_remove_buffer(pending.buffer, output, pending.records.front());
+            pending.records.pop();
+
+            if (!pending.records.empty()) {
+                this->outputSchedule.push_back(id);
+            } else if (pending.ended) {
+                evbuffer_free(pending.buffer);
+                this->outputQueues.erase(queue);
+            }
+        }
+    }
+
+    /**
+     * Check if all output was sent
+     */
+    bool Client::isFlushed(bufferevent* event)
+    {
+        return this->outputSchedule.empty() && (evbuffer_get_length(bufferevent_get_output(event)) == 0);
+    }
+
+    /**
+     * Resume parked handlers
+     */
+    void Client::resumeParked()
+    {
+        if (this->parked.empty() || ((this->bufferedBytes + this->pendingBytes) > this->io.outputLowWatermark)) {
+            return;
+        }
+
+        for (auto& callback : this->parked) {
+            this->io.workerQueue.push(callback);
+        }
+
+        this->parked.clear();
+    }
+
+    /**
+     * Park a handler until the output drained
+     */
+    bool Client::park(WorkerCallbackPtr callback)
+    {
+        if (this->io.outputHighWatermark == 0) {
+            return false;
+        }
+
+        bufferevent* event = this->acquireEvent();
+
+        // Connection is gone, let the handler finish
+        if (event == NULL) {
+            return false;
+        }
+
+        bufferevent_lock(event);
+
+        bool park = !this->isClosing && ((this->bufferedBytes + this->pendingBytes) > this->io.outputHighWatermark);
+
+        if (park) {
+            this->parked.push_back(callback);
+        }
+
+        bufferevent_unlock(event);
+        bufferevent_decref(event);
+
+        return park;
+    }
+
+    void Client::wake(WorkerCallbackPtr callback)
+    {
+        this->io.workerQueue.push(callback);
+    }
+
+    int Client::getNode() const
+    {
+        return (this->reactor != NULL)? this->reactor->getNode() : -1;
+    }
+
+    /**
+     * Get a referenced bufferevent for writing
+     */
+    bufferevent* Client::acquireEvent()
+    {
+        if (!this->isValid) {
+            return NULL;
+        }
+
+        // Valid until destruction, the connection may be closed meanwhile (see isClosing)
+        bufferevent_incref(this->event);
+        return this->event;
+    }
+
+    /**
+     * Write chunk implementation
+     */
+    void Client::write(protocol::Message &message)
+    {
+        protocol::Message* messages[] = { &message };
+        this->write(messages, 1);
+    };
+
+    /**
+     * Write multiple messages at once
+     */
+    void Client::write(const std::vector<protocol::Message*>& messages)
+    {
+        this->write(messages.data(), messages.size());
+    };
+
+    /**
+     * Frame messages and hand them to the owning loop
+     */
+    void Client::write(protocol::Message* const* messages, size_t count)
+    {
+        if ((count == 0) || !this->isValid) {
+            return;
+        }
+
+        while (count > 0) {
+            // One batch per run of records of the same request
+            uint16_t id = messages[0]->getHeader().requestId;
+            size_t n = 1;
+
+            while ((n < count) && (messages[n]->getHeader().requestId == id)) {
+                n++;
+            }
+
+            // Recycled with its buffer, framing allocates nothing once the pool is warm
+            OutputBatch* batch = OutputBatchPool::acquire();
+            batch->requestId = id;
+            batch->ended = (messages[n - 1]->getHeader().type == FCGI_END_REQUEST);
+
+            try {
+                if (batch->buffer == NULL) {
+                    throw IOException("Failed to allocate output buffer");
+                }
+
+                this->frameMessages(batch->buffer, messages, n, &batch->records);
+            } catch (...) {
+                OutputBatchPool::release(batch);
+                throw;
+            }
+
+            size_t size = evbuffer_get_length(batch->buffer);
+
+            this->pendingBytes += size;
+            this->io.admission.addBufferedBytes(size);
+            this->outbox.push(batch);
+
+            messages += n;
+            count -= n;
+        }
+
+        if (!this->outboxPending.exchange(true)) {
+            event_active(this->outboxEvent, EV_WRITE, 0);
+        }
+    };
+
+    ///////////////////////////////////////////////////
+    // Request Impl
+    //
+    void Request::processIncommingRecord(const protocol::Record& record)
+    {
+        if (!this->valid) {
+            return;
+        }
+
+        streams::InStreamBuffer* buf = NULL;
+
+        switch (record.header.type) {
+            case FCGI_PARAMS:
+                // Decoded incrementally, an empty record terminates the stream
+                if (record.header.contentLength > 0) {
+                    this->params.append(record.content, record.header.contentLength);
+                    break;
+                }
+
+                this->params.finish();
+                this->ready = true;
+
+                break;
+
+            case FCGI_STDIN: // break intentionally omitted
+            case FCGI_DATA:
+                if (!this->ready) {
+                    std::ostringstream msg;
+                    msg << "Invalid stream record order. FastCGI PARAMS is not complete, yet - thus the request is not ready.";
+                    throw IOSegmentViolationException(msg.str());
+                }
+
+                buf = (record.header.type == FCGI_STDIN)?
+                    dynamic_cast<streams::InStreamBuffer*>(this->_stdin.rdbuf()) :
+                    dynamic_cast<streams::InStreamBuffer*>(this->_datain.rdbuf());
+
+                if (buf == NULL) {
+                    break;
+                }
+
+                buf->addChunk(record);
+
+                if (this->handler != NULL) {
+                    this->handler->onReceiveData(record);
+                }
+
+                this->resume(Wait::INPUT);
+                break;
+
+            case FCGI_ABORT_REQUEST:
+                if (this->handler) {
+                    this->handler->onAbort();
+                } else {
+                    this->finish(1);
+                }
+
+                break;
+
+            default:
                 // Ignore unknown records. Is this a good idea?
                 break;
         }
     }
 
-    Request::Request(const uint16_t& id, Role role, ClientPtr client) :
-            client(client),
-            id(id),
-            role(role),
-            valid(false),
-            ready(false),
-            handler(NULL),
-            paramStream(*this),
-            _stdin(*this),
-            _datain(*this),
-            _stdout(*this, streams::OutStreamBuffer::role_t::STDOUT),
-            _stderr(*this, streams::OutStreamBuffer::role_t::STDERR)
+    Request::Request(const uint16_t& id, Role role, ClientPtr client) :
+            id(id),
+            client(client),
+            role(role),
+            valid(true),
+            ready(false),
+            _stdin(*this),
+            _datain(*this),
+            _stdout(*this, streams::OutStreamBuffer::role_t::STDOUT),
+            _stderr(*this, streams::OutStreamBuffer::role_t::STDERR),
+            handler(NULL),
+            waiting(Wait::NONE),
+            inputCount(0),
+            inputSeen(0),
+            signalToken(0),
+            signalled(false),
+            cancelled(false)
+    {
+    }
+
+    Request::~Request()
+    {
+    }
+
+
+    void Request::setHandler(RequestHandlerPtr handler)
+    {
+        this->handler = handler;
+    }
+
+    bool Request::handle()
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->suspendMutex);
+
+            if (this->cancelled) {
+                return true;
+            }
+
+            this->waiting = Wait::NONE;
+            this->inputSeen = this->inputCount;
+        }
+
+        if (!this->valid || (this->handler == NULL)) {
+            return true;
+        }
+
+        return this->handler->handle();
+    }
+
+    void Request::await(Wait wait)
+    {
+        std::lock_guard<std::mutex> lock(this->suspendMutex);
+        this->waiting = wait;
+    }
+
+    Resumer Request::awaitSignal()
+    {
+        std::lock_guard<std::mutex> lock(this->suspendMutex);
+
+        this->waiting = Wait::SIGNAL;
+        this->signalled = false;
+
+        uint32_t token = ++this->signalToken;
+        RequestPtr self = this->shared_from_this();
+
+        return [self, token]() {
+            self->resume(Wait::SIGNAL, token);
+        };
+    }
+
+    bool Request::suspend(WorkerCallbackPtr callback)
+    {
+        std::unique_lock<std::mutex> lock(this->suspendMutex);
+
+        switch (this->waiting) {
+            case Wait::INPUT:
+                // Input that arrived during the last handle() call was not seen
+                if (this->cancelled || (this->inputCount != this->inputSeen)) {
+                    return false;
+                }
+
+                break;
+
+            case Wait::SIGNAL:
+                if (this->cancelled || this->signalled) {
+                    return false;
+                }
+
+                break;
+
+            default:
+                // Slow client: wait for the output to drain instead of spinning
+                lock.unlock();
+                return this->client->park(callback);
+        }
+
+        this->suspended = callback;
+        return true;
+    }
+
+    void Request::resume(Wait reason, uint32_t token)
+    {
+        WorkerCallbackPtr callback;
+
+        {
+            std::lock_guard<std::mutex> lock(this->suspendMutex);
+
+            if (reason == Wait::INPUT) {
+                this->inputCount++;
+            }
+
+            if ((reason != Wait::NONE) && (reason != this->waiting)) {
+                return;
+            }
+
+            if ((reason == Wait::SIGNAL) && (token != this->signalToken)) {
+                return;
+            }
+
+            if (this->suspended == NULL) {
+                // The handler did not return yet
+                this->signalled = (reason == Wait::SIGNAL) || this->signalled;
+                return;
+            }
+
+            callback.swap(this->suspended);
+            this->waiting = Wait::NONE;
+        }
+
+        this->client->wake(callback);
+    }
+
+    void Request::cancel()
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->suspendMutex);
+            this->cancelled = true;
+        }
+
+        this->resume(Wait::NONE);
+    }
+
+    void Request::send(protocol::Message& msg)
+    {
+        this->client->write(msg);
+    }
+
+    // Finish the request
+    void Request::finish(uint32_t status)
+    {
+        if (!this->valid) {
+            return;
+        }
+
+        // Stream EOF records must precede END_REQUEST
+        this->_datain.close();
+        this->_stdin.close();
+        this->_stderr.close();
+        this->_stdout.close();
+
+        this->valid = false;
+
+        protocol::EndRequestMessage end(this->getId(), status, 0);
+        this->client->write(end);
+
+        // Aborted while waiting, let the handler return
+        this->resume(Wait::NONE);
+    }
+
+    protocol::StringRef Request::getParam(const std::string& name) const
+    {
+        protocol::StringRef value;
+
+        this->params.find(name.data(), name.size(), value);
+        return value;
+    }
+
+    bool Request::hasParam(const std::string& name) const
+    {
+        protocol::StringRef value;
+        return this->params.find(name.data(), name.size(), value);
+    }
+
+    protocol::StringRef Request::getParam(KnownParam param) const
+    {
+        protocol::StringRef value;
+
+        this->params.find(param, value);
+        return value;
+    }
+
+    bool Request::hasParam(KnownParam param) const
+    {
+        protocol::StringRef value;
+        return this->params.find(param, value);
+    }
+
+    bool Request::isValid()
+    {
+        return this->valid;
+    }
+
+    /////////////////////////////////////////////////////////////////////
+    //
+    // I/O backends
+    //
+
+    IOBackend::IOBackend(IOHandler& io) : io(io)
+    {
+    }
+
+    IOBackend::~IOBackend()
+    {
+    }
+
+    void IOBackend::accepted(int fd)
+    {
+        this->io.accept(fd, NULL, 0);
+    }
+
+    IOBackend* IOBackend::create(Backend type, IOHandler& io)
+    {
+        switch (type) {
+            case Backend::LIBEVENT:
+                return new LibeventBackend(io);
+
+            case Backend::IO_URING:
+                #ifdef GFSFCGI_WITH_IO_URING
+                    return createUringBackend(io);
+                #else
+                    throw IOException("The io_uring backend is not available in this build");
+                #endif
+
+            default:
+                throw IOException("Unknown I/O backend");
+        }
+    }
+
+    LibeventBackend::LibeventBackend(IOHandler& io) : IOBackend(io),
+            listener(NULL)
+    {
+    }
+
+    LibeventBackend::~LibeventBackend()
+    {
+        this->unlisten();
+    }
+
+    void LibeventBackend::listen(event_base* base, int fd)
+    {
+        this->listener = evconnlistener_new(base, IOHandler::eventAcceptCallback, &this->io, LEV_OPT_REUSEABLE, -1, fd);
+
+        if (this->listener == NULL) {
+            throw IOException("Could not initialize event listeners");
+        }
+
+        evconnlistener_set_error_cb(this->listener, IOHandler::eventErrorCallback);
+        evconnlistener_enable(this->listener);
+    }
+
+    void LibeventBackend::unlisten()
+    {
+        if (this->listener == NULL) {
+            return;
+        }
+
+        evconnlistener_disable(this->listener);
+        evconnlistener_free(this->listener);
+        this->listener = NULL;
+    }
+
+    bufferevent* LibeventBackend::open(event_base* base, int fd)
+    {
+        return bufferevent_socket_new(base, fd, BEV_OPT_DEFER_CALLBACKS | BEV_OPT_THREADSAFE);
+    }
+
+    void LibeventBackend::start(bufferevent* event)
+    {
+        bufferevent_enable(event, EV_READ | EV_WRITE);
+    }
+
+    void LibeventBackend::close(bufferevent* event)
+    {
+        evutil_socket_t fd = bufferevent_getfd(event);
+
+        // The bufferevent lives on while it is referenced, the socket does not
+        bufferevent_free(event);
+        evutil_closesocket(fd);
+    }
+
+    /////////////////////////////////////////////////////////////////////
+    //
+    // Reactor
+    //
+
+    Reactor::Reactor() :
+            thread(NULL),
+            connections(0),
+            node(-1)
+    {
+        this->eventBase = event_base_new();
+
+        if (this->eventBase == NULL) {
+            throw IOException("Failed to create event base for reactor");
+        }
+    }
+
+    Reactor::~Reactor()
+    {
+        this->stop();
+        event_base_free(this->eventBase);
+    }
+
+    void Reactor::loop()
+    {
+        // Connections come and go, keep running until stopped
+        event_base_loop(this->eventBase, EVLOOP_NO_EXIT_ON_EMPTY);
+    }
+
+    void Reactor::start()
+    {
+        if (this->thread != NULL) {
+            return;
+        }
+
+        this->thread = new std::thread(&Reactor::loop, this);
+
+        if (!this->cpus.empty() && !this->cpus.bind(*this->thread)) {
+            std::cerr << "Failed to bind reactor thread to its CPUs" << std::endl;
+        }
+    }
+
+    void Reactor::setPlacement(int node, const CpuSet& cpus)
+    {
+        this->node = node;
+        this->cpus = cpus;
+    }
+
+    void Reactor::stop()
+    {
+        if (this->thread == NULL) {
+            return;
+        }
+
+        event_base_loopbreak(this->eventBase);
+
+        if (this->thread->joinable()) {
+            this->thread->join();
+        }
+
+        delete this->thread;
+        this->thread = NULL;
+
+        // Deferred callbacks of closed connections hold references, run them
+        event_base_loop(this->eventBase, EVLOOP_NONBLOCK);
+    }
+
+    /////////////////////////////////////////////////////////////////////
+    //
+    // I/O Handler
+    //
+
+    IOHandler::IOHandler(const std::string& bind) : IOHandler(0)
+    {
+        this->bind = bind;
+    }
+
+    IOHandler::IOHandler(int socket) :
+            fd(socket),
+            gcInterval({ 10, 0 }), // default gc every 10 seconds
+            admission(workerQueue),
+            backend(NULL),
+            reactorCount(0),
+            nextReactor(0),
+            outputHighWatermark(Client::OUTPUT_HIGH_WATERMARK),
+            outputLowWatermark(Client::OUTPUT_LOW_WATERMARK),
+            bulkThreshold(DEFAULT_BULK_THRESHOLD),
+            closing(false)
+    {
+        // Clients write from worker threads, bufferevent locking requires this
+        evthread_use_pthreads();
+        this->eventBase = event_base_new();
+        this->backend = new LibeventBackend(*this);
+    }
+
+    IOHandler::~IOHandler()
+    {
+        this->clearListeners();
+
+        // Workers may hold the last reference to a request and its connection
+        this->workerQueue.stop();
+
+        // Connections must go before the loops owning them
+        {
+            std::lock_guard<std::mutex> guard(this->clientListMutex);
+
+            this->closing = true;
+
+            for (auto client : this->clients) {
+                client->destroy();
+            }
+
+            this->clients.clear();
+        }
+
+        // The backend may hold events on the reactors' loops
+        for (auto reactor : this->reactors) {
+            reactor->stop();
+        }
+
+        delete this->backend;
+        this->backend = NULL;
+
+        this->stopReactors();
+
+        // Deferred callbacks of closed connections hold references, run them
+        event_base_loop(this->eventBase, EVLOOP_NONBLOCK);
+        event_base_free(this->eventBase);
+        close(this->fd);
+    }
+
+    void IOHandler::setBackend(Backend type)
+    {
+        IOBackend* backend = IOBackend::create(type, *this);
+
+        delete this->backend;
+        this->backend = backend;
+    }
+
+    void IOHandler::setReactorCount(size_t count)
+    {
+        this->reactorCount = count;
+    }
+
+    Reactor* IOHandler::selectReactor()
+    {
+        if (this->reactors.empty()) {
+            return NULL;
+        }
+
+        size_t count = this->reactors.size();
+        Reactor* selected = this->reactors[this->nextReactor % count];
+
+        for (size_t i = 1; i < count; i++) {
+            Reactor* candidate = this->reactors[(this->nextReactor + i) % count];
+
+            if (candidate->getConnectionCount() < selected->getConnectionCount()) {
+                selected = candidate;
+            }
+        }
+
+        this->nextReactor = (this->nextReactor + 1) % count;
+        return selected;
+    }
+
+    void IOHandler::stopReactors()
+    {
+        for (auto reactor : this->reactors) {
+            reactor->stop();
+        }
+
+        for (auto reactor : this->reactors) {
+            delete reactor;
+        }
+
+        this->reactors.clear();
+    }
+
+    //! accept callback helper
+    void IOHandler::eventAcceptCallback(evconnlistener* /* event */, int fd, sockaddr* clientAddress, int len, void* ptr)
+    {
+        ((IOHandler*)ptr)->accept(fd, clientAddress, len);
+    }
+
+    //! Error callback
+    void IOHandler::eventErrorCallback(evconnlistener* listener, void* ptr)
+    {
+        ((IOHandler*)ptr)->onError(listener);
+    }
+
+    //! Connection handed to a reactor
+    void IOHandler::eventOpenCallback(evutil_socket_t /* fd */, short /* type */, void* ptr)
+    {
+        std::unique_ptr<PendingConnection> pending((PendingConnection*)ptr);
+
+        // The client counts itself from now on
+        pending->reactor->detach();
+
+        try {
+            pending->io->open(pending->fd, pending->reactor);
+        } catch (std::exception& e) {
+            std::cerr << "Failed to open connection: " << e.what() << std::endl;
+            close(pending->fd);
+        }
+    }
+
+    //! GC trigger
+    void IOHandler::eventGcCallback(int /* fd */, short /* type */, void *ptr)
+    {
+        ((IOHandler*)ptr)->gc();
+    }
+
+    void IOHandler::eventSignalCallback(int /* signal */, short /* type */, void* /* ptr */)
+    {
+        // TODO: Exit the I/O Handler
+    }
+
+    void IOHandler::addHandlerFactory(HandlerFactoryPtr handler)
+    {
+        this->handlers.push_back(handler);
+    }
+
+    bool IOHandler::isRoleAccepted(uint16_t role)
+    {
+        for (auto handler : this->handlers) {
+            if (handler->acceptRole(role)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void IOHandler::schedule(RequestPtr request)
+    {
+        WorkerCallbackPtr callback = WorkerTask::create();
+        std::weak_ptr<WorkerTask> self(callback);
+        size_t bulkThreshold = this->bulkThreshold;
+
+        callback->callback = [request, self, bulkThreshold]() {
+            WorkerCallbackPtr callback = self.lock();
+            size_t written = request->getWrittenBytes();
+            bool complete = request->handle();
+
+            if (callback == NULL) {
+                return complete;
+            }
+
+            // Account the output for fair scheduling
+            callback->cost = request->getWrittenBytes() - written;
+            callback->node = request->getClient()->getNode();
+
+            if (bulkThreshold && ((written + callback->cost) >= bulkThreshold)) {
+                callback->serviceClass = ServiceClass::BULK;
+            }
+
+            // Don't spin while the handler cannot make progress
+            return complete || request->suspend(callback);
+        };
+
+        this->workerQueue.push(callback);
+    }
+
+    void IOHandler::setReactorCpus(const CpuSet& cpus)
+    {
+        this->reactorCpus = cpus;
+    }
+
+    void IOHandler::setBulkThreshold(size_t bytes)
+    {
+        this->bulkThreshold = bytes;
+    }
+
+    void IOHandler::setOutputWatermarks(size_t high, size_t low)
+    {
+        this->outputHighWatermark = high;
+        this->outputLowWatermark = (low > high)? high : low;
+    }
+
+    HandlerFactoryPtr IOHandler::getHandlerFactory(uint16_t role)
+    {
+        for (auto handler : this->handlers) {
+            if (handler->acceptRole(role)) {
+                return handler;
+            }
+        }
+
+        std::ostringstream oss;
+        oss << "Could not find any handler to handle role \"" << role << "\".";
+
+        throw IOException(oss.str());
+    }
+
+    ///! Create the socket connection
+    void IOHandler::createListenerSocket()
+    {
+        if (this->fd != 0) {
+            return;
+        }
+
+        std::regex ipv4regex("^(\d{1,3}(?:\.\d{1,3}){3})(\:([1-9][0-9]*))?$");
+        std::smatch m;
+
+        sockaddr_un bindUnix;
+        sockaddr_in bindIPv4;
+        sockaddr_in6 bindIPv6;
+        sockaddr* bindAddr = NULL;
+        size_t bindAddrLen = 0;
+
+        if (bind.substr(0, 5) == "unix:") {
+            if (bind.size() - 5 > 108) {
+                throw IOException("Unix path name too long for socket.");
+            }
+
+            memset(&bindUnix, 0, sizeof(bindUnix));
+            memcpy(&bindUnix.sun_path, bind.substr(5).c_str(), bind.size());
+
+            bindUnix.sun_family = AF_UNIX;
+            bindAddr = (sockaddr*)&bindUnix;
+            bindAddrLen = sizeof(bindUnix);
+
+            this->fd = socket(AF_LOCAL, SOCK_STREAM, 0);
+        } else if (std::regex_match(bind, m, ipv4regex)){
+            int port = 9800;
+
+            if ((m.size() >= 3) && m[3].matched) {
+                std::istringstream iss(m[3].str());
+                iss >> port;
+            }
+
+            bindIPv4.sin_family = AF_INET;
+            bindIPv4.sin_port = htons(port);
+
+            std::string addr = m[1].str();
+
+            if (addr == "0.0.0.0") {
+                bindIPv4.sin_addr.s_addr = INADDR_ANY;
+            } else {
+                // TODO: Bind specific address
+                // gethostbyaddr(addr.c_str(), addr.size());
+                bindIPv4.sin_addr.s_addr = INADDR_ANY;
+            }
+
+            this->fd = socket(AF_INET, SOCK_STREAM, 0);
+        // } else if () { // TODO: IPv6
+        } else {
+            std::ostringstream oss;
+            oss << "Invalid bind expression: \"" << bind << "\"";
+            throw IOException(oss.str());
+        }
+
+        if (::bind(this->fd, bindAddr, bindAddrLen) < 0) {
+            close(this->fd);
+            std::ostringstream oss;
+            oss << "Failed to bind socket to \"" << bind << "\"";
+            throw IOException(oss.str());
+        }
+
+        if (!setNonBlocking(this->fd)) {
+            throw IOException("Failed to make listener socket non blocking");
+        }
+    }
+
+    //! Run the IO handler thread
+    void IOHandler::run(unsigned int workerCount)
+    {
+        this->createListenerSocket();
+
+        auto gc = event_new(this->eventBase, -1, EV_PERSIST, IOHandler::eventGcCallback, this);
+        auto sig = evsignal_new(this->eventBase, SIGTERM, IOHandler::eventSignalCallback, this);
+
+        this->eventListeners.push_back(gc);
+        this->eventListeners.push_back(sig);
+
+        evtimer_add(gc, &this->gcInterval);
+        evsignal_add(sig, NULL);
+
+        this->backend->listen(this->eventBase, this->fd);
+
+        // The accepting loop runs on this thread
+        if (!this->reactorCpus.empty() && !this->reactorCpus.bindCurrentThread()) {
+            std::cerr << "Failed to bind the I/O thread to the reactor CPUs" << std::endl;
+        }
+
+        // Start the connection loops
+        for (size_t i = this->reactors.size(); i < this->reactorCount; i++) {
+            Reactor* reactor = new Reactor();
+
+            if (!this->reactorCpus.empty()) {
+                int node;
+                CpuSet cpus = NumaTopology::get().spread(this->reactorCpus, i, node);
+
+                reactor->setPlacement(node, cpus);
+            }
+
+            this->reactors.push_back(reactor);
+            reactor->start();
+        }
+
+        // Start the worker queue
+        this->workerQueue.run(workerCount);
+
+        // Dispatch the event loop
+        event_base_dispatch(this->eventBase);
+
+        this->clearListeners();
+        this->backend->unlisten();
+    }
+
+    //! Accept a client connection
+    void IOHandler::accept(int fd, sockaddr* /* address */, int /* socketlen */)
+    {
+        // We advertise FCGI_MAX_CONNS, stick to it. Closed clients may wait for the gc,
+        // so the list is no measure of open connections.
+        if (!this->admission.connect()) {
+            close(fd);
+            return;
+        }
+
+        Reactor* reactor = this->selectReactor();
+
+        if (reactor == NULL) {
+            this->open(fd, NULL);
+            return;
+        }
+
+        // Counted until the reactor opened the connection, so a burst of them is spread
+        reactor->attach();
+
+        // Built on the reactor's thread, its allocations are first touched on its node
+        PendingConnection* pending = new PendingConnection{ this, fd, reactor };
+
+        if (event_base_once(reactor->getEventBase(), -1, EV_TIMEOUT, IOHandler::eventOpenCallback, pending, NULL) != 0) {
+            delete pending;
+            reactor->detach();
+
+            this->open(fd, reactor);
+        }
+    }
+
+    void IOHandler::open(int fd, Reactor* reactor)
+    {
+        std::lock_guard<std::mutex> guard(this->clientListMutex);
+
+        // The loops are stopping, the connection is dropped
+        if (this->closing) {
+            close(fd);
+            this->admission.disconnect();
+            return;
+        }
+
+        ClientPtr client;
+
+        try {
+            client.reset(new Client(*this, fd, reactor));
+        } catch (...) {
+            this->admission.disconnect();
+            throw;
+        }
+
+        this->clients.push_back(client);
+        client->start();
+    }
+
+    //! Garbage collect
+    void IOHandler::gc()
+    {
+        std::lock_guard<std::mutex> guard(this->clientListMutex);
+
+        auto it = this->clients.begin();
+
+        while (it != this->clients.end()) {
+            if (!(*it)->valid()) {
+                it = this->clients.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+
+    //! Handle errors
+    void IOHandler::onError(evconnlistener* /* error */)
+    {
+        int err = EVUTIL_SOCKET_ERROR();
+        std::cerr << "Socket listener error " << err << ": " << evutil_socket_error_to_string(err) << std::endl;
+
+        event_base_loopexit(this->eventBase, NULL);
+    }
+
+    /**
+     * Clear all event listeners
+     */
+    void IOHandler::clearListeners()
+    {
+        for (auto event : this->eventListeners) {
+            if (event == NULL) {
+                continue;
+            }
+
+            event_del(event);
+            event_free(event);
+        }
+
+        this->eventListeners.clear();
+    }
+
+    //! Make filedescriptor non-blocking
+    bool IOHandler::setNonBlocking(int fd)
     {
+        return (evutil_make_socket_nonblocking(fd) == 0);
     }
 
-    Request::~Request()
+
+    // Responder is the only supported role by default
+    bool HandlerFactory::acceptRole(uint16_t role)
     {
+        return (role == FCGI_RESPONDER);
     }
 
 
-    void Request::setHandler(RequestHandlerPtr handler)
+    ///////////////////////////////////////////////////////////////
+    //
+    // Request handler
+    //
+
+    RequestHandler::RequestHandler(Request& request)
     {
-        this->handler = handler;
+        this->request = &request;
     }
 
-    void Request::send(protocol::Message& msg)
+    RequestHandler::~RequestHandler()
     {
-        this->client->write(msg);
     }
 
-    // Finish the request
-    void Request::finish(uint32_t status)
+    Request& RequestHandler::getRequest() throw (std::runtime_error)
     {
-        protocol::EndRequestMessage end(this->getId(), status, 0);
-        this->client->write(end);
-
-        this->_datain.close();
-        this->_stdin.close();
-        this->_stderr.close();
-        this->_stdout.close();
+        if (this->request == NULL) {
+            throw std::runtime_error("Request is NULL for the current handler instance");
+        }
 
-        this->valid = false;
+        return *this->request;
     }
 
-    bool Request::isValid()
+    void RequestHandler::finish(uint16_t status)
     {
-        return this->valid;
+        this->getRequest().finish(status);
+        this->request = NULL;
     }
 
-    /////////////////////////////////////////////////////////////////////
-    //
-    // I/O Handler
-    //
-
-    IOHandler::IOHandler(const std::string& bind) : bind(bind), IOHandler(0)
+    void RequestHandler::waitForInput()
     {
+        this->getRequest().await(Request::Wait::INPUT);
     }
 
-    IOHandler::IOHandler(int socket) :
-            fd(socket),
-            gcInterval({ 10, 0 }) // default gc every 10 seconds
+    void RequestHandler::waitForOutput()
     {
-        this->eventBase = event_base_new();
+        this->getRequest().await(Request::Wait::OUTPUT);
     }
 
-    IOHandler::~IOHandler()
+    Resumer RequestHandler::suspend()
     {
-        this->clearListeners();
-        event_base_free(this->eventBase);
-        close(this->fd);
+        return this->getRequest().awaitSignal();
     }
 
-    //! accept callback helper
-    void IOHandler::eventAcceptCallback(evconnlistener* event, int fd, sockaddr* clientAddress, int len, void* ptr)
+    void RequestHandler::onReceiveData(const protocol::Record& /* record */)
     {
-        ((IOHandler*)ptr)->accept(fd, clientAddress, len);
+        // NOOP
     }
 
-    //! Error callback
-    void IOHandler::eventErrorCallback(evconnlistener* listener, void* ptr)
+    void RequestHandler::onAbort()
     {
-        ((IOHandler*)ptr)->onError(listener);
+        this->finish(1);
     }
 
-    //! GC trigger
-    void IOHandler::eventGcCallback(int fd, short type, void *ptr)
-    {
-        ((IOHandler*)ptr)->gc();
+
+    ///////////////////////////////////////////////////////////////
+    //
+    // Worker queue
+    //
+
+    const unsigned WorkerQueue::STEAL_ROUNDS;
+    const unsigned WorkerQueue::INJECTOR_INTERVAL;
+    const size_t WorkerQueue::DEFAULT_QUANTUM;
+    const unsigned WorkerQueue::DEFAULT_SLICE_BUDGET;
+    const size_t WorkerQueue::POP_BATCH;
+    const unsigned WorkerQueue::ADJUST_INTERVAL;
+    const unsigned WorkerQueue::BLOCKED_THRESHOLD;
+    const unsigned WorkerQueue::DEFAULT_TARGET_DELAY;
+    const unsigned WorkerQueue::DEFAULT_IDLE_TIMEOUT;
+
+    thread_local WorkerQueue::Local WorkerQueue::local = { NULL, NULL };
+
+    WorkerQueue::WorkerQueue() :
+            terminated(false),
+            queued(0),
+            injected(0),
+            sleeping(0),
+            monitor(NULL),
+            threads(0),
+            minThreads(0),
+            maxThreads(0),
+            targetDelay(std::chrono::microseconds(DEFAULT_TARGET_DELAY)),
+            idleTimeout(std::chrono::milliseconds(DEFAULT_IDLE_TIMEOUT)),
+            queueDelay(0),
+            grown(0),
+            retired(0),
+            sliceBudget(std::chrono::microseconds(DEFAULT_SLICE_BUDGET))
+    {
+        this->injection.resize(NumaTopology::get().getNodeCount() + 1);
+
+        for (size_t i = 0; i < SERVICE_CLASS_COUNT; i++) {
+            this->quantum[i] = DEFAULT_QUANTUM;
+        }
     }
 
-    void IOHandler::eventSignalCallback(int signal, short type, void* ptr)
+    WorkerQueue::~WorkerQueue()
     {
-        // TODO: Exit the I/O Handler
+        this->stop();
+
+        // Queued tasks reference themselves
+        for (auto slot : this->slots) {
+            for (auto& deque : slot->deques) {
+                WorkerTask* task;
+
+                while ((task = deque.pop()) != NULL) {
+                    task->queued.reset();
+                }
+            }
+
+            delete slot;
+        }
+
+        this->slots.clear();
+
+        for (auto& queues : this->injection) {
+            for (auto& list : queues.classes) {
+                while (list.first != NULL) {
+                    WorkerTask* task = list.first;
+
+                    list.first = task->next;
+                    task->next = NULL;
+                    task->queued.reset();
+                }
+
+                list.last = NULL;
+            }
+        }
     }
 
-    void IOHandler::addHandlerFactory(HandlerFactoryPtr handler)
+    WorkerQueue::Slot* WorkerQueue::getLocalSlot() const
     {
-        this->handlers.push_back(handler);
+        return (local.queue == this)? local.slot : NULL;
     }
 
-    bool IOHandler::isRoleAccepted(uint16_t role)
+    void WorkerQueue::push(WorkerCallbackPtr& ptr)
     {
-        for (auto handler : this->handlers) {
-            if (handler->acceptRole(role)) {
-                return true;
+        Slot* slot = this->getLocalSlot();
+        WorkerTask* task = ptr.get();
+        size_t serviceClass = (size_t)task->serviceClass;
+
+        task->queued = ptr;
+        task->queuedAt = Clock::now();
+
+        if (slot != NULL) {
+            slot->deques[serviceClass].push(task);
+        } else {
+            std::lock_guard<std::mutex> lock(this->protector);
+            TaskList& list = this->injection[this->getQueueIndex(task->node)].classes[serviceClass];
+
+            task->next = NULL;
+
+            if (list.last == NULL) {
+                list.first = task;
+            } else {
+                list.last->next = task;
             }
+
+            list.last = task;
+            this->injected++;
         }
 
-        return false;
+        this->queued++;
+
+        // Sleepers check queued under the lock, taking it avoids a lost wakeup
+        if (this->sleeping > 0) {
+            {
+                std::lock_guard<std::mutex> lock(this->protector);
+            }
+
+            this->readyCondition.notify_one();
+        }
     }
 
-    HandlerFactoryPtr IOHandler::getHandlerFactory(uint16_t role)
+    size_t WorkerQueue::popInjected(size_t index, size_t serviceClass, WorkerCallbackPtr* tasks, size_t count)
     {
-        for (auto handler : this->handlers) {
-            if (handler->acceptRole(role)) {
-                return handler;
-            }
+        if (this->injected == 0) {
+            return 0;
         }
 
-        std::ostringstream oss;
-        oss << "Could not find any handler to handle role \"" << role << "\".";
+        std::lock_guard<std::mutex> lock(this->protector);
+        TaskList& list = this->injection[index].classes[serviceClass];
+        size_t n = 0;
 
-        throw IOException(oss.str());
-    }
+        while ((n < count) && (list.first != NULL)) {
+            WorkerTask* task = list.first;
 
-    ///! Create the socket connection
-    void IOHandler::createListenerSocket()
-    {
-        if (this->fd != 0) {
-            return;
+            list.first = task->next;
+            task->next = NULL;
+            tasks[n++].swap(task->queued);
         }
 
-        std::regex ipv4regex("^(\d{1,3}(?:\.\d{1,3}){3})(\:([1-9][0-9]*))?$");
-        std::smatch m;
+        if (list.first == NULL) {
+            list.last = NULL;
+        }
 
-        sockaddr_un bindUnix;
-        sockaddr_in bindIPv4;
-        sockaddr_in6 bindIPv6;
-        sockaddr* bindAddr = NULL;
-        size_t bindAddrLen = 0;
+        this->injected -= n;
+        return n;
+    }
 
-        if (bind.substr(0, 5) == "unix:") {
-            if (bind.size() - 5 > 108) {
-                throw IOException("Unix path name too long for socket.");
+    WorkerCallbackPtr WorkerQueue::steal(Slot* thief, size_t serviceClass)
+    {
+        size_t count = this->slots.size();
+        size_t start = 0;
+
+        for (unsigned round = 0; round < STEAL_ROUNDS; round++) {
+            if (thief != NULL) {
+                // xorshift
+                thief->seed ^= thief->seed << 13;
+                thief->seed ^= thief->seed >> 17;
+                thief->seed ^= thief->seed << 5;
+                start = thief->seed;
             }
 
-            memset(&bindUnix, 0, sizeof(bindUnix));
-            memcpy(&bindUnix.sun_path, bind.substr(5).c_str(), bind.size());
+            for (size_t i = 0; i < count; i++) {
+                Slot* victim = this->slots[(start + i) % count];
 
-            bindUnix.sun_family = AF_UNIX;
-            bindAddr = (sockaddr*)&bindUnix;
-            bindAddrLen = sizeof(bindUnix);
+                if (victim == thief) {
+                    continue;
+                }
 
-            this->fd = socket(AF_LOCAL, SOCK_STREAM, 0);
-        } else if (std::regex_match(bind, m, ipv4regex)){
-            int port = 9800;
+                // Keep the first round on the thief's node
+                if ((round == 0) && (thief != NULL) && (thief->node >= 0) && (victim->node != thief->node)) {
+                    continue;
+                }
 
-            if ((m.size() >= 3) && m[3].matched) {
-                std::istringstream iss(m[3].str());
-                iss >> port;
+                WorkerTask* task = victim->deques[serviceClass].steal();
+
+                if (task != NULL) {
+                    WorkerCallbackPtr ptr;
+
+                    ptr.swap(task->queued);
+                    return ptr;
+                }
             }
+        }
 
-            bindIPv4.sin_family = AF_INET;
-            bindIPv4.sin_port = htons(port);
+        return WorkerCallbackPtr(NULL);
+    }
 
-            std::string addr = m[1].str();
+    size_t WorkerQueue::takeClass(Slot* slot, size_t serviceClass, WorkerCallbackPtr* tasks, size_t count)
+    {
+        size_t n = 0;
+        size_t own = this->getQueueIndex((slot != NULL)? slot->node : -1);
 
-            if (addr == "0.0.0.0") {
-                bindIPv4.sin_addr.s_addr = INADDR_ANY;
-            } else {
-                // TODO: Bind specific address
-                // gethostbyaddr(addr.c_str(), addr.size());
-                bindIPv4.sin_addr.s_addr = INADDR_ANY;
+        // Look at the injection queue first once in a while, so it is not starved by busy workers
+        bool injectedFirst = (slot == NULL) || ((++slot->ticks % INJECTOR_INTERVAL) == 0);
+
+        if (injectedFirst) {
+            n += this->popInjected(own, serviceClass, tasks, count);
+        }
+
+        if (slot != NULL) {
+            WorkerTask* task;
+
+            while ((n < count) && ((task = slot->deques[serviceClass].steal()) != NULL)) {
+                tasks[n++].swap(task->queued);
             }
+        }
 
-            this->fd = socket(AF_INET, SOCK_STREAM, 0);
-        // } else if () { // TODO: IPv6
-        } else {
-            std::ostringstream oss;
-            oss << "Invalid bind expression: \"" << bind << "\"";
-            throw IOException(oss.str());
+        if ((n < count) && !injectedFirst) {
+            n += this->popInjected(own, serviceClass, tasks + n, count - n);
         }
 
-        if (::bind(this->fd, bindAddr, bindAddrLen) < 0) {
-            close(this->fd);
-            std::ostringstream oss;
-            oss << "Failed to bind socket to \"" << bind << "\"";
-            throw IOException(oss.str());
+        // Callbacks of any node, then those of other nodes
+        for (size_t i = 0; (n < count) && (i < this->injection.size()); i++) {
+            if (i != own) {
+                n += this->popInjected(i, serviceClass, tasks + n, count - n);
+            }
         }
 
-        if (!setNonBlocking(this->fd)) {
-            throw IOException("Failed to make listener socket non blocking");
+        if (n == 0) {
+            tasks[0] = this->steal(slot, serviceClass);
+            n = (tasks[0] != NULL)? 1 : 0;
         }
+
+        return n;
     }
 
-    //! Run the IO handler thread
-    void IOHandler::run(unsigned int workerCount)
+    /**
+     * Deficit round robin over the service classes
+     */
+    size_t WorkerQueue::take(Slot* slot, WorkerCallbackPtr* tasks, size_t count)
     {
-        this->createListenerSocket();
+        size_t n = 0;
 
-        auto gc = event_new(this->eventBase, -1, EV_PERSIST, IOHandler::eventGcCallback, this);
-        auto sig = evsignal_new(this->eventBase, SIGTERM, IOHandler::eventSignalCallback, this);
-        auto listener = evconnlistener_new(this->eventBase, IOHandler::eventAcceptCallback, this, LEV_OPT_REUSEABLE, -1, this->fd);
+        if (slot == NULL) {
+            for (size_t i = 0; (n == 0) && (i < SERVICE_CLASS_COUNT); i++) {
+                n = this->takeClass(NULL, i, tasks, count);
+            }
+        } else {
+            Clock::time_point now = Clock::now();
 
-        this->eventListeners.push_back(gc);
-        this->eventListeners.push_back(sig);
+            // Visit each class once after the current one
+            for (size_t i = 0; i <= SERVICE_CLASS_COUNT; i++) {
+                size_t current = slot->current;
 
-        if (!listener) {
-            throw IOException("Could not initialize event listeners");
+                if ((slot->deficit[current] > 0) && ((now - slot->sliceStart) < this->sliceBudget)) {
+                    n = this->takeClass(slot, current, tasks, count);
+
+                    if (n > 0) {
+                        break;
+                    }
+
+                    // An idle class does not save up its deficit
+                    slot->deficit[current] = 0;
+                }
+
+                slot->current = (current + 1) % SERVICE_CLASS_COUNT;
+                slot->deficit[slot->current] += this->quantum[slot->current];
+                slot->sliceStart = now;
+            }
+
+            if (n > 0) {
+                uint64_t waitTime = 0;
+
+                for (size_t i = 0; i < n; i++) {
+                    waitTime += std::chrono::duration_cast<std::chrono::nanoseconds>(now - tasks[i]->queuedAt).count();
+                }
+
+                slot->waitTime += waitTime;
+                slot->waitCount += n;
+            }
         }
 
-        evtimer_add(gc, &this->gcInterval);
-        evsignal_add(sig, NULL);
+        this->queued -= n;
+        return n;
+    }
 
-        evconnlistener_set_error_cb(listener, IOHandler::eventErrorCallback);
-        evconnlistener_enable(listener);
+    void WorkerQueue::charge(ServiceClass serviceClass, size_t cost)
+    {
+        Slot* slot = this->getLocalSlot();
 
-        // Start the worker queue
-        this->workerQueue.run(workerCount);
+        if (slot != NULL) {
+            // Steps without output still use up the turn eventually
+            slot->deficit[(size_t)serviceClass] -= (cost > 0)? cost : 1;
+        }
+    }
 
-        // Dispatch the event loop
-        event_base_dispatch(this->eventBase);
+    WorkerCallbackPtr WorkerQueue::pop()
+    {
+        WorkerCallbackPtr ptr;
 
-        this->clearListeners();
-        evconnlistener_disable(listener);
-        evconnlistener_free(listener);
+        this->pop(&ptr, 1);
+        return ptr;
     }
 
-    //! Accept a client connection
-    void IOHandler::accept(int fd, sockaddr* address, int socketlen)
+    size_t WorkerQueue::pop(WorkerCallbackPtr* tasks, size_t count)
+    {
+        Slot* slot = this->getLocalSlot();
+
+        while (!this->terminated) {
+            size_t n = this->take(slot, tasks, count);
+
+            if (n > 0) {
+                return n;
+            }
+
+            // Nothing to do, sleep until the next push
+            std::unique_lock<std::mutex> lock(this->protector);
+            bool elastic = (slot != NULL) && (this->minThreads < this->maxThreads);
+            Clock::time_point idleSince = Clock::now();
+
+            this->sleeping++;
+
+            // The timeout is read on each wake up, setIdleTimeout() wakes the sleepers
+            while ((this->queued == 0) && !this->terminated) {
+                if (!elastic) {
+                    this->readyCondition.wait(lock);
+                } else if (Clock::now() < (idleSince + this->idleTimeout)) {
+                    this->readyCondition.wait_until(lock, idleSince + this->idleTimeout);
+                } else if (this->threads > this->minThreads) {
+                    // Idle for the whole timeout, the own deques are empty
+                    slot->active = false;
+                    this->threads--;
+                    this->retired++;
+                    this->sleeping--;
+
+                    return 0;
+                } else {
+                    idleSince = Clock::now();
+                }
+            }
+
+            this->sleeping--;
+        }
+
+        return 0;
+    }
+
+    /**
+     * Request worker termination
+     */
+    void WorkerQueue::terminate()
     {
-        ClientPtr client(new Client(*this, fd));
+        this->terminated = true;
 
-        std::lock_guard<std::mutex> guard(this->clientListMutex);
-        this->clients.push_back(client);
+        {
+            std::lock_guard<std::mutex> lock(this->protector);
+        }
+
+        this->readyCondition.notify_all();
+        this->monitorCondition.notify_all();
     }
 
-    //! Garbage collect
-    void IOHandler::gc()
+    void WorkerQueue::stop()
     {
-        std::lock_guard<std::mutex> guard(this->clientListMutex);
+        this->terminate();
 
-        for (auto it = this->clients.begin(); it != this->clients.end(); it++) {
-            if (!(*it)->valid()) {
-                this->clients.erase(it);
+        if (this->monitor != NULL) {
+            this->monitor->join();
+            delete this->monitor;
+            this->monitor = NULL;
+        }
+
+        for (auto slot : this->slots) {
+            if (slot->thread != NULL) {
+                slot->thread->join();
+                delete slot->thread;
+                slot->thread = NULL;
             }
         }
     }
 
-    //! Handle errors
-    void IOHandler::onError(evconnlistener* error)
+    /**
+     * Check if queue is terminated
+     */
+    bool WorkerQueue::isTerminated() const
     {
-        int err = EVUTIL_SOCKET_ERROR();
-        std::cerr << "Socket listener error " << err << ": " << evutil_socket_error_to_string(err) << std::endl;
-
-        event_base_loopexit(this->eventBase, NULL);
+        return this->terminated;
     }
 
     /**
-     * Clear all event listeners
+     * Number of queued callbacks
      */
-    void IOHandler::clearListeners()
+    size_t WorkerQueue::size()
     {
-        for (auto event : this->eventListeners) {
-            if (event == NULL) {
-                continue;
-            }
-
-            event_del(event);
-            event_free(event);
-        }
-
-        this->eventListeners.clear();
+        return this->queued;
     }
 
-    //! Make filedescriptor non-blocking
-    bool IOHandler::setNonBlocking(int fd)
+    void WorkerQueue::setQuantum(ServiceClass serviceClass, size_t bytes)
     {
-        return (evutil_make_socket_nonblocking(fd) == 0);
+        this->quantum[(size_t)serviceClass] = (bytes > 0)? bytes : 1;
     }
 
-
-    // Responder is the only supported role by default
-    bool HandlerFactory::acceptRole(uint16_t role)
+    void WorkerQueue::setSliceBudget(unsigned int usec)
     {
-        return (role == FCGI_RESPONDER);
+        this->sliceBudget = std::chrono::microseconds(usec);
     }
 
+    void WorkerQueue::setCpus(const CpuSet& cpus)
+    {
+        this->cpus = cpus;
+    }
 
-    ///////////////////////////////////////////////////////////////
-    //
-    // Request handler
-    //
-
-    RequestHandler::RequestHandler(Request& request)
+    void WorkerQueue::setThreadLimits(size_t minThreads, size_t maxThreads)
     {
-        this->request = &request;
+        this->minThreads = (minThreads > 0)? minThreads : 1;
+        this->maxThreads = (maxThreads > this->minThreads)? maxThreads : this->minThreads;
     }
 
-    RequestHandler::~RequestHandler()
+    void WorkerQueue::setTargetDelay(unsigned int usec)
     {
+        std::lock_guard<std::mutex> lock(this->protector);
+        this->targetDelay = std::chrono::microseconds(usec);
     }
 
-    Request& RequestHandler::getRequest() throw (std::runtime_error)
+    void WorkerQueue::setIdleTimeout(unsigned int msec)
     {
-        if (this->request == NULL) {
-            throw std::runtime_error("Request is NULL for the current handler instance");
+        {
+            std::lock_guard<std::mutex> lock(this->protector);
+            this->idleTimeout = std::chrono::milliseconds(msec);
         }
 
-        return *this->request;
+        this->readyCondition.notify_all();
     }
 
-    void RequestHandler::finish(uint16_t status)
+    void WorkerQueue::countBusy(size_t& busy, size_t& blocked) const
     {
-        this->getRequest().finish(status);
-        this->request = NULL;
+        Clock::rep blockedBefore = (Clock::now() - std::chrono::microseconds(BLOCKED_THRESHOLD)).time_since_epoch().count();
+
+        busy = 0;
+        blocked = 0;
+
+        for (auto slot : this->slots) {
+            Clock::rep since = slot->runningSince;
+
+            if (since != 0) {
+                busy++;
+
+                if (since < blockedBefore) {
+                    blocked++;
+                }
+            }
+        }
     }
 
-    void RequestHandler::onReceiveData(const protocol::Record& record)
+    WorkerQueue::Metrics WorkerQueue::getMetrics() const
     {
-        // NOOP
+        Metrics metrics;
+
+        metrics.threads = this->threads;
+        metrics.minThreads = this->minThreads;
+        metrics.maxThreads = this->maxThreads;
+        metrics.queued = this->queued;
+        metrics.queueDelay = this->queueDelay;
+        metrics.grown = this->grown;
+        metrics.retired = this->retired;
+
+        this->countBusy(metrics.busy, metrics.blocked);
+        return metrics;
     }
 
-    void RequestHandler::onAbort()
+    void WorkerQueue::startWorker(Slot* slot)
     {
-        this->finish(1);
+        // A retired thread has left its loop already
+        if (slot->thread != NULL) {
+            slot->thread->join();
+            delete slot->thread;
+        }
+
+        slot->thread = new std::thread(Worker(*this, slot));
+
+        if (!slot->cpus.empty() && !slot->cpus.bind(*slot->thread)) {
+            std::cerr << "Failed to bind worker thread to its CPUs" << std::endl;
+        }
     }
 
+    void WorkerQueue::adjust()
+    {
+        std::unique_lock<std::mutex> lock(this->protector);
+
+        while (!this->terminated) {
+            this->monitorCondition.wait_for(lock, std::chrono::milliseconds(ADJUST_INTERVAL));
+
+            if (this->terminated) {
+                break;
+            }
+
+            uint64_t waitTime = 0;
+            uint64_t waitCount = 0;
+            size_t busy, blocked;
+
+            for (auto slot : this->slots) {
+                waitTime += slot->waitTime.exchange(0);
+                waitCount += slot->waitCount.exchange(0);
+            }
+
+            this->queueDelay = (waitCount > 0)? (waitTime / waitCount / 1000) : 0;
+            this->countBusy(busy, blocked);
+
+            // Sleeping workers will pick up the backlog themselves
+            bool delayed = (waitCount > 0) && (std::chrono::nanoseconds(waitTime / waitCount) > this->targetDelay);
+
+            if ((this->queued == 0) || (this->sleeping > 0) || (!delayed && (blocked < this->threads))) {
+                continue;
+            }
+
+            // Replace blocked workers at once, grow one at a time otherwise
+            size_t count = std::max<size_t>(blocked, 1);
+            std::vector<Slot*> started;
+
+            for (auto slot : this->slots) {
+                if ((started.size() >= count) || (this->threads >= this->maxThreads)) {
+                    break;
+                }
+
+                if (!slot->active) {
+                    slot->active = true;
+                    this->threads++;
+                    started.push_back(slot);
+                }
+            }
+
+            this->grown += started.size();
+
+            lock.unlock();
+
+            for (auto slot : started) {
+                this->startWorker(slot);
+            }
+
+            lock.lock();
+        }
+    }
 
     ///////////////////////////////////////////////////////////////
     //
-    // Worker queue
+    // Admission control
     //
 
-    WorkerQueue::WorkerQueue() : terminated(false)
+    AdmissionController::AdmissionController(WorkerQueue& queue) :
+            queue(queue),
+            maxConnections(1024),
+            maxRequests(0),
+            maxQueueDepth(0),
+            maxBufferedBytes(0),
+            activeRequests(0),
+            bufferedBytes(0),
+            connections(0)
     {
-    }
+        rlimit limit;
 
-    WorkerQueue::~WorkerQueue()
-    {
-        this->terminate();
+        // Each connection needs a file descriptor, keep a few for everything else
+        if ((getrlimit(RLIMIT_NOFILE, &limit) == 0) && (limit.rlim_cur != RLIM_INFINITY) && (limit.rlim_cur > 64)) {
+            this->maxConnections = limit.rlim_cur - 32;
+        }
 
-        for (auto thread : this->threadPool) {
-            if (thread->joinable()) {
-                thread->join();
-            }
+        this->maxRequests = this->maxConnections;
+    }
 
-            delete thread;
+    bool AdmissionController::admit()
+    {
+        if (this->isOverloaded()) {
+            return false;
         }
 
-        this->threadPool.clear();
+        this->activeRequests++;
+        return true;
     }
 
-    void WorkerQueue::push(WorkerCallbackPtr& ptr)
+    void AdmissionController::release(size_t count)
     {
-        std::unique_lock<std::mutex> lock(this->protector);
+        this->activeRequests -= count;
+    }
+
+    bool AdmissionController::connect()
+    {
+        // Racing accepts must not overshoot the limit
+        size_t current = this->connections;
 
-        lock.lock();
-        parent::push(ptr);
-        lock.unlock();
+        do {
+            if (current >= this->maxConnections) {
+                return false;
+            }
+        } while (!this->connections.compare_exchange_weak(current, current + 1));
 
-        this->readyCondition.notify_one();
+        return true;
     }
 
-    WorkerCallbackPtr WorkerQueue::pop()
+    void AdmissionController::disconnect()
     {
-        std::unique_lock<std::mutex> lock(this->protector);
-        lock.lock();
+        this->connections--;
+    }
 
-        if (this->empty()) {
-            lock.unlock();
-            this->readyCondition.wait(lock);
+    bool AdmissionController::isOverloaded()
+    {
+        if (this->maxRequests && (this->activeRequests >= this->maxRequests)) {
+            return true;
         }
 
-        // Still empty or terminated?
-        if (this->empty() || this->terminated) {
-            return WorkerCallbackPtr(NULL);
+        if (this->maxBufferedBytes && (this->bufferedBytes >= this->maxBufferedBytes)) {
+            return true;
         }
 
-        WorkerCallbackPtr ptr = this->front();
-
-        parent::pop();
-        lock.unlock();
-
-        return ptr;
+        return (this->maxQueueDepth && (this->queue.size() >= this->maxQueueDepth));
     }
 
-    /**
-     * Request worker termination
-     */
-    void WorkerQueue::terminate()
+    void AdmissionController::addBufferedBytes(size_t size)
     {
-        this->terminated = true;
-        this->readyCondition.notify_all();
+        this->bufferedBytes += size;
     }
 
-    /**
-     * Check if queue is terminated
-     */
-    bool WorkerQueue::isTerminated() const
+    void AdmissionController::removeBufferedBytes(size_t size)
     {
-        return this->terminated;
+        this->bufferedBytes -= size;
     }
 
     /**
@@ -956,6 +2400,10 @@ namespace fastcgi
      */
     void WorkerQueue::run(unsigned int threadCount)
     {
+        if (!this->slots.empty()) {
+            return;
+        }
+
         this->terminated = false;
 
         if (threadCount < 1) {
@@ -966,16 +2414,57 @@ namespace fastcgi
             }
         }
 
-        for (auto i = 0; i < threadCount; i++) {
-            auto thread = new std::thread(Worker(*this));
-            this->threadPool.push_back(thread);
+        if (this->maxThreads == 0) {
+            this->minThreads = threadCount;
+            this->maxThreads = threadCount;
+        }
+
+        threadCount = std::min<size_t>(std::max<size_t>(threadCount, this->minThreads), this->maxThreads);
+
+        const NumaTopology& topology = NumaTopology::get();
+
+        // All slots exist before the first worker may steal
+        for (size_t i = 0; i < this->maxThreads; i++) {
+            Slot* slot = new Slot();
+
+            slot->node = -1;
+
+            if (!this->cpus.empty()) {
+                slot->cpus = topology.spread(this->cpus, i, slot->node);
+            }
+
+            slot->thread = NULL;
+            slot->active = (i < threadCount);
+            slot->runningSince = 0;
+            slot->waitTime = 0;
+            slot->waitCount = 0;
+            slot->seed = (i + 1) * 0x9e3779b9;
+            slot->ticks = 0;
+            slot->current = 0;
+            slot->sliceStart = Clock::now();
+
+            for (size_t c = 0; c < SERVICE_CLASS_COUNT; c++) {
+                slot->deficit[c] = this->quantum[c];
+            }
+
+            this->slots.push_back(slot);
+        }
+
+        this->threads = threadCount;
+
+        for (size_t i = 0; i < threadCount; i++) {
+            this->startWorker(this->slots[i]);
+        }
+
+        if (this->minThreads < this->maxThreads) {
+            this->monitor = new std::thread(&WorkerQueue::adjust, this);
         }
     }
 
     /**
      * Create a new worker
      */
-    Worker::Worker(WorkerQueue& queue) : queue(queue)
+    Worker::Worker(WorkerQueue& queue, WorkerQueue::Slot* slot) : queue(queue), slot(slot)
     {
     }
 
@@ -985,16 +2474,35 @@ namespace fastcgi
 
     void Worker::operator ()()
     {
+        WorkerQueue::local.queue = &this->queue;
+        WorkerQueue::local.slot = this->slot;
+
+        WorkerCallbackPtr handlers[WorkerQueue::POP_BATCH];
+
         while(!this->queue.isTerminated()) {
-            auto handler = this->queue.pop();
+            size_t count = this->queue.pop(handlers, WorkerQueue::POP_BATCH);
 
-            // Null pointer
-            if (handler == NULL) {
-                continue;
+            // Terminated or retired
+            if (count == 0) {
+                break;
             }
 
-            if (!(*handler)()) {
-                this->queue.push(handler);
+            for (size_t i = 0; i < count; i++) {
+                WorkerCallbackPtr& handler = handlers[i];
+                ServiceClass serviceClass = handler->serviceClass;
+
+                this->slot->runningSince = WorkerQueue::Clock::now().time_since_epoch().count();
+                bool complete = (*handler)();
+                this->slot->runningSince = 0;
+
+                this->queue.charge(serviceClass, handler->cost);
+                handler->cost = 0;
+
+                if (!complete) {
+                    this->queue.push(handler);
+                }
+
+                handler.reset();
             }
         }
     }
@@ -1010,139 +2518,130 @@ namespace fastcgi
         ////////////////////////
         // Variable Container
 
-        int32_t readSizeFromStream(std::istream& in)
+        std::ostream& operator<<(std::ostream& out, Variable& var)
         {
-            if (!in.good()) {
-                throw std::runtime_error("Failed to read variable size");
+            if (var.getSize() <= 0) {
+                return out;
             }
 
-            char s;
-            uint32_t size = 0;
+            char* buffer = new char[var.getSize()];
+
+            var.putData(buffer);
+            out.write(buffer, var.getSize());
 
-            in >> s;
+            delete [] buffer;
+            return out;
+        }
 
-            if (!in.good()) {
-                throw std::runtime_error("Failed to read variable size");
+        uint32_t Variable::readSize(char* buffer, size_t& readSize) const
+        {
+            if (readSize < encodedLengthSize(*buffer)) {
+                throw IOSegmentViolationException("Cannot read variable size from buffer (buffer too small).");
             }
 
-            if (s >> 7) { // High value bit
-                char *sbuf = new char[3];
-                char* p = (char*)&size;
+            return decodeLength(buffer);
+        }
 
-                in.get(sbuf, 3);
+        ////////////////////////
+        // Params decoder
 
-                if (!in.good()) {
-                    delete [] sbuf;
-                    throw std::runtime_error("Failed to read variable size");
-                }
+        ParamsDecoder::ParamsDecoder() : decoded(0), complete(false)
+        {
+            this->buffer.reserve(DEFAULT_BUFFER_SIZE);
+            this->params.reserve(DEFAULT_PARAM_COUNT);
 
-                memcpy(p++, &s, 1);
-                memcpy(p, sbuf, 3);
+            for (size_t i = 0; i < KNOWN_PARAM_COUNT; i++) {
+                this->known[i] = NOT_FOUND;
+            }
+        }
 
-                delete [] sbuf;
-                size = convertFromBigEndian(size);
-            } else {
-                size = (uint32_t)s;
+        void ParamsDecoder::append(const char* data, size_t size)
+        {
+            if (this->complete) {
+                throw IOSegmentViolationException("Out of sequence record chunk for name/value stream");
             }
 
-            return size;
+            this->buffer.insert(this->buffer.end(), data, data + size);
+            this->decode();
         }
 
-        std::ostream& operator<<(std::ostream& out, Variable& var)
+        void ParamsDecoder::decode()
         {
-            if (var.getSize() <= 0) {
-                return out;
-            }
+            const char* begin = this->buffer.data();
+            const char* end = begin + this->buffer.size();
+            const char* p = begin + this->decoded;
 
-            char* buffer = new char[var.getSize()];
+            while (p < end) {
+                size_t nameLengthSize = encodedLengthSize(p[0]);
 
-            var.putData(buffer);
-            out.write(buffer, var.getSize());
+                if ((size_t)(end - p) <= nameLengthSize) {
+                    break;
+                }
 
-            delete [] buffer;
-            return out;
-        }
+                size_t valueLengthSize = encodedLengthSize(p[nameLengthSize]);
 
-        /**
-         * Read var from stream operator
-         */
-        std::istream& operator>>(std::istream& in, Variable& var)
-        {
-            uint32_t nameSize = readSizeFromStream(in);
-            uint32_t valueSize = readSizeFromStream(in);
+                if ((size_t)(end - p) < (nameLengthSize + valueLengthSize)) {
+                    break;
+                }
+
+                Param param;
+                param.nameSize = decodeLength(p);
+                param.valueSize = decodeLength(p + nameLengthSize);
+
+                const char* name = p + nameLengthSize + valueLengthSize;
 
-            bool  good = false;
-            char* name = new char[nameSize + 1];
-            char* value = new char[valueSize + 1];
+                // Incomplete, wait for the next record
+                if ((size_t)(end - name) < ((size_t)param.nameSize + param.valueSize)) {
+                    break;
+                }
 
-            in.read(name, nameSize);
-            if (in.good()) {
-                in.read(value, valueSize);
+                param.nameOffset = name - begin;
 
-                if (valueSize != in.gcount()) {
-                    delete [] name;
-                    delete [] value;
+                // The first occurrence wins, same as find() by name
+                KnownParam id = findKnownParam(name, param.nameSize);
 
-                    throw std::runtime_error("Failed to read variable data from fcgi stream");
+                if ((id != KnownParam::UNKNOWN) && (this->known[(size_t)id] == NOT_FOUND)) {
+                    this->known[(size_t)id] = (uint32_t)this->params.size();
                 }
-            }
 
-            var.name(std::string(name));
-            var.value(std::string(value));
+                this->params.push_back(param);
 
-            delete [] name;
-            delete [] value;
+                p = name + param.nameSize + param.valueSize;
+            }
 
-            return in;
+            this->decoded = p - begin;
         }
 
-        uint32_t Variable::readSize(char* buffer, size_t& readSize) const
+        void ParamsDecoder::finish()
         {
-            if (!(*buffer >> 7)) {
-                return (uint32_t)*buffer;
-            }
-
-            if (readSize < sizeof(uint32_t)) {
-                throw IOSegmentViolationException("Cannot read variable size from buffer (buffer too small).");
+            if (this->decoded != this->buffer.size()) {
+                throw IOSegmentViolationException("Truncated name/value pair in stream");
             }
 
-            uint32_t size = 0;
-            memcpy(&size, buffer, sizeof(uint32_t));
-            size = convertFromBigEndian(size);
-
-            return size;
+            this->complete = true;
         }
 
-        std::vector<Variable> protocol::Variable::parseFromStream(std::istream& in)
+        bool ParamsDecoder::find(const char* name, size_t nameSize, StringRef& value) const
         {
-            std::vector<Variable> result;
+            KnownParam id = findKnownParam(name, nameSize);
 
-            while (in.good()) {
-                try {
-                    Variable v;
-                    in >> v;
+            if (id != KnownParam::UNKNOWN) {
+                return this->find(id, value);
+            }
 
-                    result.push_back(v);
-                } catch (std::runtime_error& e) {
+            for (size_t i = 0; i < this->params.size(); i++) {
+                if (this->name(i).equals(name, nameSize)) {
+                    value = this->value(i);
+                    return true;
                 }
             }
 
-            return result;
+            return false;
         }
 
         size_t Variable::putSize(char *buffer, const size_t& size) const
         {
-            if (size > MAX_BYTE_SIZE) {
-                uint32_t s = convertToBigEndian((uint32_t)size);
-                memcpy(buffer, &s, sizeof(int32_t));
-
-                return sizeof(uint32_t);
-            }
-
-            unsigned char v = (unsigned char)size;
-            memcpy(buffer, &v, sizeof(unsigned char));
-
-            return sizeof(unsigned char);
+            return encodeLength((uint32_t)size, (unsigned char*)buffer);
         };
 
         size_t Variable::getSize() const
@@ -1151,8 +2650,8 @@ namespace fastcgi
             size_t valueSize = this->getValueSize();
             size_t size = nameSize + valueSize;
 
-            size += (nameSize > MAX_BYTE_SIZE)? 4 : 1;
-            size += (valueSize > MAX_BYTE_SIZE)? 4 : 1;
+            size += lengthSize(nameSize);
+            size += lengthSize(valueSize);
 
             return size;
         };
@@ -1161,7 +2660,6 @@ namespace fastcgi
         {
             size_t nameSize = this->getNameSize();
             size_t valueSize = this->getValueSize();
-            size_t size = this->getSize();
 
             buffer += this->putSize(buffer, nameSize);
             buffer += this->putSize(buffer, valueSize);
@@ -1211,6 +2709,11 @@ namespace fastcgi
             return NULL;
         }
 
+        ContentReference* Message::getContentReference() const
+        {
+            return NULL;
+        }
+
         const Header& Message::getHeader() const
         {
             return this->header;
@@ -1242,8 +2745,8 @@ namespace fastcgi
         //
 
         GenericMessage::GenericMessage(uint16_t id, unsigned char type, const char* data, size_t size) : Message(id, type),
-                data(data),
-                size(size)
+                size(size),
+                data(data)
         {
             if (size > MAX_INT16_SIZE) {
                 throw IOException("Message data size too large");
@@ -1262,7 +2765,55 @@ namespace fastcgi
             return this->data;
         }
 
-        EndRequestMessage::EndRequestMessage(uint16_t id, uint32_t status, unsigned char fcgiStatus) : Message(id, FCGI_END_REQUEST)
+        ReferenceMessage::ReferenceMessage(uint16_t id, unsigned char type, ContentReference* content, size_t offset, size_t size) :
+                GenericMessage(id, type, content->getData() + offset, size),
+                content(content)
+        {
+        }
+
+        ContentReference* ReferenceMessage::getContentReference() const
+        {
+            return this->content;
+        }
+
+        /////////////////////////////////////////////////////
+        //
+        // Content reference impl
+        //
+
+        ContentReference::ContentReference(const char* data, size_t size, ReleaseCallback release) :
+                data(data),
+                size(size),
+                callback(release),
+                references(1)
+        {
+        }
+
+        ContentReference::~ContentReference()
+        {
+            if (this->callback) {
+                this->callback();
+            }
+        }
+
+        void ContentReference::acquire()
+        {
+            this->references.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        void ContentReference::release()
+        {
+            if (this->references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                delete this;
+            }
+        }
+
+        void ContentReference::cleanup(const void* /* data */, size_t /* size */, void* arg)
+        {
+            static_cast<ContentReference*>(arg)->release();
+        }
+
+                EndRequestMessage::EndRequestMessage(uint16_t id, uint32_t status, unsigned char fcgiStatus) : Message(id, FCGI_END_REQUEST)
         {
             this->header.contentLength = sizeof(this->record.body);
             this->record.header = this->header;
@@ -1278,9 +2829,8 @@ namespace fastcgi
 
         const char* EndRequestMessage::raw() const
         {
-            EndRequestRecord* r = (EndRequestRecord*)this->_raw;
-            *r = this->record;
-            Client::prepareOutRecordSegment(*r);
+            EndRequestRecord r = encode(this->record);
+            memcpy(this->_raw, &r, sizeof(r));
 
             return this->_raw;
         }
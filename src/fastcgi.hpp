@@ -2,17 +2,22 @@
 #pragma once
 
 #include <stdexcept>
+#include <cstring>
 #include <queue>
 #include <map>
 #include <list>
 #include <memory>
+#include <functional>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 
 #include <event2/listener.h>
 #include <event2/bufferevent.h>
 #include <event2/buffer.h>
+#include <event2/thread.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -20,6 +25,11 @@
 
 #include "fcgistream.hpp"
 #include "fastcgi_constants.hpp"
+#include "fastcgi_codec.hpp"
+#include "fastcgi_params.hpp"
+#include "fastcgi_queue.hpp"
+#include "fastcgi_pool.hpp"
+#include "fastcgi_affinity.hpp"
 
 
 /**
@@ -28,16 +38,28 @@
 namespace fastcgi
 {
     class IOHandler;
+    class IOBackend;
+    class Reactor;
     class Request;
     class Client;
 
+    /**
+     * Shared Pointer to a client
+     */
+    typedef std::shared_ptr<Client> ClientPtr;
+
+    /**
+     * Shared pointer to a request
+     */
+    typedef std::shared_ptr<Request> RequestPtr;
+
     class IOException : public std::runtime_error {
         public:
             inline IOException(const std::string& msg) : std::runtime_error(msg)
             {}
     };
 
-    class IOSegmentViolationException : IOException {
+    class IOSegmentViolationException : public IOException {
         public:
             inline IOSegmentViolationException(const std::string& msg) : IOException(msg)
             {};
@@ -47,56 +69,16 @@ namespace fastcgi
      * Low level protocol
      */
     namespace protocol {
-        const uint32_t MAX_INT32_SIZE = 0x7fffffff;
-        const uint32_t MAX_INT16_SIZE = 0x7fff;
-        const uint32_t MAX_BYTE_SIZE = 0x7f;
-
-        struct Header {
-            unsigned char version;
-            unsigned char type;
-            uint16_t requestId; // char[2]
-            uint16_t contentLength; // char[2]
-            unsigned char paddingLength;
-            unsigned char reserved;
-        };
-
+        /**
+         * A record as seen by the dispatcher
+         *
+         * The content is a view into the connection's input buffer and is only
+         * valid while the record is being dispatched. Consumers that need the
+         * data later on must copy it.
+         */
         struct Record {
             Header header;
-            char *content = NULL;
-        };
-
-        struct BeginRequestBody {
-            uint16_t role; // char[2] / uint16
-            unsigned char flags;
-            unsigned char reserved[5];
-        };
-
-
-        struct BeginRequestRecord {
-            Header header;
-            BeginRequestBody body;
-        };
-
-
-        struct EndRequestBody {
-            uint32_t appStatus; // char[4] / uint32
-            unsigned char protocolStatus;
-            unsigned char reserved[3];
-        };
-
-        struct EndRequestRecord {
-            Header header;
-            EndRequestBody body;
-        };
-
-        struct UnknownTypeBody {
-            unsigned char type;
-            unsigned char reserved[7];
-        };
-
-        struct UnknownTypeRecord {
-            Header header;
-            UnknownTypeBody body;
+            const char *content = NULL;
         };
 
         /**
@@ -159,17 +141,185 @@ namespace fastcgi
                  * store this->getSize() bytes
                  */
                 void putData(char* buffer) const;
+        };
+
+        std::ostream& operator<<(std::ostream& out, Variable& var);
+
+        /**
+         * Non-owning reference to a string
+         */
+        struct StringRef {
+            const char* data = NULL;
+            size_t size = 0;
+
+            inline StringRef() {};
+            inline StringRef(const char* data, size_t size) : data(data), size(size) {};
+
+            inline bool empty() const
+            {
+                return (this->size == 0);
+            }
+
+            inline bool equals(const char* other, size_t otherSize) const
+            {
+                return (this->size == otherSize) && (memcmp(this->data, other, otherSize) == 0);
+            }
+
+            inline bool operator==(const std::string& other) const
+            {
+                return this->equals(other.data(), other.size());
+            }
+
+            inline std::string str() const
+            {
+                return std::string(this->data, this->size);
+            }
+        };
+
+        /**
+         * Incremental name/value pair decoder (PARAMS, GET_VALUES)
+         *
+         * Record contents are appended to a single growing buffer and all complete pairs
+         * are decoded right away, so pairs may span record boundaries. Pairs are stored
+         * as offsets into that buffer, no allocation is made per variable.
+         * Well known names (see fastcgi_params.hpp) are indexed while decoding, all
+         * other names are looked up by scanning the flat table.
+         *
+         * References returned by name()/value() are invalidated by append().
+         */
+        class ParamsDecoder
+        {
+            protected:
+                struct Param {
+                    size_t nameOffset;
+                    uint32_t nameSize;
+                    uint32_t valueSize; ///< The value follows the name
+                };
+
+                std::vector<char> buffer;
+                std::vector<Param> params;
+                uint32_t known[KNOWN_PARAM_COUNT]; ///< Index into params per known name
+                size_t decoded; ///< Number of buffer bytes decoded so far
+                bool complete;
+
+                /**
+                 * Decode all complete pairs from the buffer
+                 */
+                void decode();
 
             public:
+                const static size_t DEFAULT_BUFFER_SIZE = 4096;
+                const static size_t DEFAULT_PARAM_COUNT = 64;
+                const static uint32_t NOT_FOUND = 0xffffffff;
+
+                ParamsDecoder();
+
+                /**
+                 * Append a record's content and decode it
+                 *
+                 * @param[in]  data  Pointer to the content
+                 * @param[in]  size  Size of the content
+                 */
+                void append(const char* data, size_t size);
+
+                /**
+                 * Mark the stream complete (empty record received)
+                 *
+                 * @throws IOSegmentViolationException if a pair was truncated
+                 */
+                void finish();
+
+                inline bool isComplete() const
+                {
+                    return this->complete;
+                }
+
+                /**
+                 * Number of decoded pairs
+                 */
+                inline size_t size() const
+                {
+                    return this->params.size();
+                }
+
+                inline StringRef name(size_t index) const
+                {
+                    return StringRef(this->buffer.data() + this->params[index].nameOffset, this->params[index].nameSize);
+                }
+
+                inline StringRef value(size_t index) const
+                {
+                    const Param& p(this->params[index]);
+                    return StringRef(this->buffer.data() + p.nameOffset + p.nameSize, p.valueSize);
+                }
+
+                /**
+                 * Find a value by name
+                 *
+                 * @param[in]  name   The variable name
+                 * @param[out] value  The value, if found
+                 * @return true if the variable was found
+                 */
+                bool find(const char* name, size_t nameSize, StringRef& value) const;
+
                 /**
-                 * Parse content
+                 * Find a value by its well known name
+                 *
+                 * @param[in]  param  The parameter id
+                 * @param[out] value  The value, if found
+                 * @return true if the variable was found
                  */
-                static std::vector<Variable> parseFromStream(std::istream& in);
+                inline bool find(KnownParam param, StringRef& value) const
+                {
+                    uint32_t index = (param == KnownParam::UNKNOWN)? NOT_FOUND : this->known[(size_t)param];
+
+                    if (index == NOT_FOUND) {
+                        return false;
+                    }
+
+                    value = this->value(index);
+                    return true;
+                }
         };
 
+        /**
+         * Caller owned record content shared by one or more records
+         *
+         * Each record in an output buffer holds a reference. The release callback is
+         * invoked when the last reference is dropped, the instance deletes itself.
+         */
+        class ContentReference
+        {
+            public:
+                ContentReference(const char* data, size_t size, ReleaseCallback release);
 
-        std::istream& operator>>(std::istream& in, Variable& var);
-        std::ostream& operator<<(std::ostream& out, Variable& var);
+            private:
+                ~ContentReference();
+
+                const char* data;
+                size_t size;
+                ReleaseCallback callback;
+                std::atomic<size_t> references;
+
+            public:
+                inline const char* getData() const
+                {
+                    return this->data;
+                }
+
+                inline size_t getSize() const
+                {
+                    return this->size;
+                }
+
+                void acquire();
+                void release();
+
+                /**
+                 * evbuffer cleanup callback, arg is the ContentReference
+                 */
+                static void cleanup(const void* data, size_t size, void* arg);
+        };
 
         /**
          * Wraps a FastCGI Message
@@ -231,6 +381,13 @@ namespace fastcgi
                  * Returns the data to send
                  */
                 virtual const char* getData() const = 0;
+
+                /**
+                 * Returns the shared content if the data must be sent by reference
+                 *
+                 * @return The content reference or NULL, if the data may be copied
+                 */
+                virtual ContentReference* getContentReference() const;
         };
 
         /**
@@ -266,6 +423,28 @@ namespace fastcgi
                 virtual const char* getData() const;
         };
 
+        /**
+         * A record referencing a slice of shared content instead of copying it
+         */
+        class ReferenceMessage : public GenericMessage
+        {
+            public:
+                /**
+                 * @param[in]  id       The request ID for this message
+                 * @param[in]  type     The message type
+                 * @param[in]  content  The shared content
+                 * @param[in]  offset   Offset of this record's slice
+                 * @param[in]  size     Size of the slice. This must not exceed MAX_INT16_SIZE
+                 */
+                ReferenceMessage(uint16_t id, unsigned char type, ContentReference* content, size_t offset, size_t size);
+
+            protected:
+                ContentReference* content;
+
+            public:
+                virtual ContentReference* getContentReference() const;
+        };
+
         /**
          * Wraps EndRequestRecord
          */
@@ -285,6 +464,11 @@ namespace fastcgi
         };
     };
 
+    /**
+     * Resumes a suspended request handler
+     */
+    typedef std::function<void()> Resumer;
+
     /**
      * Abstract request handler
      */
@@ -313,11 +497,40 @@ namespace fastcgi
              */
             void finish(uint16_t status);
 
+            /**
+             * Wait for more STDIN or DATA input
+             *
+             * Return false from handle() afterwards. The handler is called again once a
+             * record arrived that was not received when this handle() call started.
+             */
+            void waitForInput();
+
+            /**
+             * Wait until the client's output drained below the low watermark
+             *
+             * Return false from handle() afterwards. If the output is not backed up, the
+             * handler is called again right away.
+             */
+            void waitForOutput();
+
+            /**
+             * Wait for an external event (i.e. the next GridFS chunk was fetched)
+             *
+             * Return false from handle() afterwards and pass the returned callback to the
+             * producer of the event. The handler is called again once the callback was
+             * invoked, which may happen from any thread and even before handle() returned.
+             * Only the callback of the latest suspend() has an effect.
+             *
+             * @return The callback resuming the handler
+             */
+            Resumer suspend();
+
         public:
             /**
              * Called when a data fragment (STDIN, DATA) is received.
              *
-             * By default this is a NOOP dummy
+             * By default this is a NOOP dummy. The record content is only valid
+             * during this call.
              *
              * @param[in]  record  The received record
              */
@@ -333,6 +546,9 @@ namespace fastcgi
             /**
              * Handle the assigned request
              *
+             * A handler that cannot make progress should call one of the wait methods before
+             * returning false, so it does not occupy a worker until it can continue.
+             *
              * @return Returns true when processing the request is complete,
              * @return false if there are more actions to do.
              * @return Returning false allows processing chunk wise allowing other requests
@@ -378,27 +594,223 @@ namespace fastcgi
      */
     typedef std::function<bool(void)> WorkerCallback;
 
+    /**
+     * Scheduling class of a worker callback
+     *
+     * Requests start out as INTERACTIVE and become BULK once they sent a lot of output,
+     * so large downloads do not delay small responses.
+     */
+    enum class ServiceClass : unsigned char { INTERACTIVE = 0, BULK = 1 };
+
+    const size_t SERVICE_CLASS_COUNT = 2;
+
+    /**
+     * A worker callback with its scheduling state
+     *
+     * Tasks are intrusive queue nodes: a queued task references itself, so queueing
+     * allocates nothing. Create them with WorkerTask::create().
+     */
+    struct WorkerTask {
+        WorkerCallback callback;
+        ServiceClass serviceClass = ServiceClass::INTERACTIVE; ///< Queue for the next run, may be changed by the callback
+        size_t cost = 0; ///< Bytes sent by the last run, set by the callback
+        int node = -1; ///< Preferred NUMA node, -1 for any
+        std::chrono::steady_clock::time_point queuedAt; ///< Set by WorkerQueue::push()
+
+        WorkerTask* next = NULL; ///< Injection queue link
+        std::shared_ptr<WorkerTask> queued; ///< Keeps the task alive while it is queued
+
+        inline bool operator()()
+        {
+            return this->callback();
+        }
+
+        /**
+         * Create a pool allocated task
+         */
+        static inline std::shared_ptr<WorkerTask> create()
+        {
+            return std::allocate_shared<WorkerTask>(PoolAllocator<WorkerTask>());
+        }
+    };
+
     /**
      * Shared pointer to worker callback
      */
-    typedef std::shared_ptr<WorkerCallback> WorkerCallbackPtr;
+    typedef std::shared_ptr<WorkerTask> WorkerCallbackPtr;
 
     /**
      * Worker queue
+     *
+     * Work stealing scheduler: each worker thread owns a deque per service class.
+     * Callbacks pushed by a worker (i.e. unfinished handlers) go to its own deque,
+     * callbacks pushed by other threads go to a shared injection queue. Workers take
+     * from their own deque first, then from the injection queue and finally steal from
+     * a random other worker. Workers that found nothing sleep until the next push.
+     *
+     * Workers take their own callbacks from the top as well, so unfinished handlers are
+     * served round robin like in a FIFO queue.
+     *
+     * Each worker serves the service classes by deficit round robin: a class's turn
+     * lasts until the bytes sent by its callbacks exceed the class quantum or the slice
+     * time budget is used up.
+     *
+     * If CPUs are set, workers are bound to them and grouped by NUMA node. Workers
+     * prefer callbacks of their own node, both from the injection queue and when
+     * stealing.
+     *
+     * The number of workers is elastic within the thread limits: callbacks may block
+     * on the database, so a monitor thread starts workers while callbacks wait longer
+     * than the target delay or all workers are blocked. Workers that stay idle for the
+     * idle timeout retire.
      */
-    class WorkerQueue : protected std::queue<WorkerCallbackPtr>
+    class WorkerQueue
     {
-        using parent = std::queue<WorkerCallbackPtr>;
+        friend class Worker;
 
         public:
             WorkerQueue();
             ~WorkerQueue();
 
+            const static unsigned STEAL_ROUNDS = 2; ///< Steal attempts over all workers before sleeping
+            const static unsigned INJECTOR_INTERVAL = 61; ///< Check the injection queue first every n-th pop
+            const static size_t DEFAULT_QUANTUM = 256 * 1024; ///< Bytes per turn
+            const static unsigned DEFAULT_SLICE_BUDGET = 10000; ///< Microseconds per turn
+            const static size_t POP_BATCH = 8; ///< Callbacks a worker takes at once
+            const static unsigned ADJUST_INTERVAL = 100; ///< Milliseconds between pool size checks
+            const static unsigned BLOCKED_THRESHOLD = 10000; ///< Microseconds a callback runs until its worker counts as blocked
+            const static unsigned DEFAULT_TARGET_DELAY = 5000; ///< Microseconds in queue before the pool grows
+            const static unsigned DEFAULT_IDLE_TIMEOUT = 30000; ///< Milliseconds idle before a worker retires
+
+            /**
+             * Pool sizing state
+             */
+            struct Metrics {
+                size_t threads; ///< Running workers
+                size_t minThreads;
+                size_t maxThreads;
+                size_t busy; ///< Workers running a callback
+                size_t blocked; ///< Workers running a callback for longer than BLOCKED_THRESHOLD
+                size_t queued; ///< Callbacks in all queues
+                uint64_t queueDelay; ///< Average time in queue during the last interval (microseconds)
+                uint64_t grown; ///< Workers started because of queueing delay
+                uint64_t retired; ///< Workers retired after the idle timeout
+            };
+
         protected:
-            std::mutex protector;
+            typedef WorkStealingDeque<WorkerTask*> Deque;
+            typedef std::chrono::steady_clock Clock;
+
+            /**
+             * Intrusive FIFO list of tasks
+             */
+            struct TaskList {
+                WorkerTask* first = NULL;
+                WorkerTask* last = NULL;
+            };
+
+            /**
+             * Injection queues of a NUMA node
+             */
+            struct NodeQueues {
+                TaskList classes[SERVICE_CLASS_COUNT];
+            };
+
+            /**
+             * Per worker state
+             */
+            struct Slot {
+                Deque deques[SERVICE_CLASS_COUNT];
+                uint32_t seed; ///< Victim selection
+                unsigned ticks;
+                int node; ///< NUMA node, -1 if not placed
+                CpuSet cpus; ///< CPUs of the worker, empty if not placed
+                std::thread* thread;
+                bool active; ///< A worker thread runs on this slot (protected by protector)
+
+                // Pool sizing
+                std::atomic<Clock::rep> runningSince; ///< Start of the running callback, 0 when idle
+                std::atomic<uint64_t> waitTime; ///< Time in queue of taken callbacks (nanoseconds)
+                std::atomic<uint64_t> waitCount;
+
+                // Deficit round robin
+                size_t current; ///< Class being served
+                int64_t deficit[SERVICE_CLASS_COUNT];
+                Clock::time_point sliceStart;
+            };
+
+            /**
+             * The queue and slot of the current worker thread
+             */
+            struct Local {
+                WorkerQueue* queue;
+                Slot* slot;
+            };
+
+            static thread_local Local local;
+
+            std::mutex protector; ///< Protects the injection queues, sleeping workers and pool size
             std::condition_variable readyCondition;
-            bool terminated;
-            std::list<std::thread*> threadPool;
+            std::condition_variable monitorCondition;
+            std::vector<NodeQueues> injection; ///< Any node first, then one per NUMA node
+            std::atomic<bool> terminated;
+            std::atomic<size_t> queued; ///< Callbacks in all queues
+            std::atomic<size_t> injected; ///< Callbacks in the injection queues
+            std::atomic<unsigned> sleeping;
+            std::vector<Slot*> slots; ///< One per possible worker
+            std::thread* monitor;
+
+            // Pool sizing
+            std::atomic<size_t> threads;
+            size_t minThreads;
+            size_t maxThreads;
+            Clock::duration targetDelay;
+            Clock::duration idleTimeout;
+            std::atomic<uint64_t> queueDelay;
+            std::atomic<uint64_t> grown;
+            std::atomic<uint64_t> retired;
+
+            size_t quantum[SERVICE_CLASS_COUNT];
+            Clock::duration sliceBudget;
+            CpuSet cpus; ///< Worker CPUs, empty for no placement
+
+            /**
+             * Get the slot of the calling thread or NULL if it is no worker of this queue
+             */
+            Slot* getLocalSlot() const;
+
+            /**
+             * Injection queue index of a NUMA node
+             */
+            inline size_t getQueueIndex(int node) const
+            {
+                return ((node < 0) || ((size_t)node + 1 >= this->injection.size()))? 0 : (size_t)node + 1;
+            }
+
+            size_t popInjected(size_t index, size_t serviceClass, WorkerCallbackPtr* tasks, size_t count);
+            WorkerCallbackPtr steal(Slot* thief, size_t serviceClass);
+            size_t takeClass(Slot* slot, size_t serviceClass, WorkerCallbackPtr* tasks, size_t count);
+            size_t take(Slot* slot, WorkerCallbackPtr* tasks, size_t count);
+
+            /**
+             * Charge the bytes sent by a callback to the current worker's deficit
+             */
+            void charge(ServiceClass serviceClass, size_t cost);
+
+            /**
+             * Start a worker thread on an inactive slot
+             */
+            void startWorker(Slot* slot);
+
+            /**
+             * Count workers running a callback and those blocked in one
+             */
+            void countBusy(size_t& busy, size_t& blocked) const;
+
+            /**
+             * Monitor thread: grow the pool while callbacks wait too long
+             */
+            void adjust();
 
         public:
             /**
@@ -409,7 +821,7 @@ namespace fastcgi
             void push(WorkerCallbackPtr& ptr);
 
             /**
-             * Remove and return the first element in queue
+             * Remove and return the next element
              *
              * This method must be called in a worker thread, since this call blocks
              * until 1) a handler is pushed to the queue or b) the queue is terminated.
@@ -418,25 +830,102 @@ namespace fastcgi
              */
             WorkerCallbackPtr pop();
 
+            /**
+             * Remove and return up to count elements of one service class
+             *
+             * Blocks like pop(), the injection queue is drained with a single lock.
+             *
+             * @param[out] tasks  Receives the callbacks
+             * @param[in]  count  The maximum number of callbacks
+             * @return The number of callbacks, 0 on queue termination or when the
+             *         calling worker retires
+             */
+            size_t pop(WorkerCallbackPtr* tasks, size_t count);
+
             /**
              * Terminate the worker queue and tell all handlers to exit
              */
             void terminate();
 
+            /**
+             * Terminate the worker queue and wait for the workers to exit
+             */
+            void stop();
+
             /**
              * check if the queue is terminated
              */
             bool isTerminated() const;
 
+            /**
+             * Returns the number of queued callbacks
+             */
+            size_t size();
+
+            /**
+             * Set the bytes a service class may send per turn
+             *
+             * The quanta weigh the classes against each other. Must be called before run().
+             */
+            void setQuantum(ServiceClass serviceClass, size_t bytes);
+
+            /**
+             * Set the time budget of a service class's turn
+             *
+             * Must be called before run().
+             *
+             * @param[in]  usec  The budget in microseconds
+             */
+            void setSliceBudget(unsigned int usec);
+
+            /**
+             * Bind the worker threads to the given CPUs
+             *
+             * Workers are spread across the NUMA nodes of the set and bound to their
+             * node's share of it. Must be called before run().
+             */
+            void setCpus(const CpuSet& cpus);
+
+            /**
+             * Let the pool size vary between the given limits
+             *
+             * Without limits the pool keeps the size passed to run(). Must be called
+             * before run().
+             */
+            void setThreadLimits(size_t minThreads, size_t maxThreads);
+
+            /**
+             * Set the time in queue above which the pool grows (any time)
+             *
+             * @param[in]  usec  The delay in microseconds
+             */
+            void setTargetDelay(unsigned int usec);
+
+            /**
+             * Set the time after which idle workers above the lower limit retire (any time)
+             *
+             * Sleeping workers apply the new timeout right away.
+             *
+             * @param[in]  msec  The timeout in milliseconds
+             */
+            void setIdleTimeout(unsigned int msec);
+
+            /**
+             * Get the pool sizing state
+             */
+            Metrics getMetrics() const;
+
             /**
              * Run the worker queue with the given amount of threads.
              *
              * This method will not block and can savely be called from the main thread.
+             * It must only be called once.
              *
              * @param[in] threadCount  The number of worker threads to create.
              *                         If this param is < 1, the number of threads will be
              *                         guessed std::thread::hardware_concurrency but at minimum 1
-             *                         thread is created
+             *                         thread is created. It is clamped to the thread
+             *                         limits if they are set.
              */
             void run(unsigned int threadCount);
     };
@@ -447,11 +936,12 @@ namespace fastcgi
     class Worker
     {
         public:
-            Worker(WorkerQueue& queue);
+            Worker(WorkerQueue& queue, WorkerQueue::Slot* slot);
             ~Worker();
 
         protected:
             WorkerQueue& queue;
+            WorkerQueue::Slot* slot;
 
         public:
             void operator()();
@@ -459,30 +949,127 @@ namespace fastcgi
 
 
     /**
-     * Http Request
+     * Admission control
+     *
+     * Decides whether new requests are accepted, based on the number of active requests,
+     * the worker queue depth and the amount of output buffered for slow clients.
+     * A limit of 0 disables the respective check.
      */
-    class Request
+    class AdmissionController
     {
-        friend streams::OutStreamBuffer;
-        friend Client;
-
-        public:
-            enum class Role : uint16_t { RESPONDER = FCGI_RESPONDER, AUTHORIZER = FCGI_AUTHORIZER, FILTER = FCGI_FILTER };
-
         public:
-            Request(const uint16_t& id, Role role, ClientPtr client);
-            ~Request();
-
-        private:
-            streams::InStream paramStream;
+            AdmissionController(WorkerQueue& queue);
 
         protected:
-            uint16_t id;
-            std::map<std::string, std::string> params;
-            Role role;
+            WorkerQueue& queue;
 
-            bool valid;
-            bool ready;
+            std::atomic<size_t> maxConnections; ///< Advertised as FCGI_MAX_CONNS and enforced on accept
+            size_t maxRequests; ///< Advertised as FCGI_MAX_REQS
+            size_t maxQueueDepth;
+            size_t maxBufferedBytes;
+
+            std::atomic<size_t> activeRequests;
+            std::atomic<size_t> bufferedBytes;
+            std::atomic<size_t> connections; ///< Connections accepted and not closed yet
+
+        public:
+            /**
+             * Try to admit a new request
+             *
+             * @return true if the request was admitted, false if we are overloaded
+             */
+            bool admit();
+
+            /**
+             * Release admitted requests
+             *
+             * @param[in]  count  Number of requests that ended
+             */
+            void release(size_t count = 1);
+
+            /**
+             * Try to admit a new connection
+             *
+             * @return true if the connection was admitted, false if FCGI_MAX_CONNS is reached
+             */
+            bool connect();
+
+            /**
+             * Release an admitted connection once it is closed
+             */
+            void disconnect();
+
+            /**
+             * Check if any of the limits is exceeded
+             */
+            bool isOverloaded();
+
+            /**
+             * Account output bytes that were buffered for a client
+             */
+            void addBufferedBytes(size_t size);
+
+            /**
+             * Account output bytes that were sent (or dropped)
+             */
+            void removeBufferedBytes(size_t size);
+
+            inline size_t getMaxConnections() const
+            {
+                return this->maxConnections;
+            }
+
+            inline void setMaxConnections(size_t max)
+            {
+                this->maxConnections = max;
+            }
+
+            inline size_t getMaxRequests() const
+            {
+                return this->maxRequests;
+            }
+
+            inline void setMaxRequests(size_t max)
+            {
+                this->maxRequests = max;
+            }
+
+            inline void setMaxQueueDepth(size_t max)
+            {
+                this->maxQueueDepth = max;
+            }
+
+            inline void setMaxBufferedBytes(size_t max)
+            {
+                this->maxBufferedBytes = max;
+            }
+    };
+
+
+    /**
+     * Http Request
+     */
+    class Request : public std::enable_shared_from_this<Request>
+    {
+        friend streams::OutStreamBuffer;
+        friend Client;
+        friend RequestHandler;
+
+        public:
+            enum class Role : uint16_t { RESPONDER = FCGI_RESPONDER, AUTHORIZER = FCGI_AUTHORIZER, FILTER = FCGI_FILTER };
+
+        public:
+            Request(const uint16_t& id, Role role, ClientPtr client);
+            ~Request();
+
+        protected:
+            uint16_t id;
+            ClientPtr client; ///< Must precede the streams, they copy it
+            protocol::ParamsDecoder params;
+            Role role;
+
+            std::atomic<bool> valid; ///< Cleared by finish() on a worker, read by the loop
+            bool ready;
 
             // Streams:
 
@@ -491,12 +1078,49 @@ namespace fastcgi
             streams::OutStream _stdout;
             streams::OutStream _stderr;
 
-            // Client ref
-            ClientPtr client;
             RequestHandlerPtr handler;
 
+            /**
+             * What a handler that returned false waits for
+             */
+            enum class Wait : unsigned char { NONE, INPUT, OUTPUT, SIGNAL };
+
+            std::mutex suspendMutex; ///< Protects the suspension state below
+            Wait waiting;
+            WorkerCallbackPtr suspended; ///< The handler's callback while it waits
+            uint32_t inputCount; ///< STDIN/DATA records received
+            uint32_t inputSeen; ///< inputCount when the current handle() call started
+            uint32_t signalToken; ///< Identifies the latest suspend()
+            bool signalled; ///< The latest suspend() was resumed already
+            bool cancelled; ///< The connection is gone
+
             void processIncommingRecord(const protocol::Record& record);
 
+            /**
+             * Set what the running handler waits for
+             */
+            void await(Wait wait);
+
+            /**
+             * Wait for an external event
+             *
+             * @return The callback ending the wait
+             */
+            Resumer awaitSignal();
+
+            /**
+             * Hand the callback of a waiting handler back to the workers
+             *
+             * @param[in]  reason  The event that occured, NONE resumes any wait
+             * @param[in]  token   The signal token for SIGNAL
+             */
+            void resume(Wait reason, uint32_t token = 0);
+
+            /**
+             * Let a waiting handler finish, the connection is gone
+             */
+            void cancel();
+
         public:
             /**
              * Send a message to the fastcgi client
@@ -519,6 +1143,57 @@ namespace fastcgi
              */
             void setHandler(RequestHandlerPtr handler);
 
+            /**
+             * Run the request handler
+             *
+             * @return true if the request is complete, false if the handler must be called again
+             */
+            bool handle();
+
+            /**
+             * Keep the handler's callback until it can make progress
+             *
+             * Called after handle() returned false. If the handler waits for input or an
+             * external event, the callback is kept until it occurs. Otherwise the callback
+             * is parked at the client if its output is backed up.
+             *
+             * @param[in]  callback  The worker callback running this request
+             * @return true if the callback is kept, false if it must be called again right away
+             */
+            bool suspend(WorkerCallbackPtr callback);
+
+            /**
+             * Get a request parameter
+             *
+             * The returned reference is valid for the lifetime of the request.
+             *
+             * @param[in]  name  The parameter name
+             * @return The parameter value or an empty reference if there is no such parameter
+             */
+            protocol::StringRef getParam(const std::string& name) const;
+
+            /**
+             * Get a well known request parameter
+             *
+             * @param[in]  param  The parameter id
+             * @return The parameter value or an empty reference if there is no such parameter
+             */
+            protocol::StringRef getParam(KnownParam param) const;
+
+            /**
+             * Check if a request parameter exists
+             */
+            bool hasParam(const std::string& name) const;
+            bool hasParam(KnownParam param) const;
+
+            /**
+             * Get all decoded request parameters
+             */
+            inline const protocol::ParamsDecoder& getParams() const
+            {
+                return this->params;
+            }
+
             /**
              * get the std stream
              */
@@ -551,6 +1226,14 @@ namespace fastcgi
                 return this->_stderr;
             }
 
+            /**
+             * Output content bytes sent so far (STDOUT and STDERR)
+             */
+            inline size_t getWrittenBytes() const
+            {
+                return this->_stdout.getWrittenBytes() + this->_stderr.getWrittenBytes();
+            }
+
             /**
              * Get the request id
              */
@@ -559,6 +1242,14 @@ namespace fastcgi
                 return this->id;
             };
 
+            /**
+             * Get the client connection of this request
+             */
+            inline ClientPtr getClient() const
+            {
+                return this->client;
+            };
+
             /**
              * get the request role
              */
@@ -576,33 +1267,89 @@ namespace fastcgi
     /**
      * FastCGI Client connection
      */
-    class Client
+    class Client : public std::enable_shared_from_this<Client>
     {
+        friend IOHandler;
+
         public:
-            Client(IOHandler& io, int socket);
+            /**
+             * @param[in]  io       The I/O handler
+             * @param[in]  socket   The connected socket
+             * @param[in]  reactor  The event loop owning this connection, NULL for the I/O handler's loop
+             */
+            Client(IOHandler& io, int socket, Reactor* reactor = NULL);
             ~Client();
 
         public:
             //! Typedef: map of requestId to request object
             typedef std::map<uint16_t, std::shared_ptr<Request> > RequestMap;
 
-//            enum StreamType { STDOUT, STDERR };
+            /**
+             * Output records waiting for the socket, per request
+             */
+            struct OutputQueue {
+                evbuffer* buffer = NULL; ///< Framed records
+                std::queue<size_t> records; ///< Size of each queued record
+                bool ended = false; ///< END_REQUEST was queued, drop the queue once drained
+            };
+
+            //! Typedef: map of requestId to pending output
+            typedef std::map<uint16_t, OutputQueue> OutputQueueMap;
 
-        public:
             /**
-             * Helper method for preparing incoming records (performing int endian conversion)
+             * Records of one request framed by a writer, handed to the owning loop
              *
-             * @param[in|out] segment
+             * Batches are recycled through an ObjectPool with their buffer and record list.
              */
-            template<class T> static void prepareInRecordSegment(T& segment);
+            struct OutputBatch {
+                std::atomic<OutputBatch*> next;
+                evbuffer* buffer; ///< Framed records
+                std::vector<size_t> records; ///< Size of each framed record
+                uint16_t requestId = 0;
+                bool ended = false; ///< Contains END_REQUEST
+
+                inline OutputBatch() : next(NULL), buffer(evbuffer_new()) {};
+
+                inline ~OutputBatch()
+                {
+                    if (this->buffer != NULL) {
+                        evbuffer_free(this->buffer);
+                    }
+                };
+
+                /**
+                 * Empty the batch for reuse, the buffer and the record list keep their memory
+                 */
+                inline void reset()
+                {
+                    if (this->buffer != NULL) {
+                        evbuffer_drain(this->buffer, evbuffer_get_length(this->buffer));
+                    }
+
+                    this->next = NULL;
+                    this->records.clear();
+                    this->requestId = 0;
+                    this->ended = false;
+                }
+            };
+
+            typedef ObjectPool<OutputBatch> OutputBatchPool;
 
             /**
-             * Helper method for preparing outgoing records (performing int endian conversion)
-             *
-             * @param[in|out] segment
+             * Amount of output bytes passed to the socket buffer before records are queued
+             * per request and interleaved round robin
+             */
+            static const size_t OUTPUT_WINDOW = 131072;
+
+            /**
+             * Default output watermarks for handler flow control
              */
-            template<class T> static void prepareOutRecordSegment(T& segment);
+            static const size_t OUTPUT_HIGH_WATERMARK = 1048576;
+            static const size_t OUTPUT_LOW_WATERMARK = 262144;
+
+//            enum StreamType { STDOUT, STDERR };
 
+        public:
             /**
              * Helper function for libevent callbacks
              *
@@ -611,6 +1358,41 @@ namespace fastcgi
              */
             static void eventReadCallback(bufferevent* event, void* ptr);
 
+            /**
+             * Helper function for libevent write callbacks (output buffer drained)
+             *
+             * @param[in] event
+             * @param[in] ptr   Pointer to the client instance
+             */
+            static void eventWriteCallback(bufferevent* event, void* ptr);
+
+            /**
+             * Helper function for libevent event callbacks (EOF, errors)
+             *
+             * @param[in] event
+             * @param[in] events  The BEV_EVENT_* flags
+             * @param[in] ptr     Pointer to the client instance
+             */
+            static void eventCallback(bufferevent* event, short events, void* ptr);
+
+            /**
+             * Output evbuffer callback, accounts the bytes sent to the socket
+             *
+             * @param[in] buffer
+             * @param[in] info   Added/deleted byte counts
+             * @param[in] ptr    Pointer to the client instance
+             */
+            static void eventOutputCallback(evbuffer* buffer, const evbuffer_cb_info* info, void* ptr);
+
+            /**
+             * Outbox event callback, runs on the owning loop after writers queued output
+             *
+             * @param[in]  fd         Ignored
+             * @param[in]  eventType  Ignored
+             * @param[in]  ptr        Pointer to the client instance
+             */
+            static void eventOutboxCallback(evutil_socket_t fd, short eventType, void* ptr);
+
             /**
              * Timer callback to trigger gc
              *
@@ -625,64 +1407,107 @@ namespace fastcgi
             int socket; ///< Socket descriptor
 
             IOHandler& io; ///< I/O handler instance
-            std::mutex socketMutex; ///< Socet protection mutex (for writing)
+            Reactor* reactor; ///< Owning event loop or NULL
             protocol::Record currentRecord; ///< the current record being read
 
             RequestMap requests; ///< current requests
-            bool isValid;
+            std::mutex requestsMutex; ///< Protects the request map
+            std::atomic<bool> isValid;
+            bool isClosing; ///< The connection is closed as soon as the output is flushed (bufferevent lock)
+
+            MpscQueue<OutputBatch> outbox; ///< Output from writers, consumed by the owning loop
+            ::event* outboxEvent; ///< Activated by writers to wake the owning loop
+            std::atomic<bool> outboxPending; ///< outboxEvent is active
+            std::atomic<size_t> pendingBytes; ///< Output bytes in the outbox
+
+            OutputQueueMap outputQueues; ///< Pending output per request (bufferevent lock)
+            std::list<uint16_t> outputSchedule; ///< Requests with pending output in round robin order (bufferevent lock)
+            size_t bufferedBytes; ///< Output bytes not yet sent to the socket (bufferevent lock)
+            evbuffer_cb_entry* outputCallback;
             bool keepConnection; ///< Keep the connection alive for further requests
+            std::list<WorkerCallbackPtr> parked; ///< Handlers waiting for the output to drain (bufferevent lock)
 
             /**
              * Dispatch events
              */
             void dispatch();
 
+            /**
+             * Answer a FCGI_GET_VALUES management record
+             */
+            void sendValues();
+
             /**
              * Called when a read event occours
              */
             void onRead(bufferevent*);
 
+            /**
+             * Called when the output buffer was drained
+             */
+            void onWrite(bufferevent*);
+
+            /**
+             * Called when the web server closed the connection or the socket failed
+             */
+            void onEvent(bufferevent*, short events);
+
             /**
              * Check if there is an active request with the given id
              */
             bool hasRequest(uint16_t id);
 
+            /**
+             * Returns the active request with the given id
+             *
+             * @param[in]  id  The request id
+             * @return The request or a null pointer if there is no such request
+             */
+            RequestPtr getRequest(uint16_t id);
+
+            /**
+             * Called after the END_REQUEST record of a request was written
+             *
+             * Resets the per-request state. The connection stays open for further requests
+             * unless the server did not ask to keep it (FCGI_KEEP_CONN).
+             *
+             * @param[in]  id  The finished request's id
+             */
+            void onEndRequest(uint16_t id);
+
+            /**
+             * Close the connection once all pending output has been sent
+             */
+            void closeWhenFlushed();
+
             /**
              * Perform garbage collection
              */
             void gc();
 
         private:
-            size_t headerBytesRead;
-            size_t contentBytesRead;
-            size_t paddingBytesRead;
-
-            bool headerReady;
-            bool contentReady;
-            bool paddingReady;
+            size_t recordSize; ///< Total size of the current record (header, content and padding)
 
             bufferevent *event;
 
             /**
-             * @param[in]      buffer  Pointer to buffer data
-             * @param[in|out]  size    total buffer size
-             * @return Returns the modified pointer after extracting the header
-             */
-            char* extractHeader(char* buffer, size_t& size);
-
-            /**
-             * @param[in]      buffer  Pointer to buffer data
-             * @param[in|out]  size    total buffer size
-             * @return Returns the modified pointer after extracting the content
+             * Extract the next complete record from the input buffer
+             *
+             * The header is decoded in place and the content is exposed as a view into
+             * the buffer memory. The buffer is only linearized (pulled up) when the record
+             * spans multiple buffer segments.
+             *
+             * @param[in]  event  The bufferevent of the connection
+             * @return Returns true if a complete record is available in currentRecord
              */
-            char* extractContent(char* buffer, size_t& size);
+            bool extractRecord(bufferevent* event);
 
             /**
-             * @param[in]      buffer  Pointer to buffer data
-             * @param[in|out]  size    total buffer size
-             * @return Returns the modified pointer after extracting the padding
+             * Remove the current record from the input buffer and reset the record state
+             *
+             * @param[in]  event  The bufferevent of the connection
              */
-            char* extractPadding(char* buffer, size_t& size);
+            void consumeRecord(bufferevent* event);
 
             /**
              * Reset the current record state
@@ -694,7 +1519,77 @@ namespace fastcgi
              */
             void destroy();
 
+            /**
+             * Returns the bufferevent with an additional reference or NULL if the client is invalid
+             *
+             * The caller must release the reference with bufferevent_decref(). It does not
+             * lock anything, so it may be called with the bufferevent lock held.
+             */
+            bufferevent* acquireEvent();
+
+            /**
+             * Frame the given messages into the target buffer with a single vectored append
+             *
+             * @param[in]  target    The buffer to append to
+             * @param[in]  messages  Pointer to the first message pointer
+             * @param[in]  count     Number of messages
+             * @param[out] records   If not NULL, the size of each framed record is appended
+             */
+            static void frameMessages(evbuffer* target, protocol::Message* const* messages, size_t count, std::vector<size_t>* records = NULL);
+
+            /**
+             * Queue a batch to the output queue of its request
+             *
+             * Records are written through to the socket buffer when no other output is pending.
+             * The caller must hold the bufferevent lock.
+             */
+            void queueBatch(bufferevent* event, OutputBatch& batch);
+
+            /**
+             * Move everything from the outbox to the socket buffer or the request queues
+             *
+             * Runs on the owning loop only.
+             */
+            void flushOutbox();
+
+            /**
+             * Drop everything in the outbox
+             */
+            void discardOutbox();
+
+            /**
+             * Move queued records to the socket buffer
+             *
+             * Requests are served round robin, one record per turn, while the socket buffer
+             * holds less than OUTPUT_WINDOW bytes. The caller must hold the bufferevent lock.
+             */
+            void pumpOutput(bufferevent* event);
+
+            /**
+             * Check if all output has been sent (bufferevent lock required)
+             */
+            bool isFlushed(bufferevent* event);
+
+            /**
+             * Hand parked handlers back to the workers once the output fell below the
+             * low watermark (bufferevent lock required)
+             */
+            void resumeParked();
+
+            /**
+             * Send multiple messages to the client
+             */
+            void write(protocol::Message* const* messages, size_t count);
+
         public:
+            /**
+             * Start reading from the connection
+             *
+             * In multi reactor mode the owning loop may call back right away, so the
+             * client must already be owned by a ClientPtr.
+             */
+            void start();
+
             /**
              * Send a message to the client
              *
@@ -702,6 +1597,41 @@ namespace fastcgi
              */
             void write(protocol::Message& message);
 
+            /**
+             * Send multiple messages to the client at once
+             *
+             * The records are framed by the calling thread and passed to the connection's
+             * event loop through a lock free queue, which moves them to the socket. Messages
+             * of different requests are interleaved fairly on the connection.
+             *
+             * @param[in]  messages  The messages to send (in order)
+             */
+            void write(const std::vector<protocol::Message*>& messages);
+
+            /**
+             * Park a handler while the connection's output exceeds the high watermark
+             *
+             * The handler is pushed to the worker queue again from the I/O thread as soon
+             * as the output drained below the low watermark. Parked handlers are dropped
+             * when the connection is closed.
+             *
+             * @param[in]  callback  The worker callback of an unfinished handler
+             * @return true if the handler was parked, false if it may continue right away
+             */
+            bool park(WorkerCallbackPtr callback);
+
+            /**
+             * Hand a suspended handler back to the workers
+             */
+            void wake(WorkerCallbackPtr callback);
+
+            /**
+             * Get the NUMA node of the loop serving this connection
+             *
+             * @return The node or -1 if the loop is not placed
+             */
+            int getNode() const;
+
             /**
              * Check validity flag
              */
@@ -712,9 +1642,177 @@ namespace fastcgi
     };
 
     /**
-     * Shared Pointer to a client
+     * Available socket I/O backends
      */
-    typedef std::shared_ptr<Client> ClientPtr;
+    enum class Backend { LIBEVENT, IO_URING };
+
+    /**
+     * Socket I/O backend
+     *
+     * A backend accepts connections and moves the bytes between the sockets and the
+     * bufferevents the clients work on. Record parsing and output scheduling are the
+     * same for all backends.
+     */
+    class IOBackend
+    {
+        public:
+            IOBackend(IOHandler& io);
+            virtual ~IOBackend();
+
+        protected:
+            IOHandler& io;
+
+            /**
+             * Pass an accepted connection to the I/O handler
+             */
+            void accepted(int fd);
+
+        public:
+            /**
+             * Start accepting connections on the listening socket
+             *
+             * @param[in]  base  The event loop of the I/O handler
+             * @param[in]  fd    The listening socket
+             */
+            virtual void listen(event_base* base, int fd) = 0;
+
+            /**
+             * Stop accepting connections
+             */
+            virtual void unlisten() = 0;
+
+            /**
+             * Create the bufferevent of a connection
+             *
+             * The bufferevent owns the socket. It must be released with close().
+             *
+             * @param[in]  base  The event loop owning the connection
+             * @param[in]  fd    The connected socket
+             * @return The bufferevent, or NULL on failure
+             */
+            virtual bufferevent* open(event_base* base, int fd) = 0;
+
+            /**
+             * Enable reading and writing once the client is ready for its callbacks
+             */
+            virtual void start(bufferevent* event) = 0;
+
+            /**
+             * Release a bufferevent created by open() and close its socket
+             *
+             * The socket is closed without waiting for the remaining references to the
+             * bufferevent, output already taken by the backend is still sent.
+             */
+            virtual void close(bufferevent* event) = 0;
+
+            /**
+             * Create a backend
+             *
+             * @throws IOException if the backend is not available in this build
+             */
+            static IOBackend* create(Backend type, IOHandler& io);
+    };
+
+    #ifdef GFSFCGI_WITH_IO_URING
+        /**
+         * Create the io_uring backend (fastcgi_uring.cpp)
+         */
+        IOBackend* createUringBackend(IOHandler& io);
+    #endif
+
+    /**
+     * Default backend, plain libevent socket bufferevents
+     */
+    class LibeventBackend : public IOBackend
+    {
+        public:
+            LibeventBackend(IOHandler& io);
+            virtual ~LibeventBackend();
+
+        protected:
+            evconnlistener* listener;
+
+        public:
+            virtual void listen(event_base* base, int fd);
+            virtual void unlisten();
+            virtual bufferevent* open(event_base* base, int fd);
+            virtual void start(bufferevent* event);
+            virtual void close(bufferevent* event);
+    };
+
+    /**
+     * Event loop running in a thread of its own
+     *
+     * In multi reactor mode the I/O handler only accepts connections and assigns each
+     * one to a reactor. The reactor's loop creates the connection's client and
+     * buffers, and all reads, record parsing and socket writes of the connection then
+     * happen there.
+     */
+    class Reactor
+    {
+        public:
+            Reactor();
+            ~Reactor();
+
+        protected:
+            event_base* eventBase;
+            std::thread* thread;
+            std::atomic<size_t> connections; ///< Number of connections owned by this loop
+            int node; ///< NUMA node of the loop thread, -1 if not placed
+            CpuSet cpus; ///< CPUs of the loop thread, empty if not placed
+
+            /**
+             * Thread main
+             */
+            void loop();
+
+        public:
+            inline event_base* getEventBase() const
+            {
+                return this->eventBase;
+            }
+
+            inline size_t getConnectionCount() const
+            {
+                return this->connections;
+            }
+
+            inline int getNode() const
+            {
+                return this->node;
+            }
+
+            /**
+             * Place the loop thread, must be called before start()
+             *
+             * @param[in]  node  The NUMA node of the CPUs
+             * @param[in]  cpus  The CPUs to run on
+             */
+            void setPlacement(int node, const CpuSet& cpus);
+
+            /**
+             * Account connections (called by Client)
+             */
+            inline void attach()
+            {
+                this->connections++;
+            }
+
+            inline void detach()
+            {
+                this->connections--;
+            }
+
+            /**
+             * Start the loop thread
+             */
+            void start();
+
+            /**
+             * Stop the loop and wait for the thread to exit
+             */
+            void stop();
+    };
 
     /**
      * Handles FastCGI I/O via libevent
@@ -722,6 +1820,7 @@ namespace fastcgi
     class IOHandler
     {
         friend Client;
+        friend IOBackend;
 
         public:
             /**
@@ -742,6 +1841,8 @@ namespace fastcgi
              */
             virtual ~IOHandler();
 
+            const static size_t DEFAULT_BULK_THRESHOLD = 1048576;
+
         public:
             /**
              * libevent helper - accept callback
@@ -765,10 +1866,24 @@ namespace fastcgi
              */
             static void eventSignalCallback(int signal, short type, void* ptr);
 
+            /**
+             * Libevent helper - opens a connection handed to a reactor on its loop
+             */
+            static void eventOpenCallback(evutil_socket_t fd, short type, void* ptr);
+
 
         protected:
             typedef std::vector<ClientPtr> ClientList;
 
+            /**
+             * Accepted connection on its way to a reactor
+             */
+            struct PendingConnection {
+                IOHandler* io;
+                int fd;
+                Reactor* reactor;
+            };
+
             std::string bind;
             int fd; ///< Filedescriptor for listening socket
 
@@ -779,8 +1894,20 @@ namespace fastcgi
             std::vector<HandlerFactoryPtr> handlers; ///< Registered handlers
             ClientList clients; ///< active clients
             WorkerQueue workerQueue;
+            AdmissionController admission;
+
+            IOBackend* backend; ///< Socket I/O backend
+            std::vector<Reactor*> reactors; ///< Connection event loops, empty in single loop mode
+            size_t reactorCount;
+            size_t nextReactor; ///< Round robin start for reactor selection
+
+            size_t outputHighWatermark; ///< Handlers of a connection are parked above this many buffered output bytes
+            size_t outputLowWatermark; ///< Parked handlers are resumed below this many buffered output bytes
+            size_t bulkThreshold; ///< Requests are scheduled as BULK after sending this many bytes
+            CpuSet reactorCpus; ///< CPUs of the event loops, empty for no placement
 
             std::mutex clientListMutex;
+            bool closing; ///< Set on destruction, connections still on their way to a reactor are dropped
 
         /**
          * Handler methods
@@ -793,6 +1920,17 @@ namespace fastcgi
              */
             virtual void accept(int fd, sockaddr* address, int socketlen);
 
+            /**
+             * Create and start the client of an accepted connection
+             *
+             * Called on the thread of the loop serving the connection, so its state is
+             * allocated there.
+             *
+             * @param[in]  fd       The connection's socket
+             * @param[in]  reactor  The reactor serving it, NULL for the accepting loop
+             */
+            void open(int fd, Reactor* reactor);
+
             /**
              * handle socket errors
              */
@@ -808,6 +1946,16 @@ namespace fastcgi
              */
             void clearListeners();
 
+            /**
+             * Select the reactor for a new connection (least loaded, round robin on ties)
+             */
+            Reactor* selectReactor();
+
+            /**
+             * Stop and free all reactors
+             */
+            void stopReactors();
+
         public:
             /**
              * Add a handler
@@ -831,6 +1979,82 @@ namespace fastcgi
              */
             HandlerFactoryPtr getHandlerFactory(uint16_t role);
 
+            /**
+             * Schedule the request's handler in the worker queue
+             *
+             * The scheduled callback keeps the request alive until the handler completes.
+             *
+             * @param[in] request  The request to process
+             */
+            void schedule(RequestPtr request);
+
+            /**
+             * Set the per connection output watermarks
+             *
+             * Handlers writing to a connection with more than high bytes of unsent output
+             * are parked until it drained to low bytes or less.
+             *
+             * @param[in]  high  The high watermark (0 disables flow control)
+             * @param[in]  low   The low watermark, must not exceed high
+             */
+            void setOutputWatermarks(size_t high, size_t low);
+
+            /**
+             * Select the socket I/O backend
+             *
+             * Must be called before run().
+             *
+             * @param[in]  type  The backend type
+             * @throws IOException if the backend is not available in this build
+             */
+            void setBackend(Backend type);
+
+            /**
+             * Set the number of connection event loops
+             *
+             * With 0 (the default) all connections are served by the accepting loop.
+             * Otherwise connections are spread across the given number of loops, each
+             * running in its own thread. Must be called before run().
+             *
+             * @param[in]  count  The number of reactors
+             */
+            void setReactorCount(size_t count);
+
+            /**
+             * Bind the event loop threads to the given CPUs
+             *
+             * The accepting loop may use all of them. Reactors are spread across the
+             * NUMA nodes of the set and bound to their node's share of it, so requests of
+             * their connections can be handled by workers of the same node (see
+             * WorkerQueue::setCpus()). Must be called before run().
+             *
+             * @param[in]  cpus  The CPUs (empty for no placement)
+             */
+            void setReactorCpus(const CpuSet& cpus);
+
+            /**
+             * Set the output size after which a request is scheduled as bulk transfer
+             *
+             * @param[in]  bytes  The threshold (0 schedules all requests as INTERACTIVE)
+             */
+            void setBulkThreshold(size_t bytes);
+
+            /**
+             * Returns the worker queue to configure scheduling
+             */
+            inline WorkerQueue& getWorkerQueue()
+            {
+                return this->workerQueue;
+            }
+
+            /**
+             * Returns the admission controller to configure limits
+             */
+            inline AdmissionController& getAdmissionController()
+            {
+                return this->admission;
+            }
+
             /**
              * Run the I/O event loop
              */
@@ -0,0 +1,217 @@
+/**
+ * CPU and NUMA placement
+ */
+
+#include <cctype>
+#include <cstdlib>
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <pthread.h>
+
+#include "fastcgi_affinity.hpp"
+
+namespace fastcgi
+{
+    ////////////////////////////////////////
+    // CPU sets
+
+    CpuSet::CpuSet()
+    {
+        CPU_ZERO(&this->cpus);
+    }
+
+    CpuSet CpuSet::parse(const std::string& list)
+    {
+        CpuSet set;
+        std::istringstream in(list);
+        std::string range;
+
+        while (std::getline(in, range, ',')) {
+            if (range.find_first_not_of(" \t\r\n") == std::string::npos) {
+                continue;
+            }
+
+            const char* start = range.c_str() + range.find_first_not_of(" \t\r\n");
+            char* end = NULL;
+
+            // Digits only, strtol() would take signs, blanks and missing numbers
+            if (!isdigit((unsigned char)*start)) {
+                throw std::invalid_argument("Invalid CPU list: " + list);
+            }
+
+            long first = strtol(start, &end, 10);
+            long last = first;
+
+            if (*end == '-') {
+                if (!isdigit((unsigned char)end[1])) {
+                    throw std::invalid_argument("Invalid CPU list: " + list);
+                }
+
+                last = strtol(end + 1, &end, 10);
+            }
+
+            while ((*end == ' ') || (*end == '\t') || (*end == '\r') || (*end == '\n')) {
+                end++;
+            }
+
+            if ((*end != '\0') || (last < first) || (last >= CPU_SETSIZE)) {
+                throw std::invalid_argument("Invalid CPU list: " + list);
+            }
+
+            for (long cpu = first; cpu <= last; cpu++) {
+                set.add(cpu);
+            }
+        }
+
+        return set;
+    }
+
+    CpuSet CpuSet::getAvailable()
+    {
+        CpuSet set;
+
+        if (sched_getaffinity(0, sizeof(set.cpus), &set.cpus) != 0) {
+            CPU_ZERO(&set.cpus);
+        }
+
+        return set;
+    }
+
+    void CpuSet::add(int cpu)
+    {
+        if ((cpu >= 0) && (cpu < CPU_SETSIZE)) {
+            CPU_SET(cpu, &this->cpus);
+        }
+    }
+
+    bool CpuSet::contains(int cpu) const
+    {
+        return (cpu >= 0) && (cpu < CPU_SETSIZE) && CPU_ISSET(cpu, &this->cpus);
+    }
+
+    size_t CpuSet::count() const
+    {
+        return CPU_COUNT(&this->cpus);
+    }
+
+    CpuSet CpuSet::intersect(const CpuSet& other) const
+    {
+        CpuSet set;
+
+        CPU_AND(&set.cpus, &this->cpus, &other.cpus);
+        return set;
+    }
+
+    bool CpuSet::bind(std::thread& thread) const
+    {
+        if (this->empty()) {
+            return false;
+        }
+
+        return pthread_setaffinity_np(thread.native_handle(), sizeof(this->cpus), &this->cpus) == 0;
+    }
+
+    bool CpuSet::bindCurrentThread() const
+    {
+        if (this->empty()) {
+            return false;
+        }
+
+        return pthread_setaffinity_np(pthread_self(), sizeof(this->cpus), &this->cpus) == 0;
+    }
+
+    ////////////////////////////////////////
+    // NUMA topology
+
+    NumaTopology::NumaTopology()
+    {
+        std::ifstream possible("/sys/devices/system/node/possible");
+        std::string list;
+        size_t cpus = 0;
+
+        // Node ids may have gaps, the nodes in between stay empty
+        if (possible && std::getline(possible, list)) {
+            try {
+                // Same list format as CPUs
+                CpuSet ids = CpuSet::parse(list);
+
+                for (int node = 0; node < CPU_SETSIZE; node++) {
+                    if (!ids.contains(node)) {
+                        continue;
+                    }
+
+                    std::ostringstream path;
+                    path << "/sys/devices/system/node/node" << node << "/cpulist";
+
+                    std::ifstream file(path.str());
+                    std::string nodeList;
+
+                    this->nodes.resize(node + 1);
+
+                    // Possible nodes need not be online
+                    if (file && std::getline(file, nodeList)) {
+                        this->nodes[node] = CpuSet::parse(nodeList);
+                        cpus += this->nodes[node].count();
+                    }
+                }
+            } catch (std::invalid_argument&) {
+                cpus = 0;
+            }
+        }
+
+        if (cpus == 0) {
+            this->nodes.clear();
+            this->nodes.push_back(CpuSet::getAvailable());
+        }
+    }
+
+    const NumaTopology& NumaTopology::get()
+    {
+        static NumaTopology topology;
+        return topology;
+    }
+
+    int NumaTopology::getNode(int cpu) const
+    {
+        for (size_t node = 0; node < this->nodes.size(); node++) {
+            if (this->nodes[node].contains(cpu)) {
+                return node;
+            }
+        }
+
+        return -1;
+    }
+
+    int NumaTopology::getCurrentNode() const
+    {
+        return this->getNode(sched_getcpu());
+    }
+
+    std::vector<size_t> NumaTopology::getNodes(const CpuSet& cpus) const
+    {
+        std::vector<size_t> nodes;
+
+        for (size_t node = 0; node < this->nodes.size(); node++) {
+            if (!this->nodes[node].intersect(cpus).empty()) {
+                nodes.push_back(node);
+            }
+        }
+
+        return nodes;
+    }
+
+    CpuSet NumaTopology::spread(const CpuSet& cpus, size_t index, int& node) const
+    {
+        std::vector<size_t> nodes = this->getNodes(cpus);
+
+        // CPUs the topology does not know about
+        if (nodes.empty()) {
+            node = -1;
+            return cpus;
+        }
+
+        node = nodes[index % nodes.size()];
+        return cpus.intersect(this->nodes[node]);
+    }
+}
@@ -0,0 +1,127 @@
+/**
+ * CPU and NUMA placement
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <sched.h>
+
+namespace fastcgi
+{
+    /**
+     * A set of CPUs
+     */
+    class CpuSet
+    {
+        protected:
+            cpu_set_t cpus;
+
+        public:
+            /**
+             * Create an empty set
+             */
+            CpuSet();
+
+            /**
+             * Parse a CPU list as used by taskset and sysfs (i.e. "0-3,8,10-11")
+             *
+             * Blanks around the entries are ignored, empty entries are skipped.
+             *
+             * @param[in]  list  The CPU list
+             * @throws std::invalid_argument on malformed lists
+             */
+            static CpuSet parse(const std::string& list);
+
+            /**
+             * The CPUs this process may run on
+             */
+            static CpuSet getAvailable();
+
+            void add(int cpu);
+            bool contains(int cpu) const;
+            size_t count() const;
+
+            inline bool empty() const
+            {
+                return this->count() == 0;
+            }
+
+            /**
+             * CPUs contained in both sets
+             */
+            CpuSet intersect(const CpuSet& other) const;
+
+            /**
+             * Restrict a thread to this set
+             *
+             * @return false if the set is empty or the thread could not be bound
+             */
+            bool bind(std::thread& thread) const;
+
+            /**
+             * Restrict the calling thread to this set
+             */
+            bool bindCurrentThread() const;
+    };
+
+    /**
+     * NUMA nodes and their CPUs (from sysfs)
+     *
+     * Nodes are indexed by their id, possible nodes without CPUs are empty. Systems
+     * without NUMA information are treated as a single node containing all available
+     * CPUs.
+     */
+    class NumaTopology
+    {
+        protected:
+            std::vector<CpuSet> nodes;
+
+            NumaTopology();
+
+        public:
+            /**
+             * Get the topology of this host (read once)
+             */
+            static const NumaTopology& get();
+
+            inline size_t getNodeCount() const
+            {
+                return this->nodes.size();
+            }
+
+            inline const CpuSet& getNodeCpus(size_t node) const
+            {
+                return this->nodes[node];
+            }
+
+            /**
+             * Get the node of a CPU
+             *
+             * @return The node or -1 if the CPU is unknown
+             */
+            int getNode(int cpu) const;
+
+            /**
+             * Get the node of the CPU the calling thread runs on
+             */
+            int getCurrentNode() const;
+
+            /**
+             * Get the nodes that contain CPUs of the given set
+             */
+            std::vector<size_t> getNodes(const CpuSet& cpus) const;
+
+            /**
+             * Spread threads round robin across the nodes of a CPU set
+             *
+             * @param[in]  cpus   The CPUs to use (not empty)
+             * @param[in]  index  The thread number
+             * @param[out] node   The node of the thread
+             * @return The CPUs of the set on that node
+             */
+            CpuSet spread(const CpuSet& cpus, size_t index, int& node) const;
+    };
+}
@@ -0,0 +1,237 @@
+/**
+ * FastCGI record layout and wire codec
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "fastcgi_constants.hpp"
+
+namespace fastcgi
+{
+    /**
+     * Low level protocol
+     */
+    namespace protocol {
+        const uint32_t MAX_INT32_SIZE = 0x7fffffff;
+        const uint32_t MAX_INT16_SIZE = 0xffff;
+        const uint32_t MAX_BYTE_SIZE = 0x7f;
+
+        struct Header {
+            unsigned char version;
+            unsigned char type;
+            uint16_t requestId; // char[2]
+            uint16_t contentLength; // char[2]
+            unsigned char paddingLength;
+            unsigned char reserved;
+        };
+
+        struct BeginRequestBody {
+            uint16_t role; // char[2] / uint16
+            unsigned char flags;
+            unsigned char reserved[5];
+        };
+
+
+        struct BeginRequestRecord {
+            Header header;
+            BeginRequestBody body;
+        };
+
+
+        struct EndRequestBody {
+            uint32_t appStatus; // char[4] / uint32
+            unsigned char protocolStatus;
+            unsigned char reserved[3];
+        };
+
+        struct EndRequestRecord {
+            Header header;
+            EndRequestBody body;
+        };
+
+        struct UnknownTypeBody {
+            unsigned char type;
+            unsigned char reserved[7];
+        };
+
+        struct UnknownTypeRecord {
+            Header header;
+            UnknownTypeBody body;
+        };
+
+        // The structs are copied from/to the wire as they are
+        static_assert(sizeof(Header) == FCGI_HEADER_LEN, "Header must match the FastCGI header size");
+        static_assert(offsetof(Header, requestId) == 2, "Unexpected Header layout");
+        static_assert(offsetof(Header, contentLength) == 4, "Unexpected Header layout");
+        static_assert(offsetof(Header, paddingLength) == 6, "Unexpected Header layout");
+        static_assert(sizeof(BeginRequestBody) == 8, "Unexpected BeginRequestBody layout");
+        static_assert(offsetof(BeginRequestBody, flags) == 2, "Unexpected BeginRequestBody layout");
+        static_assert(sizeof(EndRequestBody) == 8, "Unexpected EndRequestBody layout");
+        static_assert(offsetof(EndRequestBody, protocolStatus) == 4, "Unexpected EndRequestBody layout");
+        static_assert(sizeof(UnknownTypeBody) == 8, "Unexpected UnknownTypeBody layout");
+        static_assert(sizeof(BeginRequestRecord) == 16, "Unexpected BeginRequestRecord layout");
+        static_assert(sizeof(EndRequestRecord) == 16, "Unexpected EndRequestRecord layout");
+        static_assert(sizeof(UnknownTypeRecord) == 16, "Unexpected UnknownTypeRecord layout");
+
+        /**
+         * Byte order conversion (network order is big endian)
+         */
+        #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            constexpr uint16_t toBigEndian(uint16_t value) { return __builtin_bswap16(value); }
+            constexpr uint32_t toBigEndian(uint32_t value) { return __builtin_bswap32(value); }
+        #elif __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+            constexpr uint16_t toBigEndian(uint16_t value) { return value; }
+            constexpr uint32_t toBigEndian(uint32_t value) { return value; }
+        #else
+            #error "Unsupported byte order"
+        #endif
+
+        constexpr uint16_t fromBigEndian(uint16_t value) { return toBigEndian(value); }
+        constexpr uint32_t fromBigEndian(uint32_t value) { return toBigEndian(value); }
+
+        /**
+         * Record segment codec
+         *
+         * decode() converts a segment as read from the wire to host byte order,
+         * encode() converts a segment in host byte order to its wire representation.
+         * Segments without multi byte fields are passed through.
+         */
+        template<class T> struct Codec
+        {
+            static constexpr T decode(const T& segment) { return segment; }
+            static constexpr T encode(const T& segment) { return segment; }
+        };
+
+        template<> struct Codec<Header>
+        {
+            static constexpr Header decode(const Header& h)
+            {
+                return Header{ h.version, h.type, fromBigEndian(h.requestId), fromBigEndian(h.contentLength), h.paddingLength, h.reserved };
+            }
+
+            static constexpr Header encode(const Header& h)
+            {
+                return Header{ h.version, h.type, toBigEndian(h.requestId), toBigEndian(h.contentLength), h.paddingLength, h.reserved };
+            }
+        };
+
+        template<> struct Codec<BeginRequestBody>
+        {
+            static constexpr BeginRequestBody decode(const BeginRequestBody& b)
+            {
+                return BeginRequestBody{ fromBigEndian(b.role), b.flags, { 0, 0, 0, 0, 0 } };
+            }
+
+            static constexpr BeginRequestBody encode(const BeginRequestBody& b)
+            {
+                return BeginRequestBody{ toBigEndian(b.role), b.flags, { 0, 0, 0, 0, 0 } };
+            }
+        };
+
+        template<> struct Codec<EndRequestBody>
+        {
+            static constexpr EndRequestBody decode(const EndRequestBody& b)
+            {
+                return EndRequestBody{ fromBigEndian(b.appStatus), b.protocolStatus, { 0, 0, 0 } };
+            }
+
+            static constexpr EndRequestBody encode(const EndRequestBody& b)
+            {
+                return EndRequestBody{ toBigEndian(b.appStatus), b.protocolStatus, { 0, 0, 0 } };
+            }
+        };
+
+        template<> struct Codec<EndRequestRecord>
+        {
+            static constexpr EndRequestRecord decode(const EndRequestRecord& r)
+            {
+                return EndRequestRecord{ Codec<Header>::decode(r.header), Codec<EndRequestBody>::decode(r.body) };
+            }
+
+            static constexpr EndRequestRecord encode(const EndRequestRecord& r)
+            {
+                return EndRequestRecord{ Codec<Header>::encode(r.header), Codec<EndRequestBody>::encode(r.body) };
+            }
+        };
+
+        /**
+         * Short hand for Codec<T>::decode()
+         */
+        template<class T> constexpr T decode(const T& segment)
+        {
+            return Codec<T>::decode(segment);
+        }
+
+        /**
+         * Short hand for Codec<T>::encode()
+         */
+        template<class T> constexpr T encode(const T& segment)
+        {
+            return Codec<T>::encode(segment);
+        }
+
+        /**
+         * Returns the number of bytes used to encode a name/value length (1 or 4)
+         */
+        constexpr size_t lengthSize(uint32_t length)
+        {
+            return (length > MAX_BYTE_SIZE)? 4 : 1;
+        }
+
+        /**
+         * Returns the number of bytes of an encoded name/value length by its first byte
+         */
+        constexpr size_t encodedLengthSize(char first)
+        {
+            return ((unsigned char)first & 0x80)? 4 : 1;
+        }
+
+        /**
+         * Decode a name/value length
+         *
+         * The buffer must provide encodedLengthSize(data[0]) bytes.
+         *
+         * @param[in]  data  Pointer to the encoded length (char or unsigned char)
+         */
+        template<class Byte> constexpr uint32_t decodeLength(const Byte* data)
+        {
+            return ((unsigned char)data[0] & 0x80)?
+                ((((uint32_t)(unsigned char)data[0] & 0x7f) << 24) | ((uint32_t)(unsigned char)data[1] << 16) |
+                    ((uint32_t)(unsigned char)data[2] << 8) | (uint32_t)(unsigned char)data[3]) :
+                (uint32_t)(unsigned char)data[0];
+        }
+
+        /**
+         * Encode a name/value length
+         *
+         * @param[in]  length  The length to encode (max MAX_INT32_SIZE)
+         * @param[out] data    Must provide lengthSize(length) bytes
+         * @return The number of bytes written
+         */
+        inline size_t encodeLength(uint32_t length, unsigned char* data)
+        {
+            if (length > MAX_BYTE_SIZE) {
+                data[0] = (unsigned char)((length >> 24) | 0x80);
+                data[1] = (unsigned char)(length >> 16);
+                data[2] = (unsigned char)(length >> 8);
+                data[3] = (unsigned char)length;
+
+                return 4;
+            }
+
+            data[0] = (unsigned char)length;
+            return 1;
+        }
+
+        // Compile time self checks
+        static_assert(fromBigEndian(toBigEndian((uint16_t)0x1234)) == 0x1234, "Byte order conversion is not reversible");
+        static_assert(fromBigEndian(toBigEndian((uint32_t)0x12345678)) == 0x12345678, "Byte order conversion is not reversible");
+        static_assert(decode(encode(Header{ FCGI_VERSION_1, FCGI_STDOUT, 0x0102, 0xfff8, 0, 0 })).requestId == 0x0102, "Header codec is broken");
+        static_assert(decode(encode(Header{ FCGI_VERSION_1, FCGI_STDOUT, 0x0102, 0xfff8, 0, 0 })).contentLength == 0xfff8, "Header codec is broken");
+        static_assert(decodeLength("\x7f") == 0x7f, "Length codec is broken");
+        static_assert(decodeLength("\x80\x00\x01\x00") == 0x100, "Length codec is broken");
+    }
+}
@@ -0,0 +1,184 @@
+/**
+ * Well known CGI parameters
+ *
+ * Names the web server sends with (almost) every request are interned at compile time
+ * into a perfect hash table, so the decoder can index them while decoding and lookups
+ * by KnownParam are O(1) without comparing strings.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/*
+ * List of well known parameters, X(name)
+ */
+#define FASTCGI_KNOWN_PARAMS(X) \
+    X(REQUEST_URI) \
+    X(REQUEST_METHOD) \
+    X(REQUEST_SCHEME) \
+    X(QUERY_STRING) \
+    X(SCRIPT_NAME) \
+    X(SCRIPT_FILENAME) \
+    X(PATH_INFO) \
+    X(DOCUMENT_URI) \
+    X(DOCUMENT_ROOT) \
+    X(CONTENT_TYPE) \
+    X(CONTENT_LENGTH) \
+    X(SERVER_NAME) \
+    X(SERVER_PORT) \
+    X(SERVER_ADDR) \
+    X(SERVER_PROTOCOL) \
+    X(REMOTE_ADDR) \
+    X(REMOTE_PORT) \
+    X(HTTPS) \
+    X(HTTP_HOST) \
+    X(HTTP_RANGE) \
+    X(HTTP_IF_RANGE) \
+    X(HTTP_IF_MATCH) \
+    X(HTTP_IF_NONE_MATCH) \
+    X(HTTP_IF_MODIFIED_SINCE) \
+    X(HTTP_IF_UNMODIFIED_SINCE) \
+    X(HTTP_ACCEPT_ENCODING) \
+    X(HTTP_USER_AGENT) \
+    X(HTTP_CACHE_CONTROL)
+
+namespace fastcgi
+{
+    /**
+     * Well known parameter identifiers
+     *
+     * UNKNOWN is also the number of known parameters.
+     */
+    enum class KnownParam : uint8_t {
+        #define FASTCGI_KNOWN_PARAM_ENUM(name) name,
+        FASTCGI_KNOWN_PARAMS(FASTCGI_KNOWN_PARAM_ENUM)
+        #undef FASTCGI_KNOWN_PARAM_ENUM
+        UNKNOWN
+    };
+
+    const size_t KNOWN_PARAM_COUNT = (size_t)KnownParam::UNKNOWN;
+
+    namespace protocol {
+        struct KnownParamName {
+            const char* name;
+            size_t size;
+        };
+
+        constexpr KnownParamName KNOWN_PARAM_NAMES[] = {
+            #define FASTCGI_KNOWN_PARAM_NAME(name) { #name, sizeof(#name) - 1 },
+            FASTCGI_KNOWN_PARAMS(FASTCGI_KNOWN_PARAM_NAME)
+            #undef FASTCGI_KNOWN_PARAM_NAME
+        };
+
+        static_assert(sizeof(KNOWN_PARAM_NAMES) / sizeof(KnownParamName) == KNOWN_PARAM_COUNT, "Known parameter table is out of sync");
+
+        /**
+         * Perfect hash parameters
+         *
+         * The seed was chosen so that all known names map to distinct slots, which is
+         * verified below. Change the seed when adding names if the check fails.
+         */
+        const size_t KNOWN_PARAM_TABLE_BITS = 6;
+        const size_t KNOWN_PARAM_TABLE_SIZE = (size_t)1 << KNOWN_PARAM_TABLE_BITS;
+        const uint32_t KNOWN_PARAM_HASH_SEED = 0x811c9e20;
+        const size_t MAX_KNOWN_PARAM_NAME_SIZE = 32;
+
+        static_assert(KNOWN_PARAM_COUNT < KNOWN_PARAM_TABLE_SIZE, "Known parameter table is too small");
+
+        /**
+         * FNV-1a, the slot is taken from the high bits which are mixed best
+         */
+        constexpr uint32_t hashParamName(const char* name, size_t size, uint32_t hash = KNOWN_PARAM_HASH_SEED)
+        {
+            return (size == 0)? hash : hashParamName(name + 1, size - 1, (hash ^ (unsigned char)name[0]) * 16777619u);
+        }
+
+        constexpr size_t paramSlot(const char* name, size_t size)
+        {
+            return hashParamName(name, size) >> (32 - KNOWN_PARAM_TABLE_BITS);
+        }
+
+        constexpr size_t knownParamSlot(size_t index)
+        {
+            return paramSlot(KNOWN_PARAM_NAMES[index].name, KNOWN_PARAM_NAMES[index].size);
+        }
+
+        /**
+         * Index of the known parameter occupying the given slot, or KNOWN_PARAM_COUNT
+         */
+        constexpr uint8_t knownParamForSlot(size_t slot, size_t index = 0)
+        {
+            return (index == KNOWN_PARAM_COUNT)? (uint8_t)KNOWN_PARAM_COUNT :
+                (knownParamSlot(index) == slot)? (uint8_t)index : knownParamForSlot(slot, index + 1);
+        }
+
+        constexpr bool hasKnownParamCollision(size_t index = 0, size_t other = 1)
+        {
+            return (index >= KNOWN_PARAM_COUNT)? false :
+                (other >= KNOWN_PARAM_COUNT)? hasKnownParamCollision(index + 1, index + 2) :
+                (knownParamSlot(index) == knownParamSlot(other)) || hasKnownParamCollision(index, other + 1);
+        }
+
+        constexpr bool knownNamesFit(size_t index = 0)
+        {
+            return (index >= KNOWN_PARAM_COUNT) ||
+                ((KNOWN_PARAM_NAMES[index].size <= MAX_KNOWN_PARAM_NAME_SIZE) && knownNamesFit(index + 1));
+        }
+
+        static_assert(!hasKnownParamCollision(), "Known parameter names collide, choose another KNOWN_PARAM_HASH_SEED");
+        static_assert(knownNamesFit(), "Known parameter name exceeds MAX_KNOWN_PARAM_NAME_SIZE");
+
+        /**
+         * Slot to parameter table, generated at compile time
+         */
+        template<size_t... Slots> struct KnownParamTable {
+            static const uint8_t slots[sizeof...(Slots)];
+        };
+
+        template<size_t... Slots> const uint8_t KnownParamTable<Slots...>::slots[sizeof...(Slots)] = { knownParamForSlot(Slots)... };
+
+        template<size_t N, size_t... Slots> struct MakeKnownParamTable : MakeKnownParamTable<N - 1, N - 1, Slots...> {};
+        template<size_t... Slots> struct MakeKnownParamTable<0, Slots...> {
+            typedef KnownParamTable<Slots...> type;
+        };
+
+        typedef MakeKnownParamTable<KNOWN_PARAM_TABLE_SIZE>::type KnownParams;
+
+        /**
+         * Look up a parameter name
+         *
+         * @param[in]  name  The parameter name (not null terminated)
+         * @param[in]  size  The name length
+         * @return The parameter id or KnownParam::UNKNOWN
+         */
+        inline KnownParam findKnownParam(const char* name, size_t size)
+        {
+            if (size > MAX_KNOWN_PARAM_NAME_SIZE) {
+                return KnownParam::UNKNOWN;
+            }
+
+            uint8_t index = KnownParams::slots[paramSlot(name, size)];
+
+            if ((index == KNOWN_PARAM_COUNT) || (KNOWN_PARAM_NAMES[index].size != size)
+                    || (memcmp(KNOWN_PARAM_NAMES[index].name, name, size) != 0)) {
+                return KnownParam::UNKNOWN;
+            }
+
+            return (KnownParam)index;
+        }
+
+        /**
+         * Get the name of a known parameter
+         */
+        inline const char* knownParamName(KnownParam param)
+        {
+            return (param == KnownParam::UNKNOWN)? NULL : KNOWN_PARAM_NAMES[(size_t)param].name;
+        }
+
+        // Compile time self checks
+        static_assert(knownParamForSlot(knownParamSlot((size_t)KnownParam::HTTP_RANGE)) == (uint8_t)KnownParam::HTTP_RANGE, "Known parameter table is broken");
+    }
+}
@@ -0,0 +1,200 @@
+/**
+ * Object pools
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace fastcgi
+{
+    /**
+     * Allocator recycling single objects through a free list
+     *
+     * Meant for std::allocate_shared() of objects that are created and destroyed at a
+     * high rate, the control block and the object share one recycled node. Arrays are
+     * passed to the global allocator. Up to MAX_CACHED nodes per type are kept.
+     */
+    template<class T> class PoolAllocator
+    {
+        protected:
+            union Node {
+                Node* next;
+                alignas(T) char storage[sizeof(T)];
+            };
+
+            struct FreeList {
+                std::mutex mutex;
+                Node* first = NULL;
+                size_t size = 0;
+
+                ~FreeList()
+                {
+                    while (this->first != NULL) {
+                        Node* next = this->first->next;
+
+                        delete this->first;
+                        this->first = next;
+                    }
+                }
+            };
+
+            static FreeList& getFreeList()
+            {
+                static FreeList list;
+                return list;
+            }
+
+        public:
+            typedef T value_type;
+
+            const static size_t MAX_CACHED = 4096;
+
+            template<class U> struct rebind {
+                typedef PoolAllocator<U> other;
+            };
+
+            inline PoolAllocator() {}
+            template<class U> inline PoolAllocator(const PoolAllocator<U>&) {}
+
+            T* allocate(size_t n)
+            {
+                if (n != 1) {
+                    return static_cast<T*>(::operator new(n * sizeof(T)));
+                }
+
+                FreeList& list = getFreeList();
+
+                {
+                    std::lock_guard<std::mutex> lock(list.mutex);
+                    Node* node = list.first;
+
+                    if (node != NULL) {
+                        list.first = node->next;
+                        list.size--;
+
+                        return reinterpret_cast<T*>(node->storage);
+                    }
+                }
+
+                return reinterpret_cast<T*>((new Node())->storage);
+            }
+
+            void deallocate(T* ptr, size_t n)
+            {
+                if (n != 1) {
+                    ::operator delete(ptr);
+                    return;
+                }
+
+                Node* node = reinterpret_cast<Node*>(ptr);
+                FreeList& list = getFreeList();
+
+                {
+                    std::lock_guard<std::mutex> lock(list.mutex);
+
+                    if (list.size < MAX_CACHED) {
+                        node->next = list.first;
+                        list.first = node;
+                        list.size++;
+
+                        return;
+                    }
+                }
+
+                delete node;
+            }
+    };
+
+    /**
+     * Pool of recycled objects
+     *
+     * Unlike PoolAllocator, released objects stay constructed, so the resources they
+     * own (i.e. buffers) are reused as well. T needs a default constructor and reset(),
+     * which is called on release. Up to MAX_CACHED objects are kept.
+     */
+    template<class T> class ObjectPool
+    {
+        protected:
+            struct FreeList {
+                std::mutex mutex;
+                std::vector<T*> objects;
+
+                inline FreeList()
+                {
+                    this->objects.reserve(MAX_CACHED);
+                }
+
+                ~FreeList()
+                {
+                    for (auto object : this->objects) {
+                        delete object;
+                    }
+                }
+            };
+
+            static FreeList& getFreeList()
+            {
+                static FreeList list;
+                return list;
+            }
+
+        public:
+            const static size_t MAX_CACHED = 4096;
+
+            /**
+             * Take a recycled object or create one
+             */
+            static T* acquire()
+            {
+                FreeList& list = getFreeList();
+
+                {
+                    std::lock_guard<std::mutex> lock(list.mutex);
+
+                    if (!list.objects.empty()) {
+                        T* object = list.objects.back();
+
+                        list.objects.pop_back();
+                        return object;
+                    }
+                }
+
+                return new T();
+            }
+
+            /**
+             * Reset an object and keep it for the next acquire()
+             */
+            static void release(T* object)
+            {
+                FreeList& list = getFreeList();
+
+                object->reset();
+
+                {
+                    std::lock_guard<std::mutex> lock(list.mutex);
+
+                    if (list.objects.size() < MAX_CACHED) {
+                        list.objects.push_back(object);
+                        return;
+                    }
+                }
+
+                delete object;
+            }
+    };
+
+    template<class T, class U> inline bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&)
+    {
+        return true;
+    }
+
+    template<class T, class U> inline bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&)
+    {
+        return false;
+    }
+}
@@ -0,0 +1,256 @@
+/**
+ * Lock free queues
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace fastcgi
+{
+    /**
+     * Intrusive multi producer single consumer queue (Vyukov)
+     *
+     * Any thread may push(), only one thread at a time may pop(). Nodes must provide
+     * a std::atomic<T*> next member and a default constructor (used for the stub node).
+     * The queue never owns the nodes.
+     */
+    template<class T> class MpscQueue
+    {
+        protected:
+            std::atomic<T*> head; ///< Last pushed node (producers)
+            T* tail; ///< Next node to pop (consumer)
+            T stub;
+
+        public:
+            inline MpscQueue() : head(&stub), tail(&stub)
+            {
+                this->stub.next.store(NULL, std::memory_order_relaxed);
+            }
+
+            MpscQueue(const MpscQueue&) = delete;
+            MpscQueue& operator=(const MpscQueue&) = delete;
+
+            /**
+             * Append a node (wait free)
+             */
+            inline void push(T* node)
+            {
+                node->next.store(NULL, std::memory_order_relaxed);
+                T* previous = this->head.exchange(node, std::memory_order_acq_rel);
+                previous->next.store(node, std::memory_order_release);
+            }
+
+            /**
+             * Remove the first node
+             *
+             * @return The node or NULL if the queue is empty or a producer is in the middle
+             *         of a push (the producer is expected to signal the consumer afterwards)
+             */
+            T* pop()
+            {
+                T* tail = this->tail;
+                T* next = tail->next.load(std::memory_order_acquire);
+
+                if (tail == &this->stub) {
+                    if (next == NULL) {
+                        return NULL;
+                    }
+
+                    this->tail = next;
+                    tail = next;
+                    next = next->next.load(std::memory_order_acquire);
+                }
+
+                if (next != NULL) {
+                    this->tail = next;
+                    return tail;
+                }
+
+                if (tail != this->head.load(std::memory_order_acquire)) {
+                    return NULL;
+                }
+
+                // tail is the last node, put the stub behind it so it can be handed out
+                this->push(&this->stub);
+                next = tail->next.load(std::memory_order_acquire);
+
+                if (next != NULL) {
+                    this->tail = next;
+                    return tail;
+                }
+
+                return NULL;
+            }
+
+            /**
+             * Check if there is nothing to pop (consumer only)
+             */
+            inline bool empty() const
+            {
+                return (this->tail == &this->stub) && (this->stub.next.load(std::memory_order_acquire) == NULL);
+            }
+    };
+
+    /**
+     * Work stealing deque (Chase-Lev)
+     *
+     * The owning thread pushes at the bottom, any thread may steal from the top.
+     * The owner may also take from the bottom with pop(). T must be a pointer type,
+     * NULL means "nothing taken". The array grows as needed, replaced arrays are kept
+     * until destruction since thieves may still read from them.
+     */
+    template<class T> class WorkStealingDeque
+    {
+        protected:
+            struct Array {
+                size_t capacity;
+                std::atomic<T>* items;
+                Array* previous;
+
+                Array(size_t capacity, Array* previous) :
+                    capacity(capacity),
+                    items(new std::atomic<T>[capacity]),
+                    previous(previous)
+                {}
+
+                ~Array()
+                {
+                    delete [] this->items;
+                }
+
+                inline T get(int64_t i) const
+                {
+                    return this->items[i & (this->capacity - 1)].load(std::memory_order_acquire);
+                }
+
+                inline void put(int64_t i, T item)
+                {
+                    this->items[i & (this->capacity - 1)].store(item, std::memory_order_release);
+                }
+            };
+
+            std::atomic<int64_t> top;
+            std::atomic<int64_t> bottom;
+            std::atomic<Array*> array;
+
+            Array* grow(Array* current, int64_t top, int64_t bottom)
+            {
+                Array* grown = new Array(current->capacity * 2, current);
+
+                for (int64_t i = top; i < bottom; i++) {
+                    grown->put(i, current->get(i));
+                }
+
+                this->array.store(grown, std::memory_order_release);
+                return grown;
+            }
+
+        public:
+            /**
+             * @param[in]  capacity  Initial capacity, must be a power of 2
+             */
+            WorkStealingDeque(size_t capacity = 256) : top(0), bottom(0), array(new Array(capacity, NULL))
+            {
+            }
+
+            ~WorkStealingDeque()
+            {
+                Array* array = this->array.load(std::memory_order_relaxed);
+
+                while (array != NULL) {
+                    Array* previous = array->previous;
+
+                    delete array;
+                    array = previous;
+                }
+            }
+
+            WorkStealingDeque(const WorkStealingDeque&) = delete;
+            WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+            /**
+             * Push an item at the bottom (owner only)
+             */
+            void push(T item)
+            {
+                int64_t bottom = this->bottom.load(std::memory_order_relaxed);
+                int64_t top = this->top.load(std::memory_order_acquire);
+                Array* array = this->array.load(std::memory_order_relaxed);
+
+                if ((bottom - top) > (int64_t)(array->capacity - 1)) {
+                    array = this->grow(array, top, bottom);
+                }
+
+                array->put(bottom, item);
+                std::atomic_thread_fence(std::memory_order_release);
+                this->bottom.store(bottom + 1, std::memory_order_relaxed);
+            }
+
+            /**
+             * Take the most recently pushed item (owner only)
+             */
+            T pop()
+            {
+                int64_t bottom = this->bottom.load(std::memory_order_relaxed) - 1;
+                Array* array = this->array.load(std::memory_order_relaxed);
+
+                this->bottom.store(bottom, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+
+                int64_t top = this->top.load(std::memory_order_relaxed);
+
+                if (top > bottom) {
+                    this->bottom.store(bottom + 1, std::memory_order_relaxed);
+                    return NULL;
+                }
+
+                T item = array->get(bottom);
+
+                if (top == bottom) {
+                    // Last item, race against thieves
+                    if (!this->top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                        item = NULL;
+                    }
+
+                    this->bottom.store(bottom + 1, std::memory_order_relaxed);
+                }
+
+                return item;
+            }
+
+            /**
+             * Take the oldest item (any thread)
+             *
+             * @return The item or NULL if the deque is empty or another thread won the race
+             */
+            T steal()
+            {
+                int64_t top = this->top.load(std::memory_order_acquire);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                int64_t bottom = this->bottom.load(std::memory_order_acquire);
+
+                if (top >= bottom) {
+                    return NULL;
+                }
+
+                T item = this->array.load(std::memory_order_acquire)->get(top);
+
+                if (!this->top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    return NULL;
+                }
+
+                return item;
+            }
+
+            /**
+             * Approximate number of items
+             */
+            inline size_t size() const
+            {
+                int64_t size = this->bottom.load(std::memory_order_relaxed) - this->top.load(std::memory_order_relaxed);
+                return (size > 0)? (size_t)size : 0;
+            }
+    };
+}
@@ -0,0 +1,848 @@
+/**
+ * io_uring socket I/O backend
+ */
+
+#include <cerrno>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+
+#include "fastcgi_uring.hpp"
+
+namespace fastcgi
+{
+    IOBackend* createUringBackend(IOHandler& io)
+    {
+        return new UringBackend(io);
+    }
+
+    /////////////////////////////////////////////////////////////////////
+    //
+    // Uring
+    //
+
+    Uring::Uring(unsigned entries) :
+            fd(-1),
+            sqRing(MAP_FAILED),
+            sqRingSize(0),
+            cqRing(MAP_FAILED),
+            cqRingSize(0),
+            sqes((io_uring_sqe*)MAP_FAILED),
+            sqesSize(0)
+    {
+        io_uring_params params;
+
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+
+        this->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+
+        if (this->fd < 0) {
+            throw IOException(std::string("Failed to set up io_uring: ") + strerror(errno));
+        }
+
+        this->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        this->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        this->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+        // Both queues share one mapping on all current kernels
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            this->sqRingSize = this->cqRingSize = std::max(this->sqRingSize, this->cqRingSize);
+        }
+
+        this->sqRing = mmap(NULL, this->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_SQ_RING);
+
+        if ((this->sqRing != MAP_FAILED) && (params.features & IORING_FEAT_SINGLE_MMAP)) {
+            this->cqRing = this->sqRing;
+        } else if (this->sqRing != MAP_FAILED) {
+            this->cqRing = mmap(NULL, this->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_CQ_RING);
+        }
+
+        this->sqes = (io_uring_sqe*)mmap(NULL, this->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->fd, IORING_OFF_SQES);
+
+        if ((this->sqRing == MAP_FAILED) || (this->cqRing == MAP_FAILED) || (this->sqes == MAP_FAILED)) {
+            this->unmap();
+            ::close(this->fd);
+            throw IOException("Failed to map io_uring queues");
+        }
+
+        char* sq = (char*)this->sqRing;
+        char* cq = (char*)this->cqRing;
+
+        this->sqHead = (unsigned*)(sq + params.sq_off.head);
+        this->sqTail = (unsigned*)(sq + params.sq_off.tail);
+        this->sqFlags = (unsigned*)(sq + params.sq_off.flags);
+        this->sqMask = *(unsigned*)(sq + params.sq_off.ring_mask);
+        this->sqEntries = params.sq_entries;
+        this->sqLocalTail = this->sqSubmitted = *this->sqTail;
+
+        // Entries are used in ring order, the index array maps each slot to itself
+        unsigned* array = (unsigned*)(sq + params.sq_off.array);
+
+        for (unsigned i = 0; i < this->sqEntries; i++) {
+            array[i] = i;
+        }
+
+        this->cqHead = (unsigned*)(cq + params.cq_off.head);
+        this->cqTail = (unsigned*)(cq + params.cq_off.tail);
+        this->cqMask = *(unsigned*)(cq + params.cq_off.ring_mask);
+        this->cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    }
+
+    Uring::~Uring()
+    {
+        this->unmap();
+        ::close(this->fd);
+    }
+
+    void Uring::unmap()
+    {
+        if (this->sqes != MAP_FAILED) {
+            munmap(this->sqes, this->sqesSize);
+        }
+
+        if ((this->cqRing != MAP_FAILED) && (this->cqRing != this->sqRing)) {
+            munmap(this->cqRing, this->cqRingSize);
+        }
+
+        if (this->sqRing != MAP_FAILED) {
+            munmap(this->sqRing, this->sqRingSize);
+        }
+    }
+
+    io_uring_sqe* Uring::getSqe()
+    {
+        if (this->getSpaceLeft() == 0) {
+            this->submit();
+        }
+
+        if (this->getSpaceLeft() == 0) {
+            throw IOException("io_uring submission queue is full");
+        }
+
+        io_uring_sqe* sqe = &this->sqes[this->sqLocalTail++ & this->sqMask];
+
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    unsigned Uring::getSpaceLeft() const
+    {
+        return this->sqEntries - (this->sqLocalTail - __atomic_load_n(this->sqHead, __ATOMIC_ACQUIRE));
+    }
+
+    void Uring::submit()
+    {
+        __atomic_store_n(this->sqTail, this->sqLocalTail, __ATOMIC_RELEASE);
+
+        unsigned count = this->sqLocalTail - this->sqSubmitted;
+
+        if (count == 0) {
+            return;
+        }
+
+        int result = (int)syscall(__NR_io_uring_enter, this->fd, count, 0, 0, NULL, 0);
+
+        if (result >= 0) {
+            this->sqSubmitted += result;
+            return;
+        }
+
+        // The entries stay queued and go with the next submission
+        if ((errno != EINTR) && (errno != EAGAIN) && (errno != EBUSY)) {
+            throw IOException(std::string("Failed to submit to io_uring: ") + strerror(errno));
+        }
+    }
+
+    io_uring_cqe* Uring::peek()
+    {
+        unsigned head = *this->cqHead;
+
+        if (head == __atomic_load_n(this->cqTail, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+
+        return &this->cqes[head & this->cqMask];
+    }
+
+    void Uring::seen()
+    {
+        __atomic_store_n(this->cqHead, *this->cqHead + 1, __ATOMIC_RELEASE);
+    }
+
+    bool Uring::flushOverflow()
+    {
+        if (!(__atomic_load_n(this->sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)) {
+            return false;
+        }
+
+        syscall(__NR_io_uring_enter, this->fd, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+        return true;
+    }
+
+    void Uring::registerEventFd(int eventFd)
+    {
+        if (syscall(__NR_io_uring_register, this->fd, IORING_REGISTER_EVENTFD, &eventFd, 1) < 0) {
+            throw IOException(std::string("Failed to register io_uring completion eventfd: ") + strerror(errno));
+        }
+    }
+
+    /////////////////////////////////////////////////////////////////////
+    //
+    // Backend
+    //
+
+    const unsigned UringBackend::QUEUE_DEPTH;
+    const unsigned UringBackend::BUFFER_COUNT;
+    const size_t UringBackend::BUFFER_SIZE;
+    const unsigned short UringBackend::BUFFER_GROUP;
+    const unsigned UringBackend::BUFFER_RESERVE;
+    const int UringBackend::MAX_SEND_SEGMENTS;
+
+    static void prepare(io_uring_sqe* sqe, unsigned char opcode, int fd, const void* data, unsigned size, void* operation)
+    {
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)data;
+        sqe->len = size;
+        sqe->user_data = (uint64_t)(uintptr_t)operation;
+    }
+
+    UringBackend::UringBackend(IOHandler& io) : IOBackend(io),
+            listenRing(NULL)
+    {
+    }
+
+    /**
+     * The event loops are stopped at this point, tear everything down right away
+     */
+    UringBackend::~UringBackend()
+    {
+        this->unlisten();
+
+        for (auto& entry : this->rings) {
+            entry.second->starved = false;
+            entry.second->waiting.clear();
+        }
+
+        for (auto& entry : this->connections) {
+            entry.second->closing = true;
+            bufferevent_free(entry.first);
+            this->closing.insert(entry.second);
+        }
+
+        this->connections.clear();
+
+        std::set<Connection*> closing;
+        closing.swap(this->closing);
+
+        for (auto connection : closing) {
+            this->freeConnection(connection);
+        }
+
+        for (auto& entry : this->rings) {
+            this->freeRing(entry.second);
+        }
+
+        this->rings.clear();
+    }
+
+    ////////////////////////////////////////
+    // Rings
+
+    UringBackend::Ring* UringBackend::getRing(event_base* base)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        auto existing = this->rings.find(base);
+
+        if (existing != this->rings.end()) {
+            return existing->second;
+        }
+
+        Ring* ring = new Ring();
+        ring->backend = this;
+        ring->base = base;
+        ring->uring = NULL;
+        ring->eventFd = -1;
+        ring->completion = NULL;
+        ring->bufferMemory = new char[BUFFER_COUNT * BUFFER_SIZE];
+        ring->outstanding = 0;
+        ring->starved = false;
+        ring->orphaned = false;
+        ring->listenFd = -1;
+        ring->accept = Operation{ Operation::Type::ACCEPT, ring, NULL };
+        ring->cancel = Operation{ Operation::Type::CANCEL, ring, NULL };
+
+        try {
+            ring->uring = new Uring(QUEUE_DEPTH);
+
+            // Provide all read buffers at once, they go with the first submission
+            io_uring_sqe* sqe = ring->uring->getSqe();
+
+            prepare(sqe, IORING_OP_PROVIDE_BUFFERS, BUFFER_COUNT, ring->bufferMemory, BUFFER_SIZE, NULL);
+            sqe->buf_group = BUFFER_GROUP;
+
+            // Completions wake the event loop through the eventfd
+            ring->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+            if (ring->eventFd < 0) {
+                throw IOException("Failed to create io_uring completion eventfd");
+            }
+
+            ring->uring->registerEventFd(ring->eventFd);
+            ring->completion = event_new(base, ring->eventFd, EV_READ | EV_PERSIST, UringBackend::eventCompletionCallback, ring);
+
+            if ((ring->completion == NULL) || (event_add(ring->completion, NULL) != 0)) {
+                throw IOException("Failed to watch io_uring completions");
+            }
+        } catch (IOException& e) {
+            this->freeRing(ring);
+            throw;
+        }
+
+        this->rings[base] = ring;
+        return ring;
+    }
+
+    void UringBackend::freeRing(Ring* ring)
+    {
+        if (ring->completion != NULL) {
+            event_free(ring->completion);
+        }
+
+        if (ring->eventFd >= 0) {
+            ::close(ring->eventFd);
+        }
+
+        // Closing the ring cancels everything in flight
+        delete ring->uring;
+
+        // Clients may still reference received buffers
+        if (ring->outstanding > 0) {
+            ring->orphaned = true;
+            return;
+        }
+
+        delete [] ring->bufferMemory;
+        delete ring;
+    }
+
+    void UringBackend::recycleBuffer(Ring* ring, unsigned short id)
+    {
+        // The kernel gets the buffer with the next submission, ahead of anything queued later
+        io_uring_sqe* sqe = ring->uring->getSqe();
+
+        prepare(sqe, IORING_OP_PROVIDE_BUFFERS, 1, ring->bufferMemory + (id * BUFFER_SIZE), BUFFER_SIZE, NULL);
+        sqe->buf_group = BUFFER_GROUP;
+        sqe->off = id;
+
+        if (!ring->starved) {
+            return;
+        }
+
+        // Resume reads that ran out of buffers
+        ring->starved = false;
+        std::list<Connection*> waiting;
+        waiting.swap(ring->waiting);
+
+        for (auto connection : waiting) {
+            if (!connection->closing && !connection->receiving) {
+                ring->backend->armRecv(connection);
+            }
+        }
+    }
+
+    /**
+     * Hand a received buffer back to the ring (evbuffer reference cleanup)
+     *
+     * Clients consume their input on the loop, so this runs on the ring's thread.
+     */
+    void UringBackend::releaseBuffer(const void* data, size_t /* size */, void* ptr)
+    {
+        Ring* ring = (Ring*)ptr;
+        ring->outstanding--;
+
+        if (ring->orphaned) {
+            if (ring->outstanding == 0) {
+                delete [] ring->bufferMemory;
+                delete ring;
+            }
+
+            return;
+        }
+
+        bool starved = ring->starved;
+        UringBackend::recycleBuffer(ring, ((const char*)data - ring->bufferMemory) / BUFFER_SIZE);
+
+        if (starved) {
+            ring->uring->submit();
+        }
+    }
+
+    ////////////////////////////////////////
+    // Completions
+
+    void UringBackend::eventCompletionCallback(evutil_socket_t /* fd */, short /* eventType */, void* ptr)
+    {
+        Ring* ring = (Ring*)ptr;
+        ring->backend->complete(ring);
+    }
+
+    void UringBackend::complete(Ring* ring)
+    {
+        eventfd_t value;
+        eventfd_read(ring->eventFd, &value);
+
+        do {
+            io_uring_cqe* entry;
+
+            while ((entry = ring->uring->peek()) != NULL) {
+                // Handlers may free the connection, work on a copy
+                io_uring_cqe cqe = *entry;
+                ring->uring->seen();
+
+                Operation* operation = (Operation*)(uintptr_t)cqe.user_data;
+
+                if (operation == NULL) {
+                    continue;
+                }
+
+                switch (operation->type) {
+                    case Operation::Type::ACCEPT:
+                        this->onAccept(ring, cqe);
+                        break;
+
+                    case Operation::Type::RECV:
+                        this->onRecv(operation->connection, cqe);
+                        break;
+
+                    case Operation::Type::SEND:
+                        this->onSend(operation->connection, cqe);
+                        break;
+
+                    case Operation::Type::CANCEL:
+                        if (operation->connection != NULL) {
+                            operation->connection->cancelling = false;
+                            this->finish(operation->connection);
+                        }
+
+                        break;
+                }
+            }
+        } while (ring->uring->flushOverflow());
+
+        ring->uring->submit();
+    }
+
+    ////////////////////////////////////////
+    // Accept
+
+    void UringBackend::listen(event_base* base, int fd)
+    {
+        if (::listen(fd, SOMAXCONN) != 0) {
+            throw IOException(std::string("Failed to listen on the socket: ") + strerror(errno));
+        }
+
+        this->listenRing = this->getRing(base);
+        this->listenRing->listenFd = fd;
+
+        this->armAccept(this->listenRing);
+        this->listenRing->uring->submit();
+    }
+
+    void UringBackend::unlisten()
+    {
+        if ((this->listenRing == NULL) || (this->listenRing->listenFd < 0)) {
+            return;
+        }
+
+        Ring* ring = this->listenRing;
+        ring->listenFd = -1;
+
+        io_uring_sqe* sqe = ring->uring->getSqe();
+        prepare(sqe, IORING_OP_ASYNC_CANCEL, -1, &ring->accept, 0, &ring->cancel);
+        ring->uring->submit();
+    }
+
+    void UringBackend::armAccept(Ring* ring)
+    {
+        io_uring_sqe* sqe = ring->uring->getSqe();
+
+        prepare(sqe, IORING_OP_ACCEPT, ring->listenFd, NULL, 0, &ring->accept);
+        sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+    }
+
+    void UringBackend::onAccept(Ring* ring, const io_uring_cqe& cqe)
+    {
+        if (cqe.res >= 0) {
+            this->accepted(cqe.res);
+        } else if (cqe.res != -ECANCELED) {
+            std::cerr << "Socket listener error " << -cqe.res << ": " << strerror(-cqe.res) << std::endl;
+        }
+
+        // Multishot accept ends on errors, keep listening
+        if (!(cqe.flags & IORING_CQE_F_MORE) && (ring->listenFd >= 0)) {
+            this->armAccept(ring);
+        }
+    }
+
+    ////////////////////////////////////////
+    // Connections
+
+    bufferevent* UringBackend::open(event_base* base, int fd)
+    {
+        Ring* ring = this->getRing(base);
+
+        // No socket, the backend moves the data in and out of the buffers
+        bufferevent* event = bufferevent_socket_new(base, -1, BEV_OPT_DEFER_CALLBACKS | BEV_OPT_THREADSAFE);
+
+        if (event == NULL) {
+            return NULL;
+        }
+
+        // Socket bufferevents only let their own I/O code add input and drain output
+        evbuffer_unfreeze(bufferevent_get_input(event), 0);
+        evbuffer_unfreeze(bufferevent_get_output(event), 1);
+
+        Connection* connection = new Connection();
+        connection->ring = ring;
+        connection->fd = fd;
+        connection->event = event;
+        connection->output = evbuffer_new();
+        connection->recv = Operation{ Operation::Type::RECV, ring, connection };
+        connection->send = Operation{ Operation::Type::SEND, ring, connection };
+        connection->cancel = Operation{ Operation::Type::CANCEL, ring, connection };
+        connection->started = false;
+        connection->receiving = false;
+        connection->cancelling = false;
+        connection->sending = 0;
+        connection->sent = 0;
+        connection->failed = false;
+        connection->closing = false;
+        connection->control = event_new(base, -1, 0, UringBackend::eventControlCallback, connection);
+
+        if ((connection->output == NULL) || (connection->control == NULL)) {
+            if (connection->output != NULL) {
+                evbuffer_free(connection->output);
+            }
+
+            if (connection->control != NULL) {
+                event_free(connection->control);
+            }
+
+            bufferevent_free(event);
+            delete connection;
+            return NULL;
+        }
+
+        // Released by close(), the connection keeps the bufferevent until it is freed on its loop
+        bufferevent_incref(event);
+        connection->outputCallback = evbuffer_add_cb(bufferevent_get_output(event), UringBackend::eventOutputCallback, connection);
+
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->connections[event] = connection;
+
+        return event;
+    }
+
+    void UringBackend::start(bufferevent* event)
+    {
+        Connection* connection = NULL;
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto entry = this->connections.find(event);
+
+            if (entry != this->connections.end()) {
+                connection = entry->second;
+            }
+        }
+
+        bufferevent_enable(event, EV_READ | EV_WRITE);
+
+        // The ring belongs to the connection's loop, start reading from there
+        if (connection != NULL) {
+            event_active(connection->control, EV_READ, 0);
+        }
+    }
+
+    void UringBackend::close(bufferevent* event)
+    {
+        Connection* connection = NULL;
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto entry = this->connections.find(event);
+
+            if (entry != this->connections.end()) {
+                connection = entry->second;
+                this->connections.erase(entry);
+                this->closing.insert(connection);
+            }
+        }
+
+        if (connection != NULL) {
+            connection->closing = true;
+        }
+
+        bufferevent_free(event);
+
+        if (connection != NULL) {
+            event_active(connection->control, EV_TIMEOUT, 0);
+        }
+    }
+
+    void UringBackend::eventControlCallback(evutil_socket_t /* fd */, short /* eventType */, void* ptr)
+    {
+        Connection* connection = (Connection*)ptr;
+        Ring* ring = connection->ring;
+
+        if (connection->closing) {
+            ring->backend->finish(connection);
+        } else {
+            if (!connection->started) {
+                connection->started = true;
+                ring->backend->armRecv(connection);
+            }
+
+            ring->backend->submitSends(connection);
+        }
+
+        ring->uring->submit();
+    }
+
+    /**
+     * Output added by the client (any thread, bufferevent lock held)
+     */
+    void UringBackend::eventOutputCallback(evbuffer* /* buffer */, const evbuffer_cb_info* info, void* ptr)
+    {
+        Connection* connection = (Connection*)ptr;
+
+        if ((info->n_added > 0) && !connection->closing) {
+            event_active(connection->control, EV_WRITE, 0);
+        }
+    }
+
+    void UringBackend::armRecv(Connection* connection)
+    {
+        io_uring_sqe* sqe = connection->ring->uring->getSqe();
+
+        prepare(sqe, IORING_OP_RECV, connection->fd, NULL, 0, &connection->recv);
+        sqe->ioprio |= IORING_RECV_MULTISHOT;
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = BUFFER_GROUP;
+
+        connection->receiving = true;
+    }
+
+    void UringBackend::notifyRead(Connection* connection)
+    {
+        // Closing clients stop reading, like a socket bufferevent
+        if (bufferevent_get_enabled(connection->event) & EV_READ) {
+            bufferevent_trigger(connection->event, EV_READ, 0);
+        }
+    }
+
+    void UringBackend::onRecv(Connection* connection, const io_uring_cqe& cqe)
+    {
+        Ring* ring = connection->ring;
+        bool rearm = false;
+
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            connection->receiving = false;
+        }
+
+        if ((cqe.res > 0) && (cqe.flags & IORING_CQE_F_BUFFER)) {
+            unsigned short id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            char* data = ring->bufferMemory + (id * BUFFER_SIZE);
+            evbuffer* input = bufferevent_get_input(connection->event);
+
+            if (connection->closing) {
+                UringBackend::recycleBuffer(ring, id);
+            } else if ((ring->outstanding + BUFFER_RESERVE) >= BUFFER_COUNT) {
+                // Partial records of slow clients must not take all buffers, copy instead
+                evbuffer_add(input, data, cqe.res);
+                UringBackend::recycleBuffer(ring, id);
+            } else {
+                // The data shows up in the client's input, the buffer returns once it was consumed
+                ring->outstanding++;
+
+                if (evbuffer_add_reference(input, data, cqe.res, UringBackend::releaseBuffer, ring) != 0) {
+                    UringBackend::releaseBuffer(data, cqe.res, ring);
+                }
+            }
+
+            if (!connection->closing) {
+                this->notifyRead(connection);
+            }
+
+            rearm = true;
+        } else if ((cqe.res == -ENOBUFS) && !connection->closing) {
+            if (ring->outstanding < BUFFER_COUNT) {
+                // Buffers came back after the kernel ran out, they are provided ahead of the new recv
+                rearm = true;
+            } else {
+                // All buffers are in use, wait until clients consumed some
+                ring->starved = true;
+                ring->waiting.push_back(connection);
+            }
+        } else if (!connection->closing && (cqe.res == 0)) {
+            bufferevent_trigger_event(connection->event, BEV_EVENT_EOF | BEV_EVENT_READING, 0);
+        } else if (!connection->closing && (cqe.res < 0) && (cqe.res != -ECANCELED)) {
+            bufferevent_trigger_event(connection->event, BEV_EVENT_ERROR | BEV_EVENT_READING, 0);
+        }
+
+        if (rearm && !connection->receiving && !connection->closing) {
+            this->armRecv(connection);
+        }
+
+        if (connection->closing) {
+            this->finish(connection);
+        }
+    }
+
+    /**
+     * Send the taken output as linked sends, one per segment
+     */
+    void UringBackend::submitSends(Connection* connection)
+    {
+        if ((connection->sending > 0) || connection->failed) {
+            return;
+        }
+
+        // Take all output, the client pumps no more than its output window at a time
+        if (!connection->closing) {
+            evbuffer* source = bufferevent_get_output(connection->event);
+
+            if (evbuffer_get_length(source) > 0) {
+                evbuffer_add_buffer(connection->output, source);
+
+                // Drained, the client may refill its output
+                if (bufferevent_get_enabled(connection->event) & EV_WRITE) {
+                    bufferevent_trigger(connection->event, EV_WRITE, 0);
+                }
+            }
+        }
+
+        evbuffer_iovec segments[MAX_SEND_SEGMENTS];
+        int count = evbuffer_peek(connection->output, -1, NULL, segments, MAX_SEND_SEGMENTS);
+
+        if (count > MAX_SEND_SEGMENTS) {
+            count = MAX_SEND_SEGMENTS;
+        }
+
+        if (count <= 0) {
+            return;
+        }
+
+        Uring* uring = connection->ring->uring;
+
+        // A link must not be split across submissions
+        if (uring->getSpaceLeft() < (unsigned)count) {
+            uring->submit();
+        }
+
+        for (int i = 0; i < count; i++) {
+            io_uring_sqe* sqe = uring->getSqe();
+
+            // Stream sockets retry partial sends, so only errors break the chain
+            prepare(sqe, IORING_OP_SEND, connection->fd, segments[i].iov_base, segments[i].iov_len, &connection->send);
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+
+            if ((i + 1) < count) {
+                sqe->flags |= IOSQE_IO_LINK;
+            }
+        }
+
+        connection->sending = count;
+        connection->sent = 0;
+    }
+
+    void UringBackend::onSend(Connection* connection, const io_uring_cqe& cqe)
+    {
+        connection->sending--;
+
+        // A failed send cancels the rest of the chain
+        if (cqe.res > 0) {
+            connection->sent += cqe.res;
+        } else if ((cqe.res < 0) && (cqe.res != -ECANCELED)) {
+            connection->failed = true;
+        }
+
+        if (connection->sending > 0) {
+            return;
+        }
+
+        if (connection->failed) {
+            evbuffer_drain(connection->output, evbuffer_get_length(connection->output));
+
+            if (!connection->closing) {
+                bufferevent_trigger_event(connection->event, BEV_EVENT_ERROR | BEV_EVENT_WRITING, 0);
+            }
+        } else {
+            evbuffer_drain(connection->output, connection->sent);
+            this->submitSends(connection);
+        }
+
+        if (connection->closing) {
+            this->finish(connection);
+        }
+    }
+
+    void UringBackend::finish(Connection* connection)
+    {
+        // Output the client considered flushed is still sent
+        if (!connection->failed && ((connection->sending > 0) || (evbuffer_get_length(connection->output) > 0))) {
+            this->submitSends(connection);
+            return;
+        }
+
+        if (connection->receiving) {
+            if (!connection->cancelling) {
+                io_uring_sqe* sqe = connection->ring->uring->getSqe();
+
+                prepare(sqe, IORING_OP_ASYNC_CANCEL, -1, &connection->recv, 0, &connection->cancel);
+                connection->cancelling = true;
+            }
+
+            return;
+        }
+
+        if ((connection->sending > 0) || connection->cancelling) {
+            return;
+        }
+
+        this->freeConnection(connection);
+    }
+
+    void UringBackend::freeConnection(Connection* connection)
+    {
+        bufferevent* event = connection->event;
+
+        connection->ring->waiting.remove(connection);
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->closing.erase(connection);
+        }
+
+        ::close(connection->fd);
+
+        // Received buffers go back to the ring on this thread
+        bufferevent_lock(event);
+        evbuffer_remove_cb_entry(bufferevent_get_output(event), connection->outputCallback);
+        evbuffer_drain(bufferevent_get_input(event), evbuffer_get_length(bufferevent_get_input(event)));
+        bufferevent_unlock(event);
+
+        evbuffer_free(connection->output);
+        event_free(connection->control);
+        bufferevent_decref(event);
+
+        delete connection;
+    }
+}
@@ -0,0 +1,227 @@
+/**
+ * io_uring socket I/O backend
+ */
+
+#pragma once
+
+#include <set>
+#include <map>
+#include <list>
+#include <linux/io_uring.h>
+
+#include "fastcgi.hpp"
+
+namespace fastcgi
+{
+    /**
+     * Minimal io_uring interface on top of the system calls
+     *
+     * Maps the submission and completion queues of one ring, there is no dependency
+     * on liburing. Not thread safe, a ring is used by the thread of one event loop.
+     */
+    class Uring
+    {
+        public:
+            /**
+             * @param[in]  entries  Submission queue size, the completion queue gets four times as many
+             * @throws IOException if the kernel does not support io_uring
+             */
+            Uring(unsigned entries);
+            virtual ~Uring();
+
+        protected:
+            int fd;
+
+            void* sqRing;
+            size_t sqRingSize;
+            void* cqRing;
+            size_t cqRingSize;
+            io_uring_sqe* sqes;
+            size_t sqesSize;
+
+            unsigned* sqHead;
+            unsigned* sqTail;
+            unsigned* sqFlags;
+            unsigned sqMask;
+            unsigned sqEntries;
+            unsigned sqLocalTail; ///< Entries prepared but not yet published to the kernel
+            unsigned sqSubmitted; ///< Tail at the last submission
+
+            unsigned* cqHead;
+            unsigned* cqTail;
+            unsigned cqMask;
+            io_uring_cqe* cqes;
+
+            void unmap();
+
+        public:
+            /**
+             * Get a cleared submission queue entry, submitting the queue if it is full
+             */
+            io_uring_sqe* getSqe();
+
+            /**
+             * Number of entries that can be prepared without a submission
+             */
+            unsigned getSpaceLeft() const;
+
+            /**
+             * Publish and submit the prepared entries
+             */
+            void submit();
+
+            /**
+             * Next completion or NULL, release it with seen()
+             */
+            io_uring_cqe* peek();
+            void seen();
+
+            /**
+             * Flush completions the kernel could not post because the queue was full
+             *
+             * @return true if completions were flushed
+             */
+            bool flushOverflow();
+
+            /**
+             * Signal completions through an eventfd
+             */
+            void registerEventFd(int eventFd);
+    };
+
+    /**
+     * io_uring backend
+     *
+     * Each event loop gets a ring whose completions are signalled through an eventfd
+     * registered with the loop, so everything runs on the loop's thread:
+     *
+     * - Connections are accepted with a multishot accept.
+     * - Reads use a multishot recv with provided buffers. Received buffers are linked
+     *   into the client's input by reference and provided again once the client
+     *   consumed them.
+     * - Output is sent as a batch of linked sends, one per buffer segment (record
+     *   header, payload and padding).
+     *
+     * Clients work on a socket bufferevent without a socket: the backend fills its
+     * input, takes its output and runs its callbacks.
+     */
+    class UringBackend : public IOBackend
+    {
+        public:
+            UringBackend(IOHandler& io);
+            virtual ~UringBackend();
+
+            const static unsigned QUEUE_DEPTH = 512;
+            const static unsigned BUFFER_COUNT = 256; ///< Provided buffers per ring
+            const static size_t BUFFER_SIZE = 16384;
+            const static unsigned short BUFFER_GROUP = 0;
+            const static unsigned BUFFER_RESERVE = BUFFER_COUNT / 4; ///< Received data is copied when fewer buffers are left
+            const static int MAX_SEND_SEGMENTS = 16; ///< Linked sends per batch
+
+        protected:
+            struct Ring;
+            struct Connection;
+
+            /**
+             * Tag of a submitted operation (user_data)
+             */
+            struct Operation {
+                enum class Type : unsigned char { ACCEPT, RECV, SEND, CANCEL };
+
+                Type type;
+                Ring* ring;
+                Connection* connection;
+            };
+
+            struct Ring {
+                UringBackend* backend;
+                event_base* base;
+                Uring* uring;
+                int eventFd;
+                ::event* completion; ///< Reads eventFd on the loop
+                char* bufferMemory;
+                size_t outstanding; ///< Buffers referenced by client input, all others are provided or about to be
+                bool starved; ///< Reads stopped because all buffers are in use
+                bool orphaned; ///< The ring is gone, free the buffers once they are returned
+                std::list<Connection*> waiting; ///< Connections to resume when buffers are back
+
+                int listenFd;
+                Operation accept;
+                Operation cancel;
+            };
+
+            struct Connection {
+                Ring* ring;
+                int fd;
+                bufferevent* event; ///< The client's bufferevent, referenced until freed
+                evbuffer* output; ///< Output taken from the client, sent by the sends in flight
+                evbuffer_cb_entry* outputCallback;
+                ::event* control; ///< Activated to start, flush and close the connection on its loop
+
+                Operation recv;
+                Operation send;
+                Operation cancel;
+
+                bool started;
+                bool receiving; ///< Multishot recv is armed
+                bool cancelling; ///< Cancellation of the recv is in flight
+                int sending; ///< Sends in flight
+                size_t sent; ///< Bytes sent by the current batch
+                bool failed;
+                std::atomic<bool> closing; ///< Released by the client
+            };
+
+            std::mutex mutex; ///< Protects rings and connections
+            std::map<event_base*, Ring*> rings;
+            std::map<bufferevent*, Connection*> connections; ///< Open connections by bufferevent
+            std::set<Connection*> closing; ///< Connections shutting down
+            Ring* listenRing;
+
+            /**
+             * Get or create the ring of an event loop
+             */
+            Ring* getRing(event_base* base);
+            void freeRing(Ring* ring);
+
+            /**
+             * Provide a buffer to the ring again (on the ring's loop, submitted with the next batch)
+             */
+            static void recycleBuffer(Ring* ring, unsigned short id);
+
+            // Loop callbacks
+            static void eventCompletionCallback(evutil_socket_t fd, short eventType, void* ptr);
+            static void eventControlCallback(evutil_socket_t fd, short eventType, void* ptr);
+            static void eventOutputCallback(evbuffer* buffer, const evbuffer_cb_info* info, void* ptr);
+            static void releaseBuffer(const void* data, size_t size, void* ptr);
+
+            void complete(Ring* ring);
+            void armAccept(Ring* ring);
+            void armRecv(Connection* connection);
+            void submitSends(Connection* connection);
+            void onAccept(Ring* ring, const io_uring_cqe& cqe);
+            void onRecv(Connection* connection, const io_uring_cqe& cqe);
+            void onSend(Connection* connection, const io_uring_cqe& cqe);
+
+            /**
+             * Run the client's read callback, as a socket bufferevent would
+             */
+            void notifyRead(Connection* connection);
+
+            /**
+             * Shut the connection down once its output was sent and nothing is in flight
+             */
+            void finish(Connection* connection);
+
+            /**
+             * Free a connection, close its socket and release the bufferevent
+             */
+            void freeConnection(Connection* connection);
+
+        public:
+            virtual void listen(event_base* base, int fd);
+            virtual void unlisten();
+            virtual bufferevent* open(event_base* base, int fd);
+            virtual void start(bufferevent* event);
+            virtual void close(bufferevent* event);
+    };
+}
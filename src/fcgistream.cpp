@@ -2,6 +2,9 @@
  * FastCGI stream implementation
  */
 
+#include <algorithm>
+#include <sstream>
+
 #include "fastcgi.hpp"
 
 namespace fastcgi
@@ -118,18 +121,22 @@ namespace fastcgi
 
         // Output Buffer
 
+        const size_t OutStreamBuffer::DEFAULT_CHUNKSIZE;
+        const size_t OutStreamBuffer::MAX_RECORD_SIZE;
+
         OutStreamBuffer::OutStreamBuffer(ClientPtr client, uint16_t requestId, const role_t& role, const size_t& chunksize) :
-            role(role),
-            chunkSize(chunksize),
+            chunk(NULL),
+            chunkSize(std::min(std::max(chunksize, (size_t)1), MAX_RECORD_SIZE)),
+            client(client),
             requestId(requestId),
-            client(client)
+            role(role),
+            written(0)
         {
             if (role == role_t::VALUES_RESULT) {
                 this->requestId = 0;
             }
 
-            this->chunk = new char[this->chunkSize];
-            this->resetChunk();
+            this->setp(NULL, NULL);
         }
 
         OutStreamBuffer::OutStreamBuffer(Request& request, const role_t& role, const size_t& chunksize) : OutStreamBuffer(request.client, request.getId(), role, chunksize)
@@ -146,22 +153,81 @@ namespace fastcgi
 
         void OutStreamBuffer::resetChunk()
         {
-            memset(this->chunk, 0, this->chunkSize);
             this->setp(this->chunk, this->chunk + this->chunkSize);
         }
 
+        void OutStreamBuffer::setChunkSize(size_t size)
+        {
+            size = std::min(std::max(size, (size_t)1), MAX_RECORD_SIZE);
+
+            if (size == this->chunkSize) {
+                return;
+            }
+
+            this->sync();
+            this->setp(NULL, NULL);
+
+            delete [] this->chunk;
+            this->chunk = NULL;
+            this->chunkSize = size;
+        }
+
         std::streambuf::int_type OutStreamBuffer::overflow(int_type ch)
         {
-            if (this->sync() != 0) {
+            if (this->closed) {
+                return traits_type::eof();
+            }
+
+            if (this->chunk == NULL) {
+                this->chunk = new char[this->chunkSize];
+                this->resetChunk();
+            } else if (this->sync() != 0) {
                 this->setp(NULL, NULL);
                 return traits_type::eof();
             }
 
             if (!traits_type::eq_int_type(ch, traits_type::eof())) {
-                *this->chunk = (char)ch;
+                *this->pptr() = traits_type::to_char_type(ch);
+                this->pbump(1);
+            }
+
+            return traits_type::not_eof(ch);
+        }
+
+        /**
+         * Writes of at least a full chunk bypass the put area
+         */
+        std::streamsize OutStreamBuffer::xsputn(const char_type* s, std::streamsize n)
+        {
+            if ((size_t)n < this->chunkSize) {
+                return parent::xsputn(s, n);
+            }
+
+            if (this->sync() != 0) {
+                return 0;
             }
 
-            return 1;
+            this->sendRecords(s, n);
+            return n;
+        }
+
+        void OutStreamBuffer::sendRecords(const char* data, size_t size)
+        {
+            std::vector<protocol::GenericMessage> records;
+            std::vector<protocol::Message*> messages;
+
+            records.reserve((size + this->chunkSize - 1) / this->chunkSize);
+            messages.reserve(records.capacity());
+
+            for (size_t offset = 0; offset < size; offset += this->chunkSize) {
+                size_t n = std::min(this->chunkSize, size - offset);
+
+                records.push_back(protocol::GenericMessage(this->requestId, (unsigned char)this->role, data + offset, n));
+                messages.push_back(&records.back());
+            }
+
+            this->client->write(messages);
+            this->written += size;
         }
 
         int OutStreamBuffer::sync()
@@ -170,18 +236,68 @@ namespace fastcgi
                 return -1;
             }
 
-            protocol::GenericMessage msg(this->requestId, (unsigned char)this->role, this->chunk, this->chunkSize);
+            size_t size = this->pptr() - this->pbase();
+
+            if (size == 0) {
+                return 0;
+            }
+
+            protocol::GenericMessage msg(this->requestId, (unsigned char)this->role, this->pbase(), size);
             this->client->write(msg);
+            this->written += size;
             this->resetChunk();
 
             return 0;
         }
 
+        bool OutStreamBuffer::sendReference(const char* data, size_t size, ReleaseCallback release)
+        {
+            // An empty record would terminate the stream
+            if (this->closed || (size == 0) || (this->sync() != 0)) {
+                if (release) {
+                    release();
+                }
+
+                return !this->closed;
+            }
+
+            protocol::ContentReference* content = new protocol::ContentReference(data, size, release);
+            std::vector<protocol::ReferenceMessage> records;
+            std::vector<protocol::Message*> messages;
+
+            records.reserve((size + MAX_RECORD_SIZE - 1) / MAX_RECORD_SIZE);
+            messages.reserve(records.capacity());
+
+            for (size_t offset = 0; offset < size; offset += MAX_RECORD_SIZE) {
+                size_t n = std::min(MAX_RECORD_SIZE, size - offset);
+
+                records.push_back(protocol::ReferenceMessage(this->requestId, (unsigned char)this->role, content, offset, n));
+                messages.push_back(&records.back());
+            }
+
+            try {
+                this->client->write(messages);
+            } catch (...) {
+                content->release();
+                throw;
+            }
+
+            // Drop our own reference, the records hold theirs
+            content->release();
+            this->written += size;
+
+            return true;
+        }
+
         /**
          * Close the output stream buffer
          */
         void OutStreamBuffer::close()
         {
+            if (this->closed) {
+                return;
+            }
+
             this->sync();
 
             // Send EOF
@@ -194,14 +310,18 @@ namespace fastcgi
 
         // Stream Impl
 
-        InStream::InStream(Request& request)
+        InStream::InStream(Request& request) :
+            std::istream(NULL),
+            buffer(new InStreamBuffer(request))
         {
-            // TODO: Memory
-            std::istream(new InStreamBuffer(request));
+            this->rdbuf(this->buffer);
         }
 
         InStream::~InStream()
-        {}
+        {
+            this->rdbuf(NULL);
+            delete this->buffer;
+        }
 
         bool InStream::isReady() const
         {
@@ -223,20 +343,35 @@ namespace fastcgi
         }
 
 
-        OutStream::OutStream(ClientPtr client, uint16_t requestId, const OutStreamBuffer::role_t& role)
+        OutStream::OutStream(ClientPtr client, uint16_t requestId, const OutStreamBuffer::role_t& role) :
+            std::ostream(NULL),
+            buffer(new OutStreamBuffer(client, requestId, role))
         {
-            // FIXME: Memory
-            std::ostream(new OutStreamBuffer(client, requestId, role));
+            this->rdbuf(this->buffer);
         }
 
-        OutStream::OutStream(Request& request, const role_t& role)
+        OutStream::OutStream(Request& request, const role_t& role) :
+            std::ostream(NULL),
+            buffer(new OutStreamBuffer(request, role))
         {
-            // FIXME: Memory
-            std::ostream(new OutStreamBuffer(request, role));
+            this->rdbuf(this->buffer);
         }
 
         OutStream::~OutStream()
-        {}
+        {
+            this->rdbuf(NULL);
+            delete this->buffer;
+        }
+
+        void OutStream::setRecordSize(size_t size)
+        {
+            this->buffer->setChunkSize(size);
+        }
+
+        bool OutStream::writeBody(const char* data, size_t size, ReleaseCallback release)
+        {
+            return this->buffer->sendReference(data, size, release);
+        }
 
         void OutStream::close()
         {
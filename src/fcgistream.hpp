@@ -7,6 +7,9 @@
 #include <iostream>
 #include <vector>
 #include <list>
+#include <memory>
+#include <atomic>
+#include <functional>
 
 #include "fastcgi_constants.hpp"
 
@@ -20,6 +23,11 @@ namespace fastcgi
         struct Record;
     }
 
+    /**
+     * Called when caller owned data passed by reference is no longer used
+     */
+    typedef std::function<void()> ReleaseCallback;
+
     namespace streams {
         struct chunk_t {
             size_t size = 0;
@@ -35,10 +43,11 @@ namespace fastcgi
         class ClosableStreamBuffer
         {
             public:
+                inline ClosableStreamBuffer() : closed(false) {};
                 virtual inline ~ClosableStreamBuffer() {};
 
             protected:
-                bool closed = false;
+                std::atomic<bool> closed; ///< Set by the handler, read by the loop for input streams
 
             public:
                 virtual inline void close() {
@@ -52,10 +61,10 @@ namespace fastcgi
 
             public:
                 inline InStreamBuffer(Request& request) :
+                    std::streambuf(),
                     request(request),
                     isInitialized(false),
-                    isComplete(false),
-                    std::streambuf() {};
+                    isComplete(false) {};
 
                 virtual ~InStreamBuffer();
 
@@ -83,7 +92,8 @@ namespace fastcgi
             friend Request;
 
             public:
-                const static size_t DEFAULT_CHUNKSIZE = 4086;
+                const static size_t DEFAULT_CHUNKSIZE = 8184; ///< Multiple of 8, records need no padding
+                const static size_t MAX_RECORD_SIZE = 0xffff;
                 enum class role_t : unsigned char { STDOUT = FCGI_STDOUT, STDERR = FCGI_STDERR, VALUES_RESULT = FCGI_GET_VALUES_RESULT };
 
                 OutStreamBuffer(Request& request, const role_t& role, const size_t& chunksize = DEFAULT_CHUNKSIZE);
@@ -91,7 +101,7 @@ namespace fastcgi
                 virtual ~OutStreamBuffer();
 
             private:
-                char*  chunk;
+                char*  chunk; ///< Allocated on first use
                 size_t chunkSize;
 
                 void resetChunk();
@@ -101,12 +111,54 @@ namespace fastcgi
                 uint16_t  requestId;
 
                 role_t role;
+                size_t written; ///< Content bytes handed to the client
 
                 // Put Area
                 virtual int_type overflow(int_type ch);
+                virtual std::streamsize xsputn(const char_type* s, std::streamsize n);
                 virtual int sync();
 
+                /**
+                 * Send data as records of at most chunkSize bytes
+                 */
+                void sendRecords(const char* data, size_t size);
+
             public:
+                /**
+                 * Set the maximum record size for formatted output
+                 *
+                 * Pending output is flushed first. The size is limited to MAX_RECORD_SIZE.
+                 */
+                void setChunkSize(size_t size);
+
+                inline size_t getChunkSize() const
+                {
+                    return this->chunkSize;
+                }
+
+                /**
+                 * Content bytes sent so far (excluding the put area)
+                 */
+                inline size_t getWrittenBytes() const
+                {
+                    return this->written;
+                }
+
+                /**
+                 * Send caller owned data without copying it
+                 *
+                 * Pending formatted output is flushed first. The data is split into records of
+                 * MAX_RECORD_SIZE bytes which reference it in place. It must stay valid and
+                 * unchanged until release is called, which happens once the last record was
+                 * sent or discarded, possibly from the I/O thread.
+                 *
+                 * @param[in]  data     Pointer to the data
+                 * @param[in]  size     Size of the data
+                 * @param[in]  release  Called when the data is no longer referenced (may be empty)
+                 * @return false if the stream is closed (release was called already)
+                 */
+                bool sendReference(const char* data, size_t size, ReleaseCallback release);
+
                 virtual void close();
         };
 
@@ -119,6 +171,9 @@ namespace fastcgi
                 InStream(Request& request);
                 virtual ~InStream();
 
+            protected:
+                InStreamBuffer* buffer;
+
             public:
                 /**
                  * Check if stream is ready
@@ -142,6 +197,8 @@ namespace fastcgi
                 typedef OutStreamBuffer::role_t role_t;
 
             protected:
+                OutStreamBuffer* buffer;
+
                 /**
                  * Construct directly with client
                  *
@@ -159,6 +216,31 @@ namespace fastcgi
                 OutStream(Request& request, const role_t& role);
                 ~OutStream();
 
+                /**
+                 * Set the maximum record size for formatted output
+                 */
+                void setRecordSize(size_t size);
+
+                /**
+                 * Content bytes sent so far
+                 */
+                inline size_t getWrittenBytes() const
+                {
+                    return this->buffer->getWrittenBytes();
+                }
+
+                /**
+                 * Write a body chunk by reference (i.e. a GridFS chunk)
+                 *
+                 * See OutStreamBuffer::sendReference()
+                 *
+                 * @param[in]  data     Pointer to the data, must be valid until release is called
+                 * @param[in]  size     Size of the data
+                 * @param[in]  release  Called when the data is no longer referenced
+                 * @return false if the stream is closed
+                 */
+                bool writeBody(const char* data, size_t size, ReleaseCallback release);
+
                 /**
                  * Close this stream
                  */
@@ -0,0 +1,82 @@
+/*
+ * fetchpool.cpp
+ */
+
+#include "fetchpool.hpp"
+
+using namespace gfsfcgi;
+
+const size_t gfsfcgi::FetchPool::DEFAULT_THREADS;
+
+gfsfcgi::FetchPool::FetchPool(size_t threadCount) : terminated(false)
+{
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+
+    for (size_t i = 0; i < threadCount; i++) {
+        this->threads.push_back(new std::thread(&FetchPool::run, this));
+    }
+}
+
+gfsfcgi::FetchPool::~FetchPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+
+        this->terminated = true;
+        this->jobs.clear();
+    }
+
+    this->condition.notify_all();
+
+    for (auto thread : this->threads) {
+        thread->join();
+        delete thread;
+    }
+
+    this->threads.clear();
+}
+
+void gfsfcgi::FetchPool::run()
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    while (true) {
+        while (this->jobs.empty() && !this->terminated) {
+            this->condition.wait(lock);
+        }
+
+        if (this->terminated) {
+            break;
+        }
+
+        Job job = this->jobs.front();
+        this->jobs.pop_front();
+
+        lock.unlock();
+        job();
+        lock.lock();
+    }
+}
+
+void gfsfcgi::FetchPool::submit(Job job)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+
+        if (this->terminated) {
+            return;
+        }
+
+        this->jobs.push_back(job);
+    }
+
+    this->condition.notify_one();
+}
+
+size_t gfsfcgi::FetchPool::getQueueSize() const
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->jobs.size();
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <condition_variable>
+
+namespace gfsfcgi
+{
+    /**
+     * Threads running background fetches (i.e. chunk read-ahead)
+     *
+     * Jobs run in submission order. Jobs still queued on destruction are dropped.
+     */
+    class FetchPool
+    {
+        public:
+            typedef std::function<void()> Job;
+
+            const static size_t DEFAULT_THREADS = 8;
+
+        protected:
+            mutable std::mutex mutex;
+            std::condition_variable condition;
+            std::deque<Job> jobs;
+            std::vector<std::thread*> threads;
+            bool terminated;
+
+            void run();
+
+        public:
+            FetchPool(size_t threadCount = DEFAULT_THREADS);
+            virtual ~FetchPool();
+
+            void submit(Job job);
+
+            /**
+             * Number of jobs waiting for a thread
+             */
+            size_t getQueueSize() const;
+    };
+}
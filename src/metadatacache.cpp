@@ -0,0 +1,177 @@
+/*
+ * metadatacache.cpp
+ */
+
+#include "metadatacache.hpp"
+
+using namespace gfsfcgi;
+
+const size_t gfsfcgi::MetadataCache::SHARD_COUNT;
+const size_t gfsfcgi::MetadataCache::DEFAULT_BUDGET;
+const unsigned gfsfcgi::MetadataCache::DEFAULT_TTL;
+
+////////////////////////////////////////
+// File info
+
+FileInfo gfsfcgi::FileInfo::fromBSON(const std::string& bucket, const mongo::BSONObj& file)
+{
+    FileInfo info;
+
+    info.bucket = bucket;
+    info.filename = file.getStringField("filename");
+    info.id = file["_id"].wrap();
+    info.length = file["length"].numberLong();
+    info.chunkSize = file["chunkSize"].numberInt();
+    info.md5 = file.getStringField("md5");
+    info.uploadDate = file["uploadDate"].date().millis;
+    info.contentType = file.getStringField("contentType");
+
+    return info;
+}
+
+size_t gfsfcgi::FileInfo::getMemoryUsage() const
+{
+    return sizeof(FileInfo) + this->bucket.capacity() + this->filename.capacity()
+        + this->id.objsize() + this->md5.capacity() + this->contentType.capacity();
+}
+
+////////////////////////////////////////
+// Cache
+
+gfsfcgi::MetadataCache::MetadataCache(size_t budget, unsigned ttl) :
+        shardBudget(budget / SHARD_COUNT),
+        ttl(std::chrono::seconds(ttl)),
+        hits(0),
+        misses(0),
+        expired(0),
+        evictions(0)
+{
+}
+
+std::string gfsfcgi::MetadataCache::makeKey(const std::string& bucket, const std::string& filename)
+{
+    std::string key(bucket);
+
+    // Bucket names cannot contain a null byte
+    key.push_back('\0');
+    key.append(filename);
+
+    return key;
+}
+
+MetadataCache::Shard& gfsfcgi::MetadataCache::getShard(const std::string& key)
+{
+    return this->shards[std::hash<std::string>()(key) % SHARD_COUNT];
+}
+
+void gfsfcgi::MetadataCache::erase(Shard& shard, EntryList::iterator entry)
+{
+    shard.memory -= entry->size;
+    shard.index.erase(entry->key);
+    shard.lru.erase(entry);
+}
+
+FileInfoPtr gfsfcgi::MetadataCache::get(const std::string& bucket, const std::string& filename)
+{
+    std::string key = makeKey(bucket, filename);
+    Shard& shard = this->getShard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(key);
+
+    if (found == shard.index.end()) {
+        this->misses++;
+        return FileInfoPtr();
+    }
+
+    EntryList::iterator entry = found->second;
+
+    if (entry->expires <= Clock::now()) {
+        this->erase(shard, entry);
+        this->expired++;
+        this->misses++;
+
+        return FileInfoPtr();
+    }
+
+    shard.lru.splice(shard.lru.begin(), shard.lru, entry);
+    this->hits++;
+
+    return entry->info;
+}
+
+void gfsfcgi::MetadataCache::put(const FileInfoPtr& info)
+{
+    Entry item;
+
+    item.key = makeKey(info->bucket, info->filename);
+    item.info = info;
+    item.expires = Clock::now() + this->ttl;
+    item.size = info->getMemoryUsage() + item.key.capacity() + sizeof(Entry);
+
+    // Would not fit even into an empty shard
+    if (item.size > this->shardBudget) {
+        return;
+    }
+
+    Shard& shard = this->getShard(item.key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(item.key);
+
+    if (found != shard.index.end()) {
+        this->erase(shard, found->second);
+    }
+
+    while (!shard.lru.empty() && ((shard.memory + item.size) > this->shardBudget)) {
+        this->erase(shard, --shard.lru.end());
+        this->evictions++;
+    }
+
+    shard.memory += item.size;
+    shard.lru.push_front(item);
+    shard.index[item.key] = shard.lru.begin();
+}
+
+void gfsfcgi::MetadataCache::remove(const std::string& bucket, const std::string& filename)
+{
+    std::string key = makeKey(bucket, filename);
+    Shard& shard = this->getShard(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(key);
+
+    if (found != shard.index.end()) {
+        this->erase(shard, found->second);
+    }
+}
+
+void gfsfcgi::MetadataCache::clear()
+{
+    for (auto& shard : this->shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        shard.lru.clear();
+        shard.index.clear();
+        shard.memory = 0;
+    }
+}
+
+MetadataCache::Metrics gfsfcgi::MetadataCache::getMetrics()
+{
+    Metrics metrics;
+
+    metrics.entries = 0;
+    metrics.memory = 0;
+
+    for (auto& shard : this->shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        metrics.entries += shard.index.size();
+        metrics.memory += shard.memory;
+    }
+
+    metrics.hits = this->hits;
+    metrics.misses = this->misses;
+    metrics.expired = this->expired;
+    metrics.evictions = this->evictions;
+
+    return metrics;
+}
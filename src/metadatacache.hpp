@@ -0,0 +1,123 @@
+#pragma once
+
+#include <list>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <mongo/client/dbclientinterface.h>
+
+namespace gfsfcgi
+{
+    /**
+     * GridFS file metadata (an fs.files document)
+     */
+    struct FileInfo {
+        std::string bucket;
+        std::string filename;
+        mongo::BSONObj id; ///< Owned object with the _id as its only field
+        int64_t length = 0;
+        int chunkSize = 0;
+        std::string md5;
+        int64_t uploadDate = 0; ///< Milliseconds since the epoch
+        std::string contentType;
+
+        /**
+         * Read a files document
+         */
+        static FileInfo fromBSON(const std::string& bucket, const mongo::BSONObj& file);
+
+        inline unsigned int getChunkCount() const
+        {
+            return (this->chunkSize > 0)? (this->length + this->chunkSize - 1) / this->chunkSize : 0;
+        }
+
+        /**
+         * Approximate heap usage of the entry
+         */
+        size_t getMemoryUsage() const;
+    };
+
+    typedef std::shared_ptr<const FileInfo> FileInfoPtr;
+
+    /**
+     * Sharded LRU cache of file metadata by bucket and filename
+     *
+     * Each shard has its own lock, LRU list and an equal part of the memory budget.
+     * Entries expire after the TTL, so replaced files are picked up eventually.
+     */
+    class MetadataCache
+    {
+        public:
+            typedef std::chrono::steady_clock Clock;
+
+            const static size_t SHARD_COUNT = 16;
+            const static size_t DEFAULT_BUDGET = 16 * 1024 * 1024; ///< Bytes
+            const static unsigned DEFAULT_TTL = 60; ///< Seconds
+
+            struct Metrics {
+                size_t entries;
+                size_t memory; ///< Bytes used by the entries
+                uint64_t hits;
+                uint64_t misses;
+                uint64_t expired; ///< Misses on expired entries
+                uint64_t evictions; ///< Entries dropped for the memory budget
+            };
+
+        protected:
+            struct Entry {
+                std::string key;
+                FileInfoPtr info;
+                Clock::time_point expires;
+                size_t size;
+            };
+
+            typedef std::list<Entry> EntryList;
+
+            struct Shard {
+                std::mutex mutex;
+                EntryList lru; ///< Most recently used first
+                std::unordered_map<std::string, EntryList::iterator> index;
+                size_t memory = 0;
+            };
+
+            Shard shards[SHARD_COUNT];
+            size_t shardBudget;
+            Clock::duration ttl;
+
+            std::atomic<uint64_t> hits;
+            std::atomic<uint64_t> misses;
+            std::atomic<uint64_t> expired;
+            std::atomic<uint64_t> evictions;
+
+            static std::string makeKey(const std::string& bucket, const std::string& filename);
+            Shard& getShard(const std::string& key);
+
+            /**
+             * Drop an entry (call with the shard lock held)
+             */
+            void erase(Shard& shard, EntryList::iterator entry);
+
+        public:
+            /**
+             * @param[in]  budget  Memory budget in bytes
+             * @param[in]  ttl     Time to live in seconds
+             */
+            MetadataCache(size_t budget = DEFAULT_BUDGET, unsigned ttl = DEFAULT_TTL);
+
+            /**
+             * Get the metadata of a file
+             *
+             * @return The metadata or an empty pointer if it is not cached
+             */
+            FileInfoPtr get(const std::string& bucket, const std::string& filename);
+
+            void put(const FileInfoPtr& info);
+            void remove(const std::string& bucket, const std::string& filename);
+            void clear();
+
+            Metrics getMetrics();
+    };
+}
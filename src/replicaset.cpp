@@ -0,0 +1,393 @@
+/*
+ * replicaset.cpp
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "replicaset.hpp"
+
+using namespace gfsfcgi;
+
+const unsigned gfsfcgi::ReplicaSet::HEARTBEAT_INTERVAL;
+const unsigned gfsfcgi::ReplicaSet::CHECK_TIMEOUT;
+const unsigned gfsfcgi::ReplicaSet::LATENCY_WINDOW;
+
+ReadPreference gfsfcgi::ReplicaSet::parseReadPreference(const std::string& name)
+{
+    if (name == "primary") {
+        return ReadPreference::PRIMARY;
+    } else if (name == "primaryPreferred") {
+        return ReadPreference::PRIMARY_PREFERRED;
+    } else if (name == "secondary") {
+        return ReadPreference::SECONDARY;
+    } else if (name == "secondaryPreferred") {
+        return ReadPreference::SECONDARY_PREFERRED;
+    } else if (name == "nearest") {
+        return ReadPreference::NEAREST;
+    }
+
+    throw RuntimeException("Unknown read preference");
+}
+
+gfsfcgi::ReplicaSet::ReplicaSet(const std::vector<std::string>& seeds, const std::string& name, const std::string& database, size_t poolSize) :
+        name(name),
+        database(database),
+        poolSize(poolSize),
+        acquireTimeout(ConnectionPool::DEFAULT_ACQUIRE_TIMEOUT),
+        readPreference(ReadPreference::PRIMARY),
+        random(std::random_device()()),
+        heartbeat(NULL),
+        terminated(false)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    for (auto& host : seeds) {
+        this->getMember(host);
+    }
+}
+
+gfsfcgi::ReplicaSet::~ReplicaSet()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->terminated = true;
+    }
+
+    this->heartbeatCondition.notify_all();
+
+    if (this->heartbeat != NULL) {
+        this->heartbeat->join();
+        delete this->heartbeat;
+    }
+
+    for (auto member : this->members) {
+        if (member->monitor != NULL) {
+            delete member->monitor;
+        }
+
+        delete member->pool;
+        delete member;
+    }
+
+    this->members.clear();
+}
+
+ReplicaSet::Member* gfsfcgi::ReplicaSet::getMember(const std::string& host)
+{
+    for (auto member : this->members) {
+        if (member->host == host) {
+            return member;
+        }
+    }
+
+    Member* member = new Member();
+
+    member->host = host;
+    member->pool = new ConnectionPool(host, this->database, this->poolSize);
+    member->pool->setAcquireTimeout(this->acquireTimeout);
+    member->monitor = NULL;
+    member->up = false;
+    member->primary = false;
+    member->secondary = false;
+    member->latency = -1;
+    member->leases = 0;
+
+    this->members.push_back(member);
+    return member;
+}
+
+void gfsfcgi::ReplicaSet::check(Member* member)
+{
+    mongo::BSONObj info;
+    Clock::duration roundTrip;
+    bool ok = false;
+
+    // The heartbeat connection is only used by the checking thread
+    if (member->monitor == NULL) {
+        std::string error;
+        bool connected = false;
+
+        member->monitor = new mongo::DBClientConnection(false, NULL, CHECK_TIMEOUT);
+
+        try {
+            connected = member->monitor->connect(member->host, error);
+        } catch (mongo::DBException& e) {
+        }
+
+        if (!connected) {
+            delete member->monitor;
+            member->monitor = NULL;
+        }
+    }
+
+    if (member->monitor != NULL) {
+        Clock::time_point start = Clock::now();
+
+        try {
+            ok = member->monitor->simpleCommand("admin", &info, "isMaster");
+        } catch (mongo::DBException& e) {
+        }
+
+        roundTrip = Clock::now() - start;
+
+        if (!ok) {
+            delete member->monitor;
+            member->monitor = NULL;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    // Unreachable or a member of another set
+    if (!ok || (!this->name.empty() && (this->name != info.getStringField("setName")))) {
+        member->up = false;
+        member->primary = false;
+        member->secondary = false;
+
+        return;
+    }
+
+    double latency = std::chrono::duration_cast<std::chrono::microseconds>(roundTrip).count();
+
+    member->up = true;
+    member->primary = info.getBoolField("ismaster");
+    member->secondary = info.getBoolField("secondary");
+    member->latency = (member->latency < 0)? latency : (0.8 * member->latency + 0.2 * latency);
+    member->pool->setQueryOptions(member->primary? 0 : mongo::QueryOption_SlaveOk);
+
+    if (this->name.empty()) {
+        return;
+    }
+
+    const char* fields[] = { "hosts", "passives" };
+
+    for (auto field : fields) {
+        if (info.hasField(field)) {
+            for (auto& host : info[field].Array()) {
+                this->getMember(host.String());
+            }
+        }
+    }
+}
+
+void gfsfcgi::ReplicaSet::checkAll()
+{
+    // Members found during the pass are checked in the same pass
+    for (size_t i = 0; ; i++) {
+        Member* member;
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+
+            if (i >= this->members.size()) {
+                break;
+            }
+
+            member = this->members[i];
+        }
+
+        this->check(member);
+    }
+}
+
+void gfsfcgi::ReplicaSet::runHeartbeat()
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    while (!this->terminated) {
+        this->heartbeatCondition.wait_for(lock, std::chrono::milliseconds(HEARTBEAT_INTERVAL));
+
+        if (this->terminated) {
+            break;
+        }
+
+        lock.unlock();
+        this->checkAll();
+        lock.lock();
+    }
+}
+
+void gfsfcgi::ReplicaSet::discover()
+{
+    this->checkAll();
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    if (this->heartbeat == NULL) {
+        this->heartbeat = new std::thread(&ReplicaSet::runHeartbeat, this);
+    }
+}
+
+void gfsfcgi::ReplicaSet::orderByLatency(std::vector<Member*>& members)
+{
+    if (members.empty()) {
+        return;
+    }
+
+    // Unmeasured members come last, each key is read once as the heartbeat updates them
+    std::vector<std::pair<double, Member*>> ordered;
+
+    ordered.reserve(members.size());
+
+    for (auto member : members) {
+        double latency = member->latency;
+
+        ordered.push_back(std::make_pair((latency < 0)? std::numeric_limits<double>::infinity() : latency, member));
+    }
+
+    std::sort(ordered.begin(), ordered.end(), [](const std::pair<double, Member*>& a, const std::pair<double, Member*>& b) {
+        return a.first < b.first;
+    });
+
+    std::size_t end = 1;
+    double limit = ordered.front().first + LATENCY_WINDOW;
+
+    while ((end < ordered.size()) && std::isfinite(ordered[end].first) && (ordered[end].first <= limit)) {
+        end++;
+    }
+
+    for (std::size_t i = 0; i < ordered.size(); i++) {
+        members[i] = ordered[i].second;
+    }
+
+    std::shuffle(members.begin(), members.begin() + end, this->random);
+}
+
+std::vector<ReplicaSet::Member*> gfsfcgi::ReplicaSet::select()
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    std::vector<Member*> primaries;
+    std::vector<Member*> secondaries;
+    std::vector<Member*> candidates;
+
+    for (auto member : this->members) {
+        if (member->up && member->primary) {
+            primaries.push_back(member);
+        } else if (member->up && member->secondary) {
+            secondaries.push_back(member);
+        }
+    }
+
+    this->orderByLatency(secondaries);
+
+    switch (this->readPreference) {
+        case ReadPreference::PRIMARY:
+            candidates = primaries;
+            break;
+
+        case ReadPreference::PRIMARY_PREFERRED:
+            candidates = primaries;
+            candidates.insert(candidates.end(), secondaries.begin(), secondaries.end());
+            break;
+
+        case ReadPreference::SECONDARY:
+            candidates = secondaries;
+            break;
+
+        case ReadPreference::SECONDARY_PREFERRED:
+            candidates = secondaries;
+            candidates.insert(candidates.end(), primaries.begin(), primaries.end());
+            break;
+
+        case ReadPreference::NEAREST:
+            candidates = primaries;
+            candidates.insert(candidates.end(), secondaries.begin(), secondaries.end());
+            this->orderByLatency(candidates);
+            break;
+    }
+
+    // The heartbeat may not have seen a failover yet, try everyone
+    if (candidates.empty()) {
+        candidates = this->members;
+    }
+
+    return candidates;
+}
+
+ConnectionPool::Lease gfsfcgi::ReplicaSet::acquire()
+{
+    for (auto member : this->select()) {
+        try {
+            ConnectionPool::Lease lease = member->pool->acquire();
+
+            member->leases++;
+            return lease;
+        } catch (TimeoutException& e) {
+            // Busy, but not broken
+        } catch (IOException& e) {
+            // Skip the member until the heartbeat sees it again
+            std::lock_guard<std::mutex> lock(this->mutex);
+            member->up = false;
+        }
+    }
+
+    throw IOException("No MongoDB member available for reads");
+}
+
+void gfsfcgi::ReplicaSet::invalidate(ConnectionPool::Lease& lease)
+{
+    ConnectionPool* pool = lease.getPool();
+
+    lease.invalidate();
+    lease.release();
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    for (auto member : this->members) {
+        if (member->pool == pool) {
+            member->up = false;
+        }
+    }
+}
+
+size_t gfsfcgi::ReplicaSet::warmUp(size_t count)
+{
+    size_t open = 0;
+
+    for (auto member : this->select()) {
+        open += member->pool->warmUp(count);
+    }
+
+    return open;
+}
+
+void gfsfcgi::ReplicaSet::setReadPreference(ReadPreference readPreference)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->readPreference = readPreference;
+}
+
+void gfsfcgi::ReplicaSet::setAcquireTimeout(unsigned int msec)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+
+    this->acquireTimeout = msec;
+
+    for (auto member : this->members) {
+        member->pool->setAcquireTimeout(msec);
+    }
+}
+
+std::vector<ReplicaSet::MemberState> gfsfcgi::ReplicaSet::getMembers() const
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    std::vector<MemberState> states;
+
+    for (auto member : this->members) {
+        MemberState state;
+
+        state.host = member->host;
+        state.up = member->up;
+        state.primary = member->primary;
+        state.secondary = member->secondary;
+        state.latency = (member->latency > 0)? member->latency : 0;
+        state.leases = member->leases;
+        state.pool = member->pool->getMetrics();
+
+        states.push_back(state);
+    }
+
+    return states;
+}
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <mongo/client/dbclientinterface.h>
+
+#include "connectionpool.hpp"
+#include "exceptions.hpp"
+
+namespace gfsfcgi
+{
+    /**
+     * Which members may serve reads
+     */
+    enum class ReadPreference { PRIMARY, PRIMARY_PREFERRED, SECONDARY, SECONDARY_PREFERRED, NEAREST };
+
+    /**
+     * MongoDB replica set (or a standalone server)
+     *
+     * Members are discovered from the seed hosts with isMaster and checked by a
+     * heartbeat thread, which also measures their round trip time. Each member has its
+     * own connection pool. Reads go to a random eligible member whose latency is within
+     * LATENCY_WINDOW of the fastest one, the other eligible members are tried in order
+     * of latency if it fails.
+     */
+    class ReplicaSet
+    {
+        public:
+            typedef ConnectionPool::Clock Clock;
+
+            const static unsigned HEARTBEAT_INTERVAL = 10000; ///< Milliseconds between member checks
+            const static unsigned CHECK_TIMEOUT = 5; ///< Seconds a member may take to answer a check
+            const static unsigned LATENCY_WINDOW = 15000; ///< Microseconds above the fastest member
+
+            /**
+             * Member state for monitoring
+             */
+            struct MemberState {
+                std::string host;
+                bool up;
+                bool primary;
+                bool secondary;
+                uint64_t latency; ///< Average round trip (microseconds)
+                uint64_t leases; ///< Connections handed out
+                ConnectionPool::Metrics pool;
+            };
+
+            /**
+             * Parse a read preference name (primary, primaryPreferred, secondary,
+             * secondaryPreferred or nearest)
+             *
+             * @throws RuntimeException for unknown names
+             */
+            static ReadPreference parseReadPreference(const std::string& name);
+
+        protected:
+            struct Member {
+                std::string host;
+                ConnectionPool* pool;
+                mongo::DBClientConnection* monitor; ///< Heartbeat connection, not pooled
+                bool up;
+                bool primary;
+                bool secondary;
+                double latency; ///< Moving average of the round trip (microseconds)
+                std::atomic<uint64_t> leases;
+            };
+
+            std::string name;
+            std::string database;
+            size_t poolSize;
+            unsigned acquireTimeout;
+            ReadPreference readPreference;
+
+            mutable std::mutex mutex; ///< Protects the member list and states
+            std::condition_variable heartbeatCondition;
+            std::vector<Member*> members;
+            std::minstd_rand random;
+            std::thread* heartbeat;
+            bool terminated;
+
+            /**
+             * Get a member, adding it if it is unknown (call with the lock held)
+             */
+            Member* getMember(const std::string& host);
+
+            /**
+             * Run isMaster on a member, update its state and add the hosts it reports
+             */
+            void check(Member* member);
+            void checkAll();
+            void runHeartbeat();
+
+            /**
+             * Order members by latency, shuffling those within the latency window
+             * (call with the lock held)
+             */
+            void orderByLatency(std::vector<Member*>& members);
+
+            /**
+             * Get the members to try for a read in order of preference
+             */
+            std::vector<Member*> select();
+
+        public:
+            /**
+             * @param[in]  seeds     Hosts to discover the set from (host[:port])
+             * @param[in]  name      The replica set name, empty for a standalone server
+             * @param[in]  database  The GridFS database
+             * @param[in]  poolSize  Maximum connections per member
+             */
+            ReplicaSet(const std::vector<std::string>& seeds, const std::string& name, const std::string& database, size_t poolSize = ConnectionPool::DEFAULT_MAX_SIZE);
+            virtual ~ReplicaSet();
+
+            inline const std::string& getDatabase() const
+            {
+                return this->database;
+            }
+
+            void setReadPreference(ReadPreference readPreference);
+            void setAcquireTimeout(unsigned int msec);
+
+            /**
+             * Check the seeds and start the heartbeat
+             */
+            void discover();
+
+            /**
+             * Take a connection to a member that may serve reads
+             *
+             * Fails over to the next eligible member if a member cannot be reached.
+             *
+             * @throws IOException if no member is available
+             */
+            ConnectionPool::Lease acquire();
+
+            /**
+             * Give back a connection whose query failed
+             *
+             * The connection is reconnected before it is leased again and its member is
+             * skipped until the heartbeat sees it again, so the next acquire() fails over.
+             */
+            void invalidate(ConnectionPool::Lease& lease);
+
+            /**
+             * Open connections to each eligible member ahead of the first requests
+             *
+             * @return The number of open connections
+             */
+            size_t warmUp(size_t count);
+
+            std::vector<MemberState> getMembers() const;
+    };
+}
@@ -0,0 +1,530 @@
+/*
+ * requesthandler.cpp
+ */
+
+#include "requesthandler.hpp"
+
+using namespace gfsfcgi;
+
+////////////////////////////////////////
+// Chunk iterator
+
+const unsigned int gfsfcgi::ChunkIterator::MAX_READ_AHEAD;
+const std::size_t gfsfcgi::ChunkIterator::DEFAULT_READ_AHEAD_BUDGET;
+
+gfsfcgi::ChunkIterator::ChunkIterator(const FileInfoPtr& file, ChunkLoader loader) : file(file), loader(loader),
+		fetchPool(NULL), budget(0), drainTime(0)
+{
+	this->byteRange.size = file->length;
+}
+
+gfsfcgi::ChunkIterator::~ChunkIterator()
+{
+	// Fetches still in flight finish on the shared state
+	if (this->readAhead) {
+		std::lock_guard<std::mutex> lock(this->readAhead->mutex);
+		this->readAhead->notifier = nullptr;
+	}
+}
+
+void gfsfcgi::ChunkIterator::setReadAhead(FetchPool& fetchPool, ChunkLoader fetcher, std::function<void()> notifier, std::size_t budget)
+{
+	this->fetchPool = &fetchPool;
+	this->fetcher = fetcher;
+	this->budget = budget;
+	this->readAhead = std::make_shared<ReadAhead>();
+	this->readAhead->notifier = notifier;
+	this->readAhead->position = this->pos;
+}
+
+void gfsfcgi::ChunkIterator::setByteRange(const std::size_t& offset, const std::size_t& size)
+{
+	std::size_t length = this->file->length;
+
+	this->byteRange.offset = (offset < length)? offset : length;
+	this->byteRange.size = (size < (length - this->byteRange.offset))? size : (length - this->byteRange.offset);
+
+	this->pos = (this->file->chunkSize > 0)? this->byteRange.offset / this->file->chunkSize : 0;
+	this->chunk.reset();
+
+	if (this->readAhead) {
+		std::lock_guard<std::mutex> lock(this->readAhead->mutex);
+
+		this->readAhead->ready.clear();
+		this->readAhead->failed.clear();
+		this->readAhead->bufferedBytes = 0;
+		this->readAhead->position = this->pos;
+	}
+}
+
+std::size_t gfsfcgi::ChunkIterator::getBegin() const
+{
+	std::size_t begin = (std::size_t)this->pos * this->file->chunkSize;
+	return (begin > this->byteRange.offset)? begin : this->byteRange.offset;
+}
+
+std::size_t gfsfcgi::ChunkIterator::getEnd() const
+{
+	std::size_t end = (std::size_t)(this->pos + 1) * this->file->chunkSize;
+	std::size_t rangeEnd = this->byteRange.offset + this->byteRange.size;
+
+	return (end < rangeEnd)? end : rangeEnd;
+}
+
+unsigned int gfsfcgi::ChunkIterator::getLastChunk() const
+{
+	std::size_t rangeEnd = this->byteRange.offset + this->byteRange.size;
+	return (rangeEnd > 0)? (rangeEnd - 1) / this->file->chunkSize : 0;
+}
+
+unsigned int gfsfcgi::ChunkIterator::getWindow() const
+{
+	unsigned int window = 2;
+	unsigned int limit = this->budget / this->file->chunkSize;
+
+	// Keep enough chunks ahead to hide one fetch while the client drains chunks
+	if ((this->drainTime > 0) && (this->readAhead->fetchTime > 0)) {
+		window = (unsigned int)(this->readAhead->fetchTime / this->drainTime) + 2;
+	}
+
+	if (limit > MAX_READ_AHEAD) {
+		limit = MAX_READ_AHEAD;
+	}
+
+	if (window > limit) {
+		window = limit;
+	}
+
+	return (window > 0)? window : 1;
+}
+
+void gfsfcgi::ChunkIterator::schedule()
+{
+	ReadAhead& state = *(this->readAhead);
+	unsigned int last = this->getLastChunk();
+	unsigned int end = this->pos + this->getWindow();
+
+	for (unsigned int n = this->pos; (n < end) && (n <= last); n++) {
+		if (((n == this->pos) && this->chunk) || state.ready.count(n) || state.inFlight.count(n) || state.failed.count(n)) {
+			continue;
+		}
+
+		// The current chunk is always fetched
+		if ((n != this->pos) && ((state.bufferedBytes + (state.inFlight.size() + 1) * this->file->chunkSize) > this->budget)) {
+			break;
+		}
+
+		std::shared_ptr<ReadAhead> readAhead = this->readAhead;
+		FileInfoPtr file = this->file;
+		ChunkLoader fetcher = this->fetcher;
+
+		state.inFlight.insert(n);
+
+		this->fetchPool->submit([readAhead, file, fetcher, n]() {
+			Clock::time_point start = Clock::now();
+			ChunkPtr chunk;
+
+			// Failed chunks are loaded again by the iterator, which reports the error
+			try {
+				chunk = fetcher(*file, n);
+			} catch (...) {
+			}
+
+			double fetchTime = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+			std::lock_guard<std::mutex> lock(readAhead->mutex);
+
+			readAhead->inFlight.erase(n);
+			readAhead->fetchTime = (readAhead->fetchTime > 0)? (0.8 * readAhead->fetchTime + 0.2 * fetchTime) : fetchTime;
+
+			if (n < readAhead->position) {
+				return;
+			}
+
+			if (chunk) {
+				readAhead->ready[n] = chunk;
+				readAhead->bufferedBytes += chunk->size;
+			} else {
+				readAhead->failed.insert(n);
+			}
+
+			if (n == readAhead->position) {
+				readAhead->condition.notify_all();
+
+				if (readAhead->notifier) {
+					readAhead->notifier();
+				}
+			}
+		});
+	}
+}
+
+bool gfsfcgi::ChunkIterator::ready()
+{
+	if (this->chunk || !this->readAhead || !this->valid()) {
+		return true;
+	}
+
+	std::lock_guard<std::mutex> lock(this->readAhead->mutex);
+	this->schedule();
+
+	return this->readAhead->ready.count(this->pos) || this->readAhead->failed.count(this->pos);
+}
+
+bool gfsfcgi::ChunkIterator::valid()
+{
+	return (this->file->chunkSize > 0) && (this->getBegin() < this->getEnd());
+}
+
+bool gfsfcgi::ChunkIterator::next()
+{
+	// Time the client took for the chunk, without waiting for fetches
+	if (this->chunk) {
+		double drainTime = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - this->loadedAt).count();
+		this->drainTime = (this->drainTime > 0)? (0.8 * this->drainTime + 0.2 * drainTime) : drainTime;
+	}
+
+	this->pos++;
+	this->chunk.reset();
+
+	if (this->readAhead) {
+		std::lock_guard<std::mutex> lock(this->readAhead->mutex);
+
+		this->readAhead->position = this->pos;
+		this->readAhead->failed.erase(this->pos - 1);
+
+		if (this->valid()) {
+			this->schedule();
+		}
+	}
+
+	return this->valid();
+}
+
+ChunkPtr gfsfcgi::ChunkIterator::getChunk()
+{
+	if (this->chunk || !this->valid()) {
+		return this->chunk;
+	}
+
+	if (!this->readAhead) {
+		this->chunk = this->loader(*(this->file), this->pos);
+		this->loadedAt = Clock::now();
+
+		return this->chunk;
+	}
+
+	std::unique_lock<std::mutex> lock(this->readAhead->mutex);
+	ReadAhead& state = *(this->readAhead);
+
+	this->schedule();
+
+	// Blocks only if the caller did not wait for ready()
+	while (!this->chunk) {
+		auto found = state.ready.find(this->pos);
+
+		if (found != state.ready.end()) {
+			this->chunk = found->second;
+			state.bufferedBytes -= this->chunk->size;
+			state.ready.erase(found);
+		} else if (state.failed.count(this->pos)) {
+			state.failed.erase(this->pos);
+			lock.unlock();
+
+			this->chunk = this->loader(*(this->file), this->pos);
+			lock.lock();
+		} else {
+			state.condition.wait(lock);
+		}
+	}
+
+	// The taken chunk freed budget
+	this->schedule();
+	this->loadedAt = Clock::now();
+
+	return this->chunk;
+}
+
+unsigned int gfsfcgi::ChunkIterator::getDataSize()
+{
+	ChunkPtr chunk = this->getChunk();
+
+	if (!chunk) {
+		return 0;
+	}
+
+	// Short chunks end the data early
+	std::size_t offset = this->getBegin() - (std::size_t)this->pos * this->file->chunkSize;
+	std::size_t size = this->getEnd() - this->getBegin();
+
+	if (offset >= chunk->size) {
+		return 0;
+	}
+
+	return (size < (chunk->size - offset))? size : (chunk->size - offset);
+}
+
+const char* gfsfcgi::ChunkIterator::getData()
+{
+	ChunkPtr chunk = this->getChunk();
+
+	if (!chunk || (this->getDataSize() == 0)) {
+		return NULL;
+	}
+
+	return chunk->data + (this->getBegin() - (std::size_t)this->pos * this->file->chunkSize);
+}
+
+////////////////////////////////////////
+// Request handler
+
+FileInfoPtr gfsfcgi::RequestHandler::findFile(const std::string& bucket, const std::string& filename)
+{
+	FileInfoPtr info = this->metadataCache.get(bucket, filename);
+
+	if (info) {
+		return info;
+	}
+
+	mongo::BSONObj file;
+	std::string ns = this->replicaSet.getDatabase() + "." + bucket + ".files";
+
+	// The retry goes to another member if there is one
+	for (int attempt = 0; ; attempt++) {
+		ConnectionPool::Lease connection = this->replicaSet.acquire();
+
+		try {
+			// The newest upload wins, like GridFS::findFile()
+			file = connection.getClient().findOne(
+				ns,
+				mongo::Query(BSON("filename" << filename)).sort("uploadDate", -1),
+				NULL,
+				connection.getQueryOptions()
+			);
+			break;
+		} catch (mongo::DBException& e) {
+			this->replicaSet.invalidate(connection);
+
+			if (attempt > 0) {
+				throw IOException("Failed to query the file metadata");
+			}
+		}
+	}
+
+	if (file.isEmpty()) {
+		return info;
+	}
+
+	info = std::make_shared<FileInfo>(FileInfo::fromBSON(bucket, file.getOwned()));
+	this->metadataCache.put(info);
+
+	return info;
+}
+
+ChunkPtr gfsfcgi::RequestHandler::queryChunk(ReplicaSet& replicaSet, const FileInfo& file, unsigned int n)
+{
+	mongo::BSONObj document;
+	std::string ns = replicaSet.getDatabase() + "." + file.bucket + ".chunks";
+
+	// Leased for this query only, the connection goes back to its pool right after it
+	for (int attempt = 0; ; attempt++) {
+		ConnectionPool::Lease connection = replicaSet.acquire();
+
+		try {
+			document = connection.getClient().findOne(
+				ns,
+				mongo::Query(BSON("files_id" << file.id.firstElement() << "n" << n)),
+				NULL,
+				connection.getQueryOptions()
+			);
+			break;
+		} catch (mongo::DBException& e) {
+			// The retry goes to another member if there is one
+			replicaSet.invalidate(connection);
+
+			if (attempt > 0) {
+				throw IOException("Failed to read a chunk");
+			}
+		}
+	}
+
+	if (document.isEmpty()) {
+		throw IOException("Missing chunk");
+	}
+
+	// The chunk keeps the driver's buffer, its data is never copied
+	return Chunk::fromBSON(document.getOwned());
+}
+
+ChunkPtr gfsfcgi::RequestHandler::loadChunk(const FileInfo& file, unsigned int n)
+{
+	return fetchChunk(this->replicaSet, this->chunkCache, file, n);
+}
+
+ChunkPtr gfsfcgi::RequestHandler::fetchChunk(ReplicaSet& replicaSet, ChunkCache& chunkCache, const FileInfo& file, unsigned int n)
+{
+	ChunkKey key(file.id, n);
+	ChunkPtr chunk = chunkCache.get(key);
+
+	if (chunk) {
+		return chunk;
+	}
+
+	chunk = queryChunk(replicaSet, file, n);
+	chunkCache.put(key, chunk);
+
+	return chunk;
+}
+
+ChunkIterator* gfsfcgi::RequestHandler::createChunkIterator(const FileInfoPtr& file)
+{
+	using namespace std::placeholders;
+
+	ChunkIterator* chunks = new ChunkIterator(file, std::bind(&RequestHandler::loadChunk, this, _1, _2));
+
+	chunks->setReadAhead(
+		this->fetchPool,
+		std::bind(&RequestHandler::fetchChunk, std::ref(this->replicaSet), std::ref(this->chunkCache), _1, _2),
+		std::bind(&RequestHandler::notify, this)
+	);
+
+	return chunks;
+}
+
+////////////////////////////////////////
+// Response
+
+const std::size_t gfsfcgi::RequestHandler::SLICE_SIZE;
+const std::string gfsfcgi::RequestHandler::DEFAULT_BUCKET = "fs";
+
+void gfsfcgi::RequestHandler::Output::notify()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+
+	if (this->notifier) {
+		this->notifier();
+	}
+}
+
+gfsfcgi::RequestHandler::~RequestHandler()
+{
+	delete this->chunks;
+}
+
+bool gfsfcgi::RequestHandler::response()
+{
+	// The worker sends the file and posts a message once it is done
+	return (this->state == COMPLETE);
+}
+
+bool gfsfcgi::RequestHandler::sendData()
+{
+	try {
+		switch (this->state) {
+			case START:
+				if (!this->start()) {
+					this->complete();
+					return false;
+				}
+
+				this->state = SENDING;
+				return true;
+
+			case SENDING:
+				return this->sendChunks();
+
+			default:
+				return false;
+		}
+	} catch (IOException& e) {
+		// The headers are out once the body is sent, the response can only be cut short
+		if (this->state == START) {
+			this->out << "Status: 500 Internal Server Error\r\n\r\n";
+		}
+
+		this->complete();
+		return false;
+	}
+}
+
+bool gfsfcgi::RequestHandler::start()
+{
+	const std::vector<std::string>& path = this->environment().pathInfo;
+	std::string bucket = DEFAULT_BUCKET;
+	std::string filename;
+
+	// /bucket/name or /name in the default bucket
+	for (std::size_t i = (path.size() > 1)? 1 : 0; i < path.size(); i++) {
+		filename += (filename.empty()? "" : "/") + path[i];
+	}
+
+	if (path.size() > 1) {
+		bucket = path[0];
+	}
+
+	this->file = this->findFile(bucket, filename);
+
+	if (!this->file) {
+		this->out << "Status: 404 Not Found\r\n\r\n";
+		return false;
+	}
+
+	this->out << "Content-Type: " << (this->file->contentType.empty()? "application/octet-stream" : this->file->contentType) << "\r\n";
+	this->out << "Content-Length: " << this->file->length << "\r\n";
+
+	if (!this->file->md5.empty()) {
+		this->out << "ETag: \"" << this->file->md5 << "\"\r\n";
+	}
+
+	this->out << "\r\n";
+
+	// Chunks ahead are fetched on the fetch pool, ready() tells when to block
+	this->chunks = this->createChunkIterator(this->file);
+
+	return (this->file->length > 0);
+}
+
+bool gfsfcgi::RequestHandler::sendChunks()
+{
+	std::size_t sent = 0;
+
+	while (this->chunks->valid()) {
+		if (!this->chunks->ready()) {
+			this->block();
+			return true;
+		}
+
+		// Let the other handlers of the worker run
+		if (sent >= SLICE_SIZE) {
+			return true;
+		}
+
+		ChunkPtr chunk = this->chunks->getChunk();
+		const char* data = this->chunks->getData();
+		std::size_t size = this->chunks->getDataSize();
+
+		if ((data == NULL) || (size == 0)) {
+			throw IOException("Short chunk");
+		}
+
+		this->out.dump(data, size);
+		sent += size;
+
+		this->chunks->next();
+	}
+
+	this->complete();
+	return false;
+}
+
+void gfsfcgi::RequestHandler::complete()
+{
+	Fastcgipp::Message message;
+
+	// fastcgi++ may delete the handler as soon as the message is posted, the worker
+	// must not be reached through it after that
+	this->setNotifier(nullptr);
+	this->state = COMPLETE;
+	message.type = 1;
+
+	this->callback()(message);
+}
@@ -1,30 +1,122 @@
 #pragma once
 
 #include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <map>
+#include <set>
+#include <atomic>
+#include <memory>
+#include <chrono>
+#include <condition_variable>
 #include <fastcgi++/request.hpp>
 #include <mongo/client/gridfs.h>
 
+#include "replicaset.hpp"
+#include "metadatacache.hpp"
+#include "chunkcache.hpp"
+#include "fetchpool.hpp"
+
 namespace gfsfcgi
 {
 	using mongo::GridFile;
 	using mongo::GridFS;
 
+	/**
+	 * Loads chunk n of a file
+	 */
+	typedef std::function<ChunkPtr(const FileInfo& file, unsigned int n)> ChunkLoader;
+
+	/**
+	 * Iterates the chunks covering a byte range of a file
+	 *
+	 * getData() points into the chunk itself and stays valid while the chunk returned
+	 * by getChunk() is held.
+	 *
+	 * With read-ahead, the chunks following the current one are fetched in the
+	 * background. The window covers one fetch at the pace the client drains chunks,
+	 * and the chunks buffered or in flight stay within the memory budget.
+	 */
 	class ChunkIterator
 	{
+		public:
+			const static unsigned int MAX_READ_AHEAD = 16; ///< Chunks
+			const static std::size_t DEFAULT_READ_AHEAD_BUDGET = 4 * 1024 * 1024; ///< Bytes per request
+
 		protected:
+			typedef std::chrono::steady_clock Clock;
+
 			struct ByteRange {
 				std::size_t offset = 0;
 				std::size_t size = 0;
 			};
 
-			GridFile file;
+			/**
+			 * Read-ahead state, shared with the fetches in flight
+			 */
+			struct ReadAhead {
+				std::mutex mutex;
+				std::condition_variable condition;
+				std::map<unsigned int, ChunkPtr> ready;
+				std::set<unsigned int> inFlight;
+				std::set<unsigned int> failed;
+				std::size_t bufferedBytes = 0; ///< Size of the ready chunks
+				unsigned int position = 0; ///< Fetches of earlier chunks are dropped
+				double fetchTime = 0; ///< Moving average (microseconds)
+				std::function<void()> notifier; ///< Cleared when the iterator is destroyed
+			};
+
+			FileInfoPtr file;
+			ChunkLoader loader;
 			unsigned int pos = 0;
+			ChunkPtr chunk; ///< The loaded current chunk
+
+			ByteRange byteRange;
+
+			// Read-ahead
+			FetchPool* fetchPool;
+			ChunkLoader fetcher;
+			std::size_t budget;
+			std::shared_ptr<ReadAhead> readAhead;
+			double drainTime; ///< Moving average time the client takes per chunk (microseconds)
+			Clock::time_point loadedAt; ///< When the current chunk became available
+
+			/**
+			 * First and last byte of the current chunk within the range
+			 */
+			std::size_t getBegin() const;
+			std::size_t getEnd() const;
 
-			ByteRange* byteRange;
+			unsigned int getLastChunk() const;
+
+			/**
+			 * Number of chunks to keep ahead, starting with the current one
+			 */
+			unsigned int getWindow() const;
+
+			/**
+			 * Start fetches within the window and budget (call with the read-ahead lock)
+			 */
+			void schedule();
 
 		public:
-			ChunkIterator(GridFile& file) : file(file), byteRange(NULL) {};
-			virtual inline ~ChunkIterator() {};
+			ChunkIterator(const FileInfoPtr& file, ChunkLoader loader);
+			virtual ~ChunkIterator();
+
+			/**
+			 * Fetch chunks ahead on a fetch pool
+			 *
+			 * @param[in]  fetchPool  The pool running the fetches
+			 * @param[in]  fetcher    Loads a chunk on a fetch thread
+			 * @param[in]  notifier   Called on a fetch thread when the current chunk arrived
+			 * @param[in]  budget     Bytes buffered or in flight at most
+			 */
+			void setReadAhead(FetchPool& fetchPool, ChunkLoader fetcher, std::function<void()> notifier, std::size_t budget = DEFAULT_READ_AHEAD_BUDGET);
+
+			/**
+			 * Check if getChunk() would not block on a fetch
+			 */
+			bool ready();
 
 			bool next();
 			bool valid();
@@ -33,19 +125,167 @@ namespace gfsfcgi
 
 			unsigned int getDataSize();
 			const char* getData();
+
+			/**
+			 * Get the current chunk, loading it if necessary
+			 */
+			ChunkPtr getChunk();
 	};
 
+	/**
+	 * Sends a GridFS file
+	 *
+	 * The handler runs on a Worker: sendData() is called until it returns false. It
+	 * block()s while the next chunk is not available and notify()s the worker once
+	 * the chunk arrived.
+	 */
 	class RequestHandler : public Fastcgipp::Request<char>
 	{
+		public:
+			/**
+			 * Called when a blocked handler can make progress again
+			 */
+			typedef std::function<void()> Notifier;
+
+			const static std::size_t SLICE_SIZE = 1024 * 1024; ///< Bytes sent per sendData() call at most
+			const static std::string DEFAULT_BUCKET;
+
 		protected:
+			/**
+			 * Notifier set by the worker, called from the fetch threads
+			 */
+			struct Output {
+				std::mutex mutex;
+				Notifier notifier;
+
+				void notify();
+			};
+
 			enum State {START, SENDING, COMPLETE} state;
-			GridFS& gridfs;
+			ReplicaSet& replicaSet;
+			MetadataCache& metadataCache;
+			ChunkCache& chunkCache;
+			FetchPool& fetchPool;
+			FileInfoPtr file;
 			ChunkIterator* chunks;
 
+			Output output;
+			bool blocked;
+
+			/**
+			 * Tell the worker that sendData() cannot make progress until notify() is called
+			 * (i.e. the next chunk is not available, yet)
+			 */
+			inline void block()
+			{
+				this->blocked = true;
+			}
+
+			/**
+			 * Look up the newest file with the given name, from the metadata cache if
+			 * possible
+			 *
+			 * A failed query is retried once, its member is skipped for the retry.
+			 *
+			 * @return The file or an empty pointer if there is none
+			 * @throws IOException if no connection is available
+			 */
+			FileInfoPtr findFile(const std::string& bucket, const std::string& filename);
+
+			/**
+			 * Load a chunk from the chunk cache or the database (a ChunkLoader)
+			 *
+			 * Like findFile(), it leases a connection for the query only, so a download
+			 * does not hold one while it waits for the client.
+			 *
+			 * @throws IOException if the chunk cannot be read
+			 */
+			ChunkPtr loadChunk(const FileInfo& file, unsigned int n);
+
+			/**
+			 * Load a chunk with a connection leased for the query (any thread)
+			 */
+			static ChunkPtr fetchChunk(ReplicaSet& replicaSet, ChunkCache& chunkCache, const FileInfo& file, unsigned int n);
+
+			/**
+			 * Read a chunk document, retrying once if the member fails
+			 *
+			 * @throws IOException if the chunk cannot be read
+			 */
+			static ChunkPtr queryChunk(ReplicaSet& replicaSet, const FileInfo& file, unsigned int n);
+
+			/**
+			 * Create the chunk iterator of a file with read-ahead
+			 */
+			ChunkIterator* createChunkIterator(const FileInfoPtr& file);
+
+			/**
+			 * Look up the requested file and send the headers
+			 *
+			 * @return false if there is no body to send
+			 */
+			bool start();
+
+			/**
+			 * Send chunks until SLICE_SIZE bytes were sent or a chunk is not available
+			 *
+			 * fastcgi++ copies the data into its own buffer, the chunk is not referenced
+			 * once it was written.
+			 *
+			 * @return false once the file was sent
+			 */
+			bool sendChunks();
+
+			/**
+			 * Mark the request complete and let fastcgi++ end it
+			 *
+			 * Clears the notifier first, the handler may be deleted once this returns.
+			 */
+			void complete();
+
 		public:
-			inline RequestHandler(GridFS& gridfs) : gridfs(gridfs), chunks(NULL), state(START) {};
+			inline RequestHandler(ReplicaSet& replicaSet, MetadataCache& metadataCache, ChunkCache& chunkCache, FetchPool& fetchPool) : state(START), replicaSet(replicaSet), metadataCache(metadataCache), chunkCache(chunkCache), fetchPool(fetchPool), chunks(NULL), blocked(false) {};
 			virtual ~RequestHandler();
+
+			/**
+			 * Called by fastcgi++, ends the request once the worker sent the file
+			 */
 			bool response();
+
+			/**
+			 * Send the next part of the response (worker thread)
+			 *
+			 * @return false once the response is complete, the handler may already be
+			 *         deleted then
+			 */
 			bool sendData();
+
+			/**
+			 * Check and reset the blocked flag after sendData()
+			 */
+			inline bool checkBlocked()
+			{
+				bool blocked = this->blocked;
+				this->blocked = false;
+
+				return blocked;
+			}
+
+			/**
+			 * Set the callback that makes this handler runnable again
+			 */
+			inline void setNotifier(Notifier notifier)
+			{
+				std::lock_guard<std::mutex> lock(this->output.mutex);
+				this->output.notifier = notifier;
+			}
+
+			/**
+			 * The next chunk became available (any thread)
+			 */
+			inline void notify()
+			{
+				this->output.notify();
+			}
 	};
 }
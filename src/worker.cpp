@@ -7,71 +7,142 @@ namespace gfsfcgi
 {
 	template<class T> class Deallocator<std::thread>;
 
-	Worker::Worker() : thread(NULL), first(NULL), last(NULL), size(0)
+	Worker::Worker() : thread(NULL), first(NULL), last(NULL), size(0), running(false),
+		busyTime(0), sampledBusyTime(0), sampledAt(Clock::now())
 	{
 	}
 
 	void Worker::doRun()
 	{
-		while (true) {
-			auto current = this->first;
+		std::unique_lock<std::mutex> lock(this->mutex);
 
-			while (current != NULL) {
-				if (current->handler->sendData()) {
-					current = this->next(current);
-					std::this_thread::yield();
-					continue;
-				}
+		while (this->running) {
+			if (this->runQueue.empty()) {
+				// Nothing runnable, sleep until a handler is attached or notified
+				this->readyCondition.wait(lock);
+				continue;
+			}
+
+			auto current = this->runQueue.front();
+			this->runQueue.pop_front();
+
+			current->state = RequestList::RUNNING;
+			current->notified = false;
+			lock.unlock();
 
-				auto next = this->next(current);
+			auto start = Clock::now();
+			bool more = current->handler->sendData();
+			bool blocked = more && current->handler->checkBlocked();
+
+			this->busyTime += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+			// The handler completed and cleared its notifier, fastcgi++ may have deleted it
+			if (!more) {
 				this->remove(current);
 
-				current = next;
-				std::this_thread::yield();
+				lock.lock();
+				continue;
 			}
 
-			std::this_thread::yield();
+			lock.lock();
+
+			// A notification during sendData() may have been missed by the handler
+			if (blocked && !current->notified) {
+				current->state = RequestList::WAITING;
+			} else {
+				current->state = RequestList::QUEUED;
+				this->runQueue.push_back(current);
+			}
+		}
+	}
+
+	void Worker::wake(RequestList* item)
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+
+		switch (item->state) {
+			case RequestList::WAITING:
+				item->state = RequestList::QUEUED;
+				this->runQueue.push_back(item);
+				this->readyCondition.notify_one();
+				break;
+
+			case RequestList::RUNNING:
+				item->notified = true;
+				break;
+
+			default:
+				break;
 		}
 	}
 
+	std::size_t Worker::getRunnableCount() const
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		return this->runQueue.size();
+	}
+
+	double Worker::sampleUtilization()
+	{
+		auto now = Clock::now();
+		uint64_t busy = this->busyTime;
+		auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - this->sampledAt).count();
+		double utilization = (elapsed > 0)? (double)(busy - this->sampledBusyTime) / elapsed : 0;
+
+		this->sampledBusyTime = busy;
+		this->sampledAt = now;
+
+		return (utilization > 1)? 1 : utilization;
+	}
+
 	void Worker::attachHandler(RequestHandler* handler)
 	{
 		if (handler == NULL) {
 			throw NullPointerException("Request Handler");
 		}
 
-		std::lock_guard lock(this->mutex);
+		std::lock_guard<std::mutex> lock(this->mutex);
+		auto newItem = new RequestList;
+		newItem->handler = handler;
 
 		if (this->last == NULL) {
-			if (this->first == NULL) {
+			if (this->first != NULL) {
 			    throw RuntimeException("Inconsistent worker state: Initial list pointer is not null.");
 			}
 
-			this->first = this->last = new RequestList;
-			this->last->handler = handler;
+			this->first = this->last = newItem;
 		} else {
-			auto newItem = new RequestList;
-			newItem->handler = handler;
 			newItem->previous = this->last;
 
 			this->last->next = newItem;
 			this->last = newItem;
 		}
 
+		handler->setNotifier([this, newItem]() {
+			this->wake(newItem);
+		});
+
+		this->runQueue.push_back(newItem);
 		this->size++;
+		this->readyCondition.notify_one();
 	}
 
+	/**
+	 * Free the request list, the worker thread must have exited
+	 */
 	void Worker::freeList()
 	{
-	    this->assertSameThreadContext();
 		RequestList* current = this->first;
 
 		while (current != NULL) {
 			RequestList* next = current->next;
+
+			current->handler->setNotifier(nullptr);
 			delete current;
 			current = next;
 		}
 
+		this->runQueue.clear();
 		this->first = NULL;
 		this->last = NULL;
 		this->size = 0;
@@ -84,7 +155,7 @@ namespace gfsfcgi
 	    }
 
 	    this->assertSameThreadContext();
-		std::lock_guard lock(this->mutex);
+		std::lock_guard<std::mutex> lock(this->mutex);
 
 		if ((item->previous == NULL) && (item->next != NULL)) {
 			this->first = item->next;
@@ -106,15 +177,6 @@ namespace gfsfcgi
 		this->size--;
 	}
 
-	/**
-	 * Move to next list pointer
-	 */
-	Worker::RequestList* Worker::next(RequestList* item)
-	{
-	    this->assertSameThreadContext();
-		return item->next;
-	}
-
     void Worker::assertSameThreadContext()
     {
         if (this->thread->get_id() != std::this_thread::get_id()) {
@@ -127,7 +189,8 @@ namespace gfsfcgi
      */
 	void Worker::run()
 	{
-		this->thread = new std::thread(std::bind(Worker::doRun(), this));
+		this->running = true;
+		this->thread = new std::thread(std::bind(&Worker::doRun, this));
 		this->allocatorGuard.add(dynamic_cast<DeallocatorInterface&>(Deallocator(this->thread)));
 	}
 
@@ -141,19 +204,41 @@ namespace gfsfcgi
 
 	void WorkerPool::run()
 	{
-		for (auto worker : this->items) {
+		for (auto& worker : this->items) {
 			worker.run();
 		}
 	}
 
 	void WorkerPool::exit()
 	{
-		for (auto worker : this->items) {
+		for (auto& worker : this->items) {
 			worker.exit();
 		}
 	}
 
+	std::vector<double> WorkerPool::getUtilization()
+	{
+		std::vector<double> utilization;
+		utilization.reserve(this->items.size());
+
+		for (auto& worker : this->items) {
+			utilization.push_back(worker.sampleUtilization());
+		}
+
+		return utilization;
+	}
+
     void Worker::exit()
     {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->running = false;
+        }
+
+        this->readyCondition.notify_all();
+
+        if ((this->thread != NULL) && this->thread->joinable() && (this->thread->get_id() != std::this_thread::get_id())) {
+            this->thread->join();
+        }
     }
 }
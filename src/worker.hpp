@@ -1,8 +1,12 @@
 #pragma once
 
 #include <list>
+#include <vector>
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <sstream>
 
 #include "exceptions.hpp"
@@ -11,45 +15,82 @@
 
 namespace gfsfcgi
 {
+	/**
+	 * Request worker
+	 *
+	 * Runs the attached handlers round robin. Handlers that cannot make progress block()
+	 * and are skipped until they notify() the worker. The worker thread sleeps while no
+	 * handler is runnable.
+	 */
 	class Worker
 	{
 		protected:
+			typedef std::chrono::steady_clock Clock;
+
 			struct RequestList {
+				enum State {QUEUED, RUNNING, WAITING};
+
 				RequestHandler* handler = NULL;
 				RequestList* previous = NULL;
 				RequestList* next = NULL;
+
+				State state = QUEUED;
+				bool notified = false; ///< notify() while running
 			};
 
 			std::thread* thread;
-			std::mutex mutex;
+			mutable std::mutex mutex;
+			std::condition_variable readyCondition;
 			std::size_t size;
+			bool running;
 
 			RequestList* first;
 			RequestList* last;
+			std::list<RequestList*> runQueue; ///< Runnable handlers in order
 			DeallocatorGuard allocatorGuard;
 
+			// Utilization
+			std::atomic<uint64_t> busyTime; ///< Nanoseconds spent in handlers
+			uint64_t sampledBusyTime;
+			Clock::time_point sampledAt;
+
 			void doRun();
 
+			/**
+			 * Make a waiting handler runnable
+			 */
+			void wake(RequestList* item);
+
 		private:
 			void inline assertSameThreadContext() throw (ThreadContextViolatedException);
 
 			void freeList();
 			void remove(RequestList* item);
-			RequestList* next(RequestList* item);
 
 
 		public:
 			Worker();
 			virtual inline ~Worker()
 			{
+				this->exit();
 				this->freeList();
 			};
 
 			inline std::size_t getRequestCount() const {
-				std::lock_guard lock(this->mutex);
+				std::lock_guard<std::mutex> lock(this->mutex);
 				return this->size;
 			}
 
+			/**
+			 * Number of handlers that are not blocked
+			 */
+			std::size_t getRunnableCount() const;
+
+			/**
+			 * Share of time spent in handlers since the previous call (0..1)
+			 */
+			double sampleUtilization();
+
 			void attachHandler(RequestHandler* handler);
 
 			inline void f(RequestHandler* handler) {
@@ -70,6 +111,11 @@ namespace gfsfcgi
 
 			void run();
 			void exit();
+
+			/**
+			 * Utilization of each worker since the previous call (0..1)
+			 */
+			std::vector<double> getUtilization();
 	};
 
 }
@@ -0,0 +1,208 @@
+/**
+ * Management records (FCGI_GET_VALUES) and overload rejection
+ */
+
+#include <map>
+#include <mutex>
+
+#include "test.hpp"
+
+using namespace fastcgi;
+
+/**
+ * Holds the request open until it is released
+ */
+class HoldHandler : public RequestHandler
+{
+    public:
+        static std::mutex mutex;
+        static Resumer resumer; ///< Set while a request is held
+
+        inline HoldHandler(Request& request) : RequestHandler(request) {};
+
+        bool handle()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (!resumer) {
+                resumer = this->suspend();
+                return false;
+            }
+
+            resumer = nullptr;
+
+            this->getRequest().getStdOut() << "Content-Type: text/plain\r\n\r\nreleased";
+            this->finish(0);
+
+            return true;
+        }
+
+        /**
+         * Wait until a request is held (up to 5 seconds)
+         */
+        static bool waitForHeld()
+        {
+            for (int i = 0; i < 500; i++) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+
+                    if (resumer) {
+                        return true;
+                    }
+                }
+
+                usleep(10000);
+            }
+
+            return false;
+        }
+
+        static void release()
+        {
+            Resumer resume;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                resume = resumer;
+            }
+
+            resume();
+        }
+};
+
+std::mutex HoldHandler::mutex;
+Resumer HoldHandler::resumer;
+
+class HoldHandlerFactory : public HandlerFactory
+{
+    public:
+        inline RequestHandlerPtr factory(Request& request)
+        {
+            return std::make_shared<HoldHandler>(request);
+        }
+};
+
+/**
+ * Name-value pair without a value, as sent in FCGI_GET_VALUES
+ */
+static std::string nameOnly(const std::string& name)
+{
+    return std::string(1, (char)name.size()) + std::string(1, '\0') + name;
+}
+
+/**
+ * Ask for the management variables
+ *
+ * @return The answered variables
+ */
+static std::map<std::string, std::string> getValues(test::Client& client)
+{
+    std::map<std::string, std::string> values;
+    protocol::ParamsDecoder decoder;
+    protocol::Header header;
+    std::string content;
+
+    client.send(test::Client::record(FCGI_GET_VALUES, FCGI_NULL_REQUEST_ID,
+        nameOnly(FCGI_MAX_CONNS) + nameOnly(FCGI_MAX_REQS) + nameOnly(FCGI_MPXS_CONNS) + nameOnly("UNKNOWN")));
+
+    CHECK(client.readRecord(header, content));
+    CHECK(header.type == FCGI_GET_VALUES_RESULT);
+    CHECK(header.requestId == FCGI_NULL_REQUEST_ID);
+
+    decoder.append(content.data(), content.size());
+    decoder.finish();
+
+    for (size_t i = 0; i < decoder.size(); i++) {
+        values[decoder.name(i).str()] = decoder.value(i).str();
+    }
+
+    return values;
+}
+
+/**
+ * The answers follow the live admission limits
+ */
+static void testValues()
+{
+    test::Server server;
+
+    server.addHandlerFactory(std::make_shared<test::StaticHandlerFactory>("hello"));
+    server.getAdmissionController().setMaxConnections(17);
+    server.getAdmissionController().setMaxRequests(5);
+    server.start();
+
+    test::Client client(server.connect());
+    std::map<std::string, std::string> values = getValues(client);
+
+    // Unknown variables are omitted
+    CHECK(values.size() == 3);
+    CHECK(values[FCGI_MAX_CONNS] == "17");
+    CHECK(values[FCGI_MAX_REQS] == "5");
+    CHECK(values[FCGI_MPXS_CONNS] == "1");
+
+    server.getAdmissionController().setMaxConnections(64);
+    server.getAdmissionController().setMaxRequests(32);
+    values = getValues(client);
+
+    CHECK(values[FCGI_MAX_CONNS] == "64");
+    CHECK(values[FCGI_MAX_REQS] == "32");
+
+    // The connection still serves requests
+    std::string output;
+    unsigned char status;
+
+    client.sendRequest(1, true);
+    CHECK(client.readResponse(1, output, status));
+    CHECK(status == FCGI_REQUEST_COMPLETE);
+}
+
+/**
+ * Requests above FCGI_MAX_REQS are rejected with FCGI_OVERLOADED
+ */
+static void testOverloaded()
+{
+    test::Server server;
+    std::string output;
+    unsigned char status;
+
+    server.addHandlerFactory(std::make_shared<HoldHandlerFactory>());
+    server.getAdmissionController().setMaxRequests(1);
+    server.start();
+
+    test::Client client(server.connect());
+    test::Client other(server.connect());
+
+    client.sendRequest(1, true);
+    CHECK(HoldHandler::waitForHeld());
+
+    // On the same and on another connection
+    client.sendRequest(2, true);
+    CHECK(client.readResponse(2, output, status));
+    CHECK(status == FCGI_OVERLOADED);
+    CHECK(output.empty());
+
+    other.sendRequest(1, true);
+    CHECK(other.readResponse(1, output, status));
+    CHECK(status == FCGI_OVERLOADED);
+
+    HoldHandler::release();
+    CHECK(client.readResponse(1, output, status));
+    CHECK(status == FCGI_REQUEST_COMPLETE);
+    CHECK(output == "Content-Type: text/plain\r\n\r\nreleased");
+
+    // The ended request no longer counts
+    client.sendRequest(2, true);
+    CHECK(HoldHandler::waitForHeld());
+
+    HoldHandler::release();
+    CHECK(client.readResponse(2, output, status));
+    CHECK(status == FCGI_REQUEST_COMPLETE);
+}
+
+int main()
+{
+    testValues();
+    testOverloaded();
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+/**
+ * CPU lists and NUMA topology
+ */
+
+#include <stdexcept>
+
+#include "test.hpp"
+
+using namespace fastcgi;
+
+/**
+ * Check that a list is rejected
+ */
+static bool rejects(const std::string& list)
+{
+    try {
+        CpuSet::parse(list);
+    } catch (std::invalid_argument&) {
+        return true;
+    }
+
+    return false;
+}
+
+static void testParse()
+{
+    CpuSet set = CpuSet::parse("0-3,8");
+
+    CHECK(set.count() == 5);
+    CHECK(set.contains(0) && set.contains(3) && set.contains(8));
+    CHECK(!set.contains(4));
+
+    // Blanks around entries, as in sysfs files, and empty entries
+    set = CpuSet::parse(" 1 , 4-5\n");
+
+    CHECK(set.count() == 3);
+    CHECK(set.contains(1) && set.contains(4) && set.contains(5));
+
+    set = CpuSet::parse("2,,6");
+
+    CHECK(set.count() == 2);
+    CHECK(CpuSet::parse("").empty());
+    CHECK(CpuSet::parse("\n").empty());
+
+    // Reversed and open ranges
+    CHECK(rejects("3-1"));
+    CHECK(rejects("0-"));
+    CHECK(rejects("0-3,8-"));
+    CHECK(rejects("0- 3"));
+    CHECK(rejects("-1"));
+    CHECK(rejects("-"));
+
+    // Anything but digits
+    CHECK(rejects("+1"));
+    CHECK(rejects("1 2"));
+    CHECK(rejects("a"));
+    CHECK(rejects("1-2x"));
+    CHECK(rejects(std::to_string(CPU_SETSIZE)));
+}
+
+static void testTopology()
+{
+    const NumaTopology& topology = NumaTopology::get();
+    CpuSet available = CpuSet::getAvailable();
+
+    CHECK(topology.getNodeCount() > 0);
+
+    // Each CPU belongs to exactly one node
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!available.contains(cpu)) {
+            continue;
+        }
+
+        int node = topology.getNode(cpu);
+
+        CHECK(node >= 0);
+
+        for (size_t other = 0; other < topology.getNodeCount(); other++) {
+            CHECK(topology.getNodeCpus(other).contains(cpu) == ((int)other == node));
+        }
+    }
+}
+
+int main()
+{
+    testParse();
+    testTopology();
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+/**
+ * Microbenchmark helpers
+ *
+ * Benchmarks take the iteration count as first argument, so the test suite can run
+ * them as a quick smoke test.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+namespace bench
+{
+    typedef std::chrono::steady_clock Clock;
+
+    /**
+     * Keep the compiler from optimizing away a computed value
+     */
+    template<class T> inline void use(const T& value)
+    {
+        asm volatile("" : : "g"(&value) : "memory");
+    }
+
+    /**
+     * Iteration count from the command line or the default
+     */
+    inline size_t getIterations(int argc, char** argv, size_t defaultCount)
+    {
+        return (argc > 1)? std::strtoul(argv[1], NULL, 10) : defaultCount;
+    }
+
+    /**
+     * Print one result line
+     *
+     * @param[in]  name        Benchmark name
+     * @param[in]  operations  Number of operations measured
+     * @param[in]  elapsed     Measured time
+     */
+    inline void report(const std::string& name, size_t operations, Clock::duration elapsed)
+    {
+        double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+
+        std::cout << std::left << std::setw(40) << name << std::right << std::setw(12) << std::fixed << std::setprecision(2)
+                << ((operations > 0)? ns / operations : 0.0) << " ns/op" << std::setw(14) << operations << " ops" << std::endl;
+    }
+
+    /**
+     * Run a function the given number of times and report the time per operation
+     *
+     * @param[in]  batch  Operations per call
+     */
+    template<class Function> inline void run(const std::string& name, size_t iterations, Function function, size_t batch = 1)
+    {
+        Clock::time_point start = Clock::now();
+
+        for (size_t i = 0; i < iterations; i++) {
+            function(i);
+        }
+
+        report(name, iterations * batch, Clock::now() - start);
+    }
+}
@@ -0,0 +1,113 @@
+/**
+ * Socket I/O backend benchmarks: request round trips over a unix socket
+ *
+ * Each backend answers the same requests, small responses measure the per request
+ * overhead, large ones the throughput of the output path.
+ */
+
+#include <memory>
+#include <vector>
+
+#include "bench.hpp"
+#include "test.hpp"
+
+using namespace fastcgi;
+
+static const size_t CONNECTION_COUNT = 8;
+static const size_t LARGE_BODY_SIZE = 1024 * 1024;
+
+/**
+ * Sequential requests on one persistent connection
+ */
+static void runSequential(const std::string& name, test::Server& server, size_t iterations)
+{
+    test::Client client(server.connect());
+    std::string output;
+    unsigned char status;
+
+    bench::run(name, iterations, [&](size_t) {
+        client.sendRequest(1, true);
+        CHECK(client.readResponse(1, output, status));
+    });
+}
+
+/**
+ * Requests on several connections at once, one client thread each
+ */
+static void runParallel(const std::string& name, test::Server& server, size_t iterations)
+{
+    std::vector<std::unique_ptr<test::Client>> clients;
+    std::vector<std::thread> threads;
+
+    for (size_t i = 0; i < CONNECTION_COUNT; i++) {
+        clients.emplace_back(new test::Client(server.connect()));
+    }
+
+    size_t perConnection = (iterations + CONNECTION_COUNT - 1) / CONNECTION_COUNT;
+    bench::Clock::time_point start = bench::Clock::now();
+
+    for (auto& client : clients) {
+        threads.emplace_back([&client, perConnection]() {
+            std::string output;
+            unsigned char status;
+
+            for (size_t i = 0; i < perConnection; i++) {
+                client->sendRequest(1, true);
+                CHECK(client->readResponse(1, output, status));
+            }
+        });
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    bench::report(name, perConnection * CONNECTION_COUNT, bench::Clock::now() - start);
+}
+
+static void run(const std::string& backendName, Backend backend, size_t iterations)
+{
+    {
+        test::Server server;
+
+        server.setBackend(backend);
+        server.addHandlerFactory(std::make_shared<test::StaticHandlerFactory>("hello"));
+        server.start();
+
+        runSequential("round trip (" + backendName + ")", server, iterations);
+    }
+
+    {
+        test::Server server;
+
+        server.setBackend(backend);
+        server.setReactorCount(2);
+        server.addHandlerFactory(std::make_shared<test::StaticHandlerFactory>("hello"));
+        server.start();
+
+        runParallel("round trip, 8 connections (" + backendName + ")", server, iterations);
+    }
+
+    {
+        test::Server server;
+
+        server.setBackend(backend);
+        server.addHandlerFactory(std::make_shared<test::StaticHandlerFactory>(std::string(LARGE_BODY_SIZE, 'x')));
+        server.start();
+
+        runSequential("1 MiB response (" + backendName + ")", server, (iterations / 100) + 1);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    size_t iterations = bench::getIterations(argc, argv, 20000);
+
+    run("libevent", Backend::LIBEVENT, iterations);
+
+    #ifdef GFSFCGI_WITH_IO_URING
+        run("io_uring", Backend::IO_URING, iterations);
+    #endif
+
+    return 0;
+}
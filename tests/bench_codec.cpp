@@ -0,0 +1,121 @@
+/**
+ * Record codec microbenchmarks
+ *
+ * The byte loop is the conversion the codec replaced, kept here as the baseline.
+ */
+
+#include <cstring>
+#include <vector>
+
+#include "bench.hpp"
+#include "fastcgi.hpp"
+
+using namespace fastcgi;
+
+/**
+ * Former conversion: reverse the bytes one at a time
+ */
+template<class T> static T swapByteLoop(T value)
+{
+    T result;
+    char* from = (char*)&value - 1;
+    char* end = from + sizeof(T);
+    char* to = (char*)&result + sizeof(T);
+
+    while (from != end) {
+        *--to = *++from;
+    }
+
+    return result;
+}
+
+static protocol::Header decodeByteLoop(const protocol::Header& header)
+{
+    protocol::Header result = header;
+
+    result.requestId = swapByteLoop(header.requestId);
+    result.contentLength = swapByteLoop(header.contentLength);
+
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    size_t iterations = bench::getIterations(argc, argv, 100000000);
+
+    // Distinct records, so the conversion is not hoisted out of the loop
+    std::vector<protocol::Header> headers(1024);
+
+    for (size_t i = 0; i < headers.size(); i++) {
+        protocol::Header header = { FCGI_VERSION_1, FCGI_STDOUT, (uint16_t)i, (uint16_t)(i * 31), 0, 0 };
+        headers[i] = protocol::encode(header);
+    }
+
+    bench::run("header decode (byte loop)", iterations, [&](size_t i) {
+        bench::use(decodeByteLoop(headers[i & 1023]));
+    });
+
+    bench::run("header decode (codec)", iterations, [&](size_t i) {
+        bench::use(protocol::decode(headers[i & 1023]));
+    });
+
+    bench::run("header encode (codec)", iterations, [&](size_t i) {
+        bench::use(protocol::encode(headers[i & 1023]));
+    });
+
+    protocol::EndRequestRecord end = { { FCGI_VERSION_1, FCGI_END_REQUEST, 1, 8, 0, 0 }, { 0, FCGI_REQUEST_COMPLETE, { 0, 0, 0 } } };
+
+    bench::run("end request encode (codec)", iterations, [&](size_t i) {
+        end.body.appStatus = (uint32_t)i;
+        bench::use(protocol::encode(end));
+    });
+
+    // Name/value lengths, half of them long
+    std::vector<unsigned char> lengths;
+
+    for (uint32_t i = 0; i < 1024; i++) {
+        unsigned char data[4];
+        size_t size = protocol::encodeLength((i & 1)? i * 1000 : i & 0x7f, data);
+
+        lengths.insert(lengths.end(), data, data + size);
+    }
+
+    bench::run("name/value length decode", iterations / 1024, [&](size_t) {
+        const unsigned char* data = lengths.data();
+        uint32_t sum = 0;
+
+        for (size_t n = 0; n < 1024; n++) {
+            sum += protocol::decodeLength(data);
+            data += protocol::encodedLengthSize((char)data[0]);
+        }
+
+        bench::use(sum);
+    }, 1024);
+
+    // A typical parameter block of a web server
+    const char* params[][2] = {
+        { "SCRIPT_NAME", "/files/image.png" }, { "REQUEST_METHOD", "GET" }, { "QUERY_STRING", "" },
+        { "REQUEST_URI", "/files/image.png" }, { "SERVER_PROTOCOL", "HTTP/1.1" }, { "REMOTE_ADDR", "127.0.0.1" },
+        { "HTTP_HOST", "localhost" }, { "HTTP_ACCEPT", "*/*" }, { "HTTP_USER_AGENT", "Mozilla/5.0 (X11; Linux x86_64)" },
+        { "HTTP_IF_NONE_MATCH", "\"5f2b1c\"" }, { "HTTP_RANGE", "bytes=0-1023" }, { "HTTP_ACCEPT_ENCODING", "gzip" }
+    };
+    std::string block;
+
+    for (auto& param : params) {
+        protocol::Variable variable(param[0], param[1]);
+        std::string data(variable.getSize(), '\0');
+
+        variable.putData(&data[0]);
+        block += data;
+    }
+
+    bench::run("params block decode (12 pairs)", iterations / 100, [&](size_t) {
+        protocol::ParamsDecoder decoder;
+
+        decoder.append(block.data(), block.size());
+        decoder.finish();
+        bench::use(decoder.size());
+    });
+
+    return 0;
+}
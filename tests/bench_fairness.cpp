@@ -0,0 +1,115 @@
+/**
+ * Latency of small responses while bulk downloads run
+ *
+ * Bulk callbacks send a lot per step and never finish during the measurement.
+ * Small callbacks are pushed one at a time; their time from push to completion
+ * is measured. Without service classes (bulk callbacks scheduled as INTERACTIVE)
+ * the worker queue serves everything by FIFO, which is the baseline.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "bench.hpp"
+#include "test.hpp"
+
+using namespace fastcgi;
+
+static const size_t THREAD_COUNT = 4;
+static const size_t BULK_COUNT = 64;
+static const size_t BULK_STEP_COST = 1024 * 1024; ///< Bytes a bulk step sends
+static const unsigned BULK_STEP_TIME = 50; ///< Microseconds a bulk step takes
+
+/**
+ * Busy loop for the given time, like a handler copying data
+ */
+static void work(unsigned usec)
+{
+    bench::Clock::time_point end = bench::Clock::now() + std::chrono::microseconds(usec);
+
+    while (bench::Clock::now() < end) {
+    }
+}
+
+static void report(const std::string& name, std::vector<bench::Clock::duration>& samples)
+{
+    std::sort(samples.begin(), samples.end());
+
+    auto percentile = [&](double p) {
+        return std::chrono::duration<double, std::micro>(samples[(size_t)(p * (samples.size() - 1))]).count();
+    };
+
+    std::cout << std::left << std::setw(40) << name << std::right << std::fixed << std::setprecision(1)
+            << "p50 " << std::setw(10) << percentile(0.5) << " us   p99 " << std::setw(10) << percentile(0.99) << " us" << std::endl;
+}
+
+/**
+ * @param[in]  bulkCount  Bulk callbacks running alongside
+ * @param[in]  bulkClass  Service class of the bulk callbacks
+ */
+static void run(const std::string& name, size_t samples, size_t bulkCount, ServiceClass bulkClass)
+{
+    WorkerQueue queue;
+    std::atomic<bool> stop(false);
+    std::vector<WorkerCallbackPtr> bulk;
+
+    queue.run(THREAD_COUNT);
+
+    for (size_t i = 0; i < bulkCount; i++) {
+        WorkerCallbackPtr task = WorkerTask::create();
+        WorkerTask* self = task.get();
+
+        task->serviceClass = bulkClass;
+        task->callback = [&stop, self]() {
+            work(BULK_STEP_TIME);
+            self->cost = BULK_STEP_COST;
+
+            return stop.load();
+        };
+
+        bulk.push_back(task);
+        queue.push(task);
+    }
+
+    std::vector<bench::Clock::duration> latencies;
+
+    for (size_t i = 0; i < samples; i++) {
+        std::atomic<bool> done(false);
+        bench::Clock::time_point finished;
+        WorkerCallbackPtr task = WorkerTask::create();
+        WorkerTask* self = task.get();
+
+        task->callback = [&done, &finished, self]() {
+            work(5);
+            self->cost = 4096;
+            finished = bench::Clock::now();
+            done = true;
+
+            return true;
+        };
+
+        bench::Clock::time_point start = bench::Clock::now();
+        queue.push(task);
+
+        while (!done) {
+            std::this_thread::yield();
+        }
+
+        latencies.push_back(finished - start);
+    }
+
+    stop = true;
+    report(name, latencies);
+}
+
+int main(int argc, char** argv)
+{
+    size_t samples = bench::getIterations(argc, argv, 2000);
+
+    run("small, idle", samples, 0, ServiceClass::INTERACTIVE);
+    run("small, 64 downloads (FIFO)", samples, BULK_COUNT, ServiceClass::INTERACTIVE);
+    run("small, 64 downloads (service classes)", samples, BULK_COUNT, ServiceClass::BULK);
+
+    return 0;
+}
@@ -0,0 +1,163 @@
+/**
+ * Worker scheduler benchmark
+ *
+ * The locked queue is the std::queue/mutex/condition variable queue the work stealing
+ * scheduler replaced, kept here as the baseline. Each task runs a few steps and is
+ * pushed again after each unfinished one, like a handler sending a response in parts.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <queue>
+#include <vector>
+
+#include "bench.hpp"
+#include "test.hpp"
+
+using namespace fastcgi;
+
+static const size_t STEPS = 4; ///< Runs per task
+static const size_t WORK = 200; ///< Loop iterations per run
+static const unsigned THREAD_COUNTS[] = { 1, 2, 4, 8, 16, 32, 64 };
+
+/**
+ * Former worker queue: one locked FIFO
+ */
+class LockedQueue
+{
+    protected:
+        std::queue<WorkerCallbackPtr> queue;
+        std::mutex protector;
+        std::condition_variable readyCondition;
+        std::vector<std::thread> threads;
+        bool terminated;
+
+    public:
+        LockedQueue() : terminated(false) {};
+
+        ~LockedQueue()
+        {
+            {
+                std::lock_guard<std::mutex> lock(this->protector);
+                this->terminated = true;
+            }
+
+            this->readyCondition.notify_all();
+
+            for (auto& thread : this->threads) {
+                thread.join();
+            }
+        }
+
+        void push(WorkerCallbackPtr& ptr)
+        {
+            std::unique_lock<std::mutex> lock(this->protector);
+
+            this->queue.push(ptr);
+            lock.unlock();
+
+            this->readyCondition.notify_one();
+        }
+
+        WorkerCallbackPtr pop()
+        {
+            std::unique_lock<std::mutex> lock(this->protector);
+
+            while (this->queue.empty() && !this->terminated) {
+                this->readyCondition.wait(lock);
+            }
+
+            if (this->queue.empty() || this->terminated) {
+                return WorkerCallbackPtr(NULL);
+            }
+
+            WorkerCallbackPtr ptr = this->queue.front();
+
+            this->queue.pop();
+            return ptr;
+        }
+
+        void run(unsigned threadCount)
+        {
+            for (unsigned i = 0; i < threadCount; i++) {
+                this->threads.emplace_back([this]() {
+                    WorkerCallbackPtr handler;
+
+                    while ((handler = this->pop()) != NULL) {
+                        if (!(*handler)()) {
+                            this->push(handler);
+                        }
+                    }
+                });
+            }
+        }
+};
+
+/**
+ * Push the tasks from outside and wait until all of them completed
+ */
+template<class Queue> static void runTasks(const std::string& name, Queue& queue, size_t tasks)
+{
+    std::atomic<size_t> completed(0);
+    std::vector<WorkerCallbackPtr> callbacks;
+
+    for (size_t i = 0; i < tasks; i++) {
+        WorkerCallbackPtr task = WorkerTask::create();
+        size_t steps = STEPS;
+
+        task->callback = [&completed, steps]() mutable {
+            size_t sum = 0;
+
+            for (size_t n = 0; n < WORK; n++) {
+                sum += n;
+                bench::use(sum);
+            }
+
+            if (--steps > 0) {
+                return false;
+            }
+
+            completed++;
+            return true;
+        };
+
+        callbacks.push_back(task);
+    }
+
+    bench::Clock::time_point start = bench::Clock::now();
+
+    for (auto& task : callbacks) {
+        queue.push(task);
+    }
+
+    while (completed < tasks) {
+        std::this_thread::yield();
+    }
+
+    bench::report(name, tasks * STEPS, bench::Clock::now() - start);
+}
+
+int main(int argc, char** argv)
+{
+    size_t tasks = bench::getIterations(argc, argv, 200000);
+
+    for (unsigned threads : THREAD_COUNTS) {
+        std::string suffix = ", " + std::to_string(threads) + " threads";
+
+        {
+            LockedQueue queue;
+
+            queue.run(threads);
+            runTasks("locked queue" + suffix, queue, tasks);
+        }
+
+        {
+            WorkerQueue queue;
+
+            queue.run(threads);
+            runTasks("work stealing" + suffix, queue, tasks);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,141 @@
+/**
+ * Record codec: byte order of the fixed segments and name/value lengths
+ */
+
+#include <cstring>
+
+#include "test.hpp"
+
+using namespace fastcgi;
+
+static void testHeader()
+{
+    protocol::Header header = { FCGI_VERSION_1, FCGI_STDOUT, 0x0102, 0xfff8, 8, 0 };
+    protocol::Header wire = protocol::encode(header);
+    const unsigned char expected[] = { FCGI_VERSION_1, FCGI_STDOUT, 0x01, 0x02, 0xff, 0xf8, 8, 0 };
+
+    CHECK(memcmp(&wire, expected, sizeof(expected)) == 0);
+
+    protocol::Header decoded = protocol::decode(wire);
+
+    CHECK(decoded.version == FCGI_VERSION_1);
+    CHECK(decoded.type == FCGI_STDOUT);
+    CHECK(decoded.requestId == 0x0102);
+    CHECK(decoded.contentLength == 0xfff8);
+    CHECK(decoded.paddingLength == 8);
+
+    // The high bit is data, not a marker
+    header.requestId = 0x8001;
+    header.contentLength = protocol::MAX_INT16_SIZE;
+    decoded = protocol::decode(protocol::encode(header));
+
+    CHECK(decoded.requestId == 0x8001);
+    CHECK(decoded.contentLength == protocol::MAX_INT16_SIZE);
+}
+
+static void testBodies()
+{
+    const unsigned char begin[] = { 0x00, FCGI_RESPONDER, FCGI_KEEP_CONN, 1, 2, 3, 4, 5 };
+    protocol::BeginRequestBody beginBody;
+
+    memcpy(&beginBody, begin, sizeof(begin));
+    beginBody = protocol::decode(beginBody);
+
+    CHECK(beginBody.role == FCGI_RESPONDER);
+    CHECK(beginBody.flags == FCGI_KEEP_CONN);
+
+    protocol::EndRequestBody endBody = { 0x01020304, FCGI_OVERLOADED, { 0, 0, 0 } };
+    protocol::EndRequestBody endWire = protocol::encode(endBody);
+    const unsigned char end[] = { 0x01, 0x02, 0x03, 0x04, FCGI_OVERLOADED, 0, 0, 0 };
+
+    CHECK(memcmp(&endWire, end, sizeof(end)) == 0);
+    CHECK(protocol::decode(endWire).appStatus == 0x01020304);
+
+    protocol::EndRequestRecord record = { { FCGI_VERSION_1, FCGI_END_REQUEST, 7, 8, 0, 0 }, endBody };
+    protocol::EndRequestRecord recordWire = protocol::encode(record);
+
+    CHECK(memcmp(&recordWire.body, end, sizeof(end)) == 0);
+    CHECK(protocol::decode(recordWire).header.requestId == 7);
+    CHECK(protocol::decode(recordWire).body.appStatus == 0x01020304);
+}
+
+static void testLengths()
+{
+    const uint32_t lengths[] = { 0, 1, 0x7f, 0x80, 0xff, 0x1234, 0x123456, protocol::MAX_INT32_SIZE };
+
+    for (uint32_t length : lengths) {
+        unsigned char data[4] = { 0 };
+        size_t size = protocol::encodeLength(length, data);
+
+        CHECK(size == protocol::lengthSize(length));
+        CHECK(size == protocol::encodedLengthSize((char)data[0]));
+        CHECK(protocol::decodeLength(data) == length);
+    }
+
+    const unsigned char wire[] = { 0x80, 0x00, 0x01, 0x00 };
+    CHECK(protocol::decodeLength(wire) == 0x100);
+}
+
+/**
+ * Pairs with both length encodings, fed to the decoder in every possible split
+ */
+static void testParams()
+{
+    protocol::Variable variables[] = {
+        protocol::Variable("SCRIPT_NAME", "/file.png"),
+        protocol::Variable("EMPTY", ""),
+        protocol::Variable("HTTP_COOKIE", std::string(300, 'c')),
+        protocol::Variable(std::string(200, 'n'), "long name")
+    };
+    std::string encoded;
+
+    for (auto& variable : variables) {
+        std::string data(variable.getSize(), '\0');
+
+        variable.putData(&data[0]);
+        encoded += data;
+    }
+
+    for (size_t split = 0; split <= encoded.size(); split++) {
+        protocol::ParamsDecoder decoder;
+        protocol::StringRef value;
+
+        decoder.append(encoded.data(), split);
+        decoder.append(encoded.data() + split, encoded.size() - split);
+        decoder.finish();
+
+        CHECK(decoder.size() == 4);
+
+        for (size_t i = 0; i < 4; i++) {
+            CHECK(std::string(decoder.name(i).data, decoder.name(i).size) == variables[i].name());
+            CHECK(std::string(decoder.value(i).data, decoder.value(i).size) == variables[i].value());
+        }
+
+        CHECK(decoder.find(KnownParam::SCRIPT_NAME, value));
+        CHECK(std::string(value.data, value.size) == "/file.png");
+    }
+
+    // A truncated pair is a protocol violation
+    protocol::ParamsDecoder decoder;
+    bool thrown = false;
+
+    decoder.append(encoded.data(), 5);
+
+    try {
+        decoder.finish();
+    } catch (const IOException&) {
+        thrown = true;
+    }
+
+    CHECK(thrown);
+}
+
+int main()
+{
+    testHeader();
+    testBodies();
+    testLengths();
+    testParams();
+
+    return 0;
+}
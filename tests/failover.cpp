@@ -0,0 +1,144 @@
+/**
+ * Replica set failover against a local replica set (see replicaset.sh)
+ *
+ * GFSFCGI_TEST_SEEDS lists the members (host:port,...), GFSFCGI_TEST_SET names the
+ * set. The test is skipped if they are not set. It shuts a secondary down.
+ */
+
+#include <sstream>
+#include <vector>
+
+#include "test.hpp"
+#include "replicaset.hpp"
+
+using namespace gfsfcgi;
+
+static const char* DATABASE = "gfsfcgi_test";
+
+static std::string getHost(const ConnectionPool::Lease& lease)
+{
+    return (lease.getPool() != NULL)? lease.getPool()->getHost() : std::string();
+}
+
+/**
+ * Look up the test file like RequestHandler::findFile()
+ *
+ * @param[out]  host  The member that answered
+ */
+static mongo::BSONObj findTestFile(ReplicaSet& replicaSet, ConnectionPool::Lease connection, std::string& host)
+{
+    std::string ns = std::string(DATABASE) + ".fs.files";
+
+    for (int attempt = 0; ; attempt++) {
+        if (!connection.valid()) {
+            connection = replicaSet.acquire();
+        }
+
+        try {
+            mongo::BSONObj file = connection.getClient().findOne(ns, mongo::Query(BSON("filename" << "failover")), NULL, connection.getQueryOptions());
+
+            host = getHost(connection);
+            return file.getOwned();
+        } catch (mongo::DBException& e) {
+            replicaSet.invalidate(connection);
+
+            if (attempt > 0) {
+                throw IOException("Failed to query the file metadata");
+            }
+        }
+    }
+}
+
+static bool isUp(ReplicaSet& replicaSet, const std::string& host)
+{
+    for (auto& member : replicaSet.getMembers()) {
+        if (member.host == host) {
+            return member.up;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * An invalidated member is skipped by the next acquire()
+ */
+static void testInvalidate(ReplicaSet& replicaSet)
+{
+    ConnectionPool::Lease lease = replicaSet.acquire();
+    std::string host = getHost(lease);
+
+    CHECK(isUp(replicaSet, host));
+
+    replicaSet.invalidate(lease);
+
+    CHECK(!lease.valid());
+    CHECK(!isUp(replicaSet, host));
+
+    for (int i = 0; i < 10; i++) {
+        CHECK(getHost(replicaSet.acquire()) != host);
+    }
+}
+
+/**
+ * A query on a member that went away is answered by another one
+ */
+static void testRetry(ReplicaSet& replicaSet)
+{
+    ConnectionPool::Lease lease = replicaSet.acquire();
+    std::string failed = getHost(lease);
+    std::string host;
+
+    // The lease keeps its socket to the member that is shut down
+    CHECK(!findTestFile(replicaSet, replicaSet.acquire(), host).isEmpty());
+
+    {
+        mongo::DBClientConnection admin;
+        mongo::BSONObj info;
+        std::string error;
+
+        CHECK(admin.connect(failed, error));
+
+        try {
+            admin.runCommand("admin", BSON("shutdown" << 1 << "force" << true), info);
+        } catch (mongo::DBException& e) {
+            // The member closes the connection
+        }
+    }
+
+    mongo::BSONObj file = findTestFile(replicaSet, std::move(lease), host);
+
+    CHECK(!file.isEmpty());
+    CHECK(host != failed);
+    CHECK(!isUp(replicaSet, failed));
+}
+
+int main()
+{
+    const char* seeds = std::getenv("GFSFCGI_TEST_SEEDS");
+    const char* name = std::getenv("GFSFCGI_TEST_SET");
+
+    if ((seeds == NULL) || (name == NULL)) {
+        std::cout << "GFSFCGI_TEST_SEEDS and GFSFCGI_TEST_SET are not set, skipped" << std::endl;
+        return 0;
+    }
+
+    std::vector<std::string> hosts;
+    std::stringstream list(seeds);
+    std::string host;
+
+    while (std::getline(list, host, ',')) {
+        hosts.push_back(host);
+    }
+
+    // Shut secondaries down only, the set stays writable
+    ReplicaSet replicaSet(hosts, name, DATABASE, 4);
+
+    replicaSet.setReadPreference(ReadPreference::SECONDARY);
+    replicaSet.discover();
+
+    testInvalidate(replicaSet);
+    testRetry(replicaSet);
+
+    return 0;
+}
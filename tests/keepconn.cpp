@@ -0,0 +1,161 @@
+/**
+ * Persistent connections (FCGI_KEEP_CONN) and connection teardown
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include "test.hpp"
+
+using namespace fastcgi;
+
+static const size_t REQUEST_COUNT = 5000;
+static const size_t CONNECTION_COUNT = 200;
+
+/**
+ * Wait until the number of open files dropped to the given count
+ */
+static bool waitForOpenFiles(size_t count)
+{
+    for (int i = 0; i < 200; i++) {
+        if (test::countOpenFiles() <= count) {
+            return true;
+        }
+
+        usleep(10000);
+    }
+
+    return false;
+}
+
+static void run(size_t reactorCount, Backend backend)
+{
+    size_t openFiles = test::countOpenFiles();
+    std::string output;
+    unsigned char status;
+
+    {
+        test::Server server;
+
+        server.setBackend(backend);
+        server.setReactorCount(reactorCount);
+        server.addHandlerFactory(std::make_shared<test::StaticHandlerFactory>("hello"));
+        server.start();
+
+        size_t serverFiles;
+
+        // One connection per loop, backends may set up per loop state on first use
+        {
+            std::vector<std::unique_ptr<test::Client>> clients;
+
+            for (size_t i = 0; i < std::max<size_t>(reactorCount, 1); i++) {
+                clients.emplace_back(new test::Client(server.connect()));
+                clients.back()->sendRequest(1, true);
+                CHECK(clients.back()->readResponse(1, output, status));
+            }
+
+            // Only these connections' sockets are added
+            serverFiles = test::countOpenFiles() - (2 * clients.size());
+        }
+
+        CHECK(waitForOpenFiles(serverFiles));
+
+        // Back to back requests on one connection
+        {
+            test::Client client(server.connect());
+
+            for (size_t i = 0; i < REQUEST_COUNT; i++) {
+                client.sendRequest(1, true);
+
+                CHECK(client.readResponse(1, output, status));
+                CHECK(status == FCGI_REQUEST_COMPLETE);
+                CHECK(output == "Content-Type: text/plain\r\n\r\nhello");
+            }
+        }
+
+        // Closed by the web server
+        CHECK(waitForOpenFiles(serverFiles));
+
+        // Without FCGI_KEEP_CONN the connection is closed after the response
+        {
+            test::Client client(server.connect());
+
+            client.sendRequest(1, false);
+
+            CHECK(client.readResponse(1, output, status));
+            CHECK(client.isClosed());
+        }
+
+        // Connections closed by the web server are released
+        for (size_t i = 0; i < CONNECTION_COUNT; i++) {
+            test::Client client(server.connect());
+
+            client.sendRequest(1, true);
+            CHECK(client.readResponse(1, output, status));
+        }
+
+        CHECK(waitForOpenFiles(serverFiles));
+
+        // Only open connections count against FCGI_MAX_CONNS, closed ones still wait for the gc
+        server.getAdmissionController().setMaxConnections(2);
+
+        {
+            std::unique_ptr<test::Client> first(new test::Client(server.connect()));
+            test::Client second(server.connect());
+
+            first->sendRequest(1, true);
+            CHECK(first->readResponse(1, output, status));
+            second.sendRequest(1, true);
+            CHECK(second.readResponse(1, output, status));
+
+            test::Client rejected(server.connect());
+            CHECK(rejected.isClosed());
+
+            first.reset();
+            CHECK(waitForOpenFiles(serverFiles + 3));
+
+            test::Client third(server.connect());
+
+            third.sendRequest(1, true);
+            CHECK(third.readResponse(1, output, status));
+            CHECK(status == FCGI_REQUEST_COMPLETE);
+        }
+
+        server.getAdmissionController().setMaxConnections(1024);
+        CHECK(waitForOpenFiles(serverFiles));
+
+        // A protocol violation closes the connection, not the server
+        {
+            test::Client client(server.connect());
+            test::Client broken(server.connect());
+            test::Client early(server.connect());
+
+            broken.send(test::Client::record(FCGI_BEGIN_REQUEST, 1, "short"));
+            CHECK(broken.isClosed());
+
+            // STDIN before the PARAMS stream ended
+            early.send(test::Client::record(FCGI_BEGIN_REQUEST, 1, std::string("\x00\x01\x01\x00\x00\x00\x00\x00", 8)));
+            early.send(test::Client::record(FCGI_STDIN, 1, "data"));
+            CHECK(early.isClosed());
+
+            client.sendRequest(1, true);
+            CHECK(client.readResponse(1, output, status));
+            CHECK(status == FCGI_REQUEST_COMPLETE);
+        }
+    }
+
+    CHECK(waitForOpenFiles(openFiles));
+}
+
+int main()
+{
+    run(0, Backend::LIBEVENT);
+    run(2, Backend::LIBEVENT);
+
+    #ifdef GFSFCGI_WITH_IO_URING
+        run(0, Backend::IO_URING);
+        run(2, Backend::IO_URING);
+    #endif
+
+    return 0;
+}
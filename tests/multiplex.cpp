@@ -0,0 +1,193 @@
+/**
+ * Multiplexed requests on one connection
+ */
+
+#include <map>
+#include <mutex>
+
+#include "test.hpp"
+
+using namespace fastcgi;
+
+static const uint16_t REQUEST_COUNT = 8;
+static const uint16_t ABORTED_ID = 3;
+
+/**
+ * Answers with the request id and the STDIN content once STDIN is complete
+ */
+class EchoHandler : public RequestHandler
+{
+    protected:
+        std::mutex mutex;
+        std::string input;
+        bool complete;
+
+    public:
+        inline EchoHandler(Request& request) : RequestHandler(request), complete(false) {};
+
+        void onReceiveData(const protocol::Record& record)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+
+            if (record.header.type != FCGI_STDIN) {
+                return;
+            }
+
+            this->input.append(record.content, record.header.contentLength);
+            this->complete = (record.header.contentLength == 0);
+        }
+
+        bool handle()
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+
+            if (!this->complete) {
+                lock.unlock();
+
+                this->waitForInput();
+                return false;
+            }
+
+            this->getRequest().getStdOut() << "Content-Type: text/plain\r\n\r\nid=" << this->getRequest().getId() << " " << this->input;
+            this->finish(0);
+
+            return true;
+        }
+};
+
+class EchoHandlerFactory : public HandlerFactory
+{
+    public:
+        inline RequestHandlerPtr factory(Request& request)
+        {
+            return std::make_shared<EchoHandler>(request);
+        }
+};
+
+struct Response {
+    std::string output;
+    uint32_t appStatus = 0;
+    unsigned char protocolStatus = 0;
+    bool ended = false;
+};
+
+/**
+ * Read interleaved responses until each of the requests ended
+ */
+static std::map<uint16_t, Response> readResponses(test::Client& client, size_t count)
+{
+    std::map<uint16_t, Response> responses;
+    protocol::Header header;
+    std::string content;
+    size_t ended = 0;
+
+    while ((ended < count) && client.readRecord(header, content)) {
+        Response& response = responses[header.requestId];
+
+        CHECK(!response.ended);
+
+        if (header.type == FCGI_STDOUT) {
+            response.output += content;
+        } else if (header.type == FCGI_END_REQUEST) {
+            protocol::EndRequestBody body;
+
+            CHECK(content.size() == sizeof(body));
+            memcpy(&body, content.data(), sizeof(body));
+            body = protocol::decode(body);
+
+            response.appStatus = body.appStatus;
+            response.protocolStatus = body.protocolStatus;
+            response.ended = true;
+            ended++;
+        }
+    }
+
+    CHECK(ended == count);
+    return responses;
+}
+
+static void run(size_t reactorCount, Backend backend)
+{
+    test::Server server;
+    test::Client client(server.connect());
+    std::string params("\x0b\x02" "SCRIPT_NAME" "/x", 15);
+    std::string records;
+
+    server.setBackend(backend);
+    server.setReactorCount(reactorCount);
+    server.addHandlerFactory(std::make_shared<EchoHandlerFactory>());
+    server.start();
+
+    // Each stream of each request is sent interleaved with the others
+    for (uint16_t id = 1; id <= REQUEST_COUNT; id++) {
+        records += test::Client::beginRecord(id, true);
+    }
+
+    for (uint16_t id = 1; id <= REQUEST_COUNT; id++) {
+        records += test::Client::record(FCGI_PARAMS, id, params);
+    }
+
+    for (uint16_t id = REQUEST_COUNT; id >= 1; id--) {
+        records += test::Client::record(FCGI_PARAMS, id, "");
+        records += test::Client::record(FCGI_STDIN, id, "stdin-" + std::to_string(id));
+    }
+
+    client.send(records);
+
+    // Let the handlers wait for the rest of STDIN before one request is aborted
+    usleep(100000);
+    client.send(test::Client::record(FCGI_ABORT_REQUEST, ABORTED_ID, ""));
+
+    records.clear();
+
+    for (uint16_t id = 1; id <= REQUEST_COUNT; id++) {
+        if (id != ABORTED_ID) {
+            records += test::Client::record(FCGI_STDIN, id, "");
+        }
+    }
+
+    client.send(records);
+
+    std::map<uint16_t, Response> responses = readResponses(client, REQUEST_COUNT);
+
+    for (uint16_t id = 1; id <= REQUEST_COUNT; id++) {
+        Response& response = responses[id];
+
+        CHECK(response.ended);
+        CHECK(response.protocolStatus == FCGI_REQUEST_COMPLETE);
+
+        if (id == ABORTED_ID) {
+            CHECK(response.appStatus == 1);
+            CHECK(response.output.empty());
+        } else {
+            CHECK(response.appStatus == 0);
+            CHECK(response.output == "Content-Type: text/plain\r\n\r\nid=" + std::to_string(id) + " stdin-" + std::to_string(id));
+        }
+    }
+
+    // The ids are free again
+    for (uint16_t id = 1; id <= REQUEST_COUNT; id++) {
+        client.send(test::Client::beginRecord(id, true) + test::Client::record(FCGI_PARAMS, id, params) +
+            test::Client::record(FCGI_PARAMS, id, "") + test::Client::record(FCGI_STDIN, id, ""));
+    }
+
+    responses = readResponses(client, REQUEST_COUNT);
+
+    for (uint16_t id = 1; id <= REQUEST_COUNT; id++) {
+        CHECK(responses[id].appStatus == 0);
+        CHECK(responses[id].output == "Content-Type: text/plain\r\n\r\nid=" + std::to_string(id) + " ");
+    }
+}
+
+int main()
+{
+    run(0, Backend::LIBEVENT);
+    run(2, Backend::LIBEVENT);
+
+    #ifdef GFSFCGI_WITH_IO_URING
+        run(0, Backend::IO_URING);
+        run(2, Backend::IO_URING);
+    #endif
+
+    return 0;
+}
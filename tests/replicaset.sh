@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# Run a test against a local three member replica set
+#
+# Usage: replicaset.sh <test> [arguments]
+#
+# Starts mongod on ports 27117 to 27119 with the data in a temporary directory and
+# removes everything afterwards. The test is skipped if mongod is not installed.
+
+PORTS="27117 27118 27119"
+SET=gfsfcgi_test
+
+if ! command -v mongod > /dev/null; then
+    echo "mongod not found, skipped"
+    exit 0
+fi
+
+SHELL_COMMAND=mongosh
+command -v mongosh > /dev/null || SHELL_COMMAND=mongo
+
+DATA=$(mktemp -d)
+trap 'for port in $PORTS; do [ -f "$DATA/$port.pid" ] && kill $(cat "$DATA/$port.pid") 2> /dev/null; done; sleep 1; rm -rf "$DATA"' EXIT
+
+MEMBERS=""
+SEEDS=""
+ID=0
+
+for port in $PORTS; do
+    mkdir "$DATA/$port"
+    mongod --replSet $SET --port $port --bind_ip 127.0.0.1 --dbpath "$DATA/$port" \
+        --logpath "$DATA/$port.log" --pidfilepath "$DATA/$port.pid" --fork > /dev/null || exit 1
+
+    MEMBERS="$MEMBERS{_id: $ID, host: '127.0.0.1:$port'},"
+    SEEDS="$SEEDS127.0.0.1:$port,"
+    ID=$((ID + 1))
+done
+
+PRIMARY=127.0.0.1:$(echo $PORTS | cut -d ' ' -f 1)
+
+$SHELL_COMMAND --quiet $PRIMARY --eval "rs.initiate({_id: '$SET', members: [$MEMBERS]})" > /dev/null || exit 1
+
+# Wait for a primary, then write the test file to all members
+$SHELL_COMMAND --quiet $PRIMARY --eval "
+    while (!db.isMaster().ismaster) { sleep(100); }
+    db.getSiblingDB('gfsfcgi_test').fs.files.insertOne(
+        {filename: 'failover', length: 0, chunkSize: 261120, uploadDate: new Date()},
+        {writeConcern: {w: 3}}
+    );
+" > /dev/null || exit 1
+
+GFSFCGI_TEST_SEEDS=${SEEDS%,} GFSFCGI_TEST_SET=$SET "$@"
@@ -0,0 +1,317 @@
+/**
+ * Suspended handlers: waiting for input and for external events
+ */
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "test.hpp"
+
+using namespace fastcgi;
+
+/**
+ * Handler running a test step on each handle() call
+ */
+class StepHandler : public RequestHandler
+{
+    public:
+        /**
+         * @param[in]  call  Number of the handle() call, starting with 1
+         * @return The result of handle()
+         */
+        typedef std::function<bool(StepHandler& handler, size_t call)> Step;
+
+    protected:
+        Step step;
+        size_t calls;
+
+    public:
+        std::atomic<size_t>& received; ///< STDIN records with content
+
+        inline StepHandler(Request& request, Step step, std::atomic<size_t>& received) : RequestHandler(request),
+                step(step),
+                calls(0),
+                received(received)
+        {};
+
+        using RequestHandler::waitForInput;
+        using RequestHandler::suspend;
+
+        void onReceiveData(const protocol::Record& record)
+        {
+            if ((record.header.type == FCGI_STDIN) && (record.header.contentLength > 0)) {
+                this->received++;
+            }
+        }
+
+        bool handle()
+        {
+            return this->step(*this, ++this->calls);
+        }
+
+        inline bool respond(const std::string& body)
+        {
+            this->getRequest().getStdOut() << "Content-Type: text/plain\r\n\r\n" << body;
+            this->finish(0);
+
+            return true;
+        }
+};
+
+class StepHandlerFactory : public HandlerFactory
+{
+    protected:
+        StepHandler::Step step;
+
+    public:
+        std::atomic<size_t> received;
+
+        inline StepHandlerFactory(StepHandler::Step step) : step(step), received(0) {};
+
+        inline RequestHandlerPtr factory(Request& request)
+        {
+            return std::make_shared<StepHandler>(request, this->step, this->received);
+        }
+};
+
+/**
+ * Resumers handed out by a handler
+ */
+struct Resumers {
+    std::mutex mutex;
+    std::vector<Resumer> list;
+
+    inline void add(Resumer resumer)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->list.push_back(resumer);
+    }
+
+    /**
+     * Wait until the given number of resumers was added (up to 5 seconds)
+     */
+    inline bool waitFor(size_t count)
+    {
+        for (int i = 0; i < 500; i++) {
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+
+                if (this->list.size() >= count) {
+                    return true;
+                }
+            }
+
+            usleep(10000);
+        }
+
+        return false;
+    }
+
+    /**
+     * Call a resumer on a thread of its own
+     */
+    inline void fire(size_t index)
+    {
+        Resumer resumer;
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            resumer = this->list.at(index);
+        }
+
+        std::thread(resumer).join();
+    }
+};
+
+/**
+ * Send a request without STDIN, the handler starts once PARAMS ended
+ */
+static void sendParams(test::Client& client)
+{
+    std::string params("\x0b\x02" "SCRIPT_NAME" "/x", 15);
+
+    client.send(test::Client::beginRecord(1, true) + test::Client::record(FCGI_PARAMS, 1, params) +
+        test::Client::record(FCGI_PARAMS, 1, ""));
+}
+
+static void checkResponse(test::Client& client, const std::string& body)
+{
+    std::string output;
+    unsigned char status;
+
+    CHECK(client.readResponse(1, output, status));
+    CHECK(status == FCGI_REQUEST_COMPLETE);
+    CHECK(output == "Content-Type: text/plain\r\n\r\n" + body);
+}
+
+/**
+ * A resumer fired by another thread before handle() returned runs the handler again
+ */
+static void testSignalBeforeReturn()
+{
+    std::atomic<size_t> calls(0);
+    test::Server server;
+
+    server.addHandlerFactory(std::make_shared<StepHandlerFactory>([&](StepHandler& handler, size_t call) {
+        calls++;
+
+        if (call == 1) {
+            Resumer resumer = handler.suspend();
+
+            std::thread(resumer).join();
+            return false;
+        }
+
+        return handler.respond("resumed");
+    }));
+
+    server.start(1);
+
+    test::Client client(server.connect());
+
+    sendParams(client);
+    checkResponse(client, "resumed");
+    CHECK(calls == 2);
+}
+
+/**
+ * A resumer fired by another thread after handle() returned runs the handler again
+ */
+static void testSignalAfterReturn()
+{
+    std::atomic<size_t> calls(0);
+    test::Server server;
+    Resumers resumers; ///< Keep requests alive, released before the server
+
+    server.addHandlerFactory(std::make_shared<StepHandlerFactory>([&](StepHandler& handler, size_t call) {
+        calls++;
+
+        if (call == 1) {
+            resumers.add(handler.suspend());
+            return false;
+        }
+
+        return handler.respond("resumed");
+    }));
+
+    server.start(1);
+
+    test::Client client(server.connect());
+
+    sendParams(client);
+    CHECK(resumers.waitFor(1));
+
+    // Suspended, not called again until resumed
+    usleep(100000);
+    CHECK(calls == 1);
+
+    resumers.fire(0);
+    checkResponse(client, "resumed");
+    CHECK(calls == 2);
+}
+
+/**
+ * Only the resumer of the latest suspend() has an effect
+ */
+static void testStaleSignal()
+{
+    std::atomic<size_t> calls(0);
+    test::Server server;
+    Resumers resumers; ///< Keep requests alive, released before the server
+
+    server.addHandlerFactory(std::make_shared<StepHandlerFactory>([&](StepHandler& handler, size_t call) {
+        calls++;
+
+        switch (call) {
+            case 1:
+                resumers.add(handler.suspend());
+                return false;
+
+            case 2:
+                // Replaced by the second suspend() of the same call
+                resumers.add(handler.suspend());
+                resumers.add(handler.suspend());
+                return false;
+
+            default:
+                return handler.respond("resumed");
+        }
+    }));
+
+    server.start(1);
+
+    test::Client client(server.connect());
+
+    sendParams(client);
+    CHECK(resumers.waitFor(1));
+
+    resumers.fire(0);
+    CHECK(resumers.waitFor(3));
+
+    // From the earlier call and the replaced one
+    resumers.fire(0);
+    resumers.fire(1);
+
+    usleep(100000);
+    CHECK(calls == 2);
+
+    resumers.fire(2);
+    checkResponse(client, "resumed");
+    CHECK(calls == 3);
+}
+
+/**
+ * STDIN that arrives during handle() after waitForInput() runs the handler again
+ */
+static void testInputDuringHandle()
+{
+    std::atomic<size_t> calls(0);
+    std::atomic<bool> waiting(false);
+    test::Server server;
+
+    server.addHandlerFactory(std::make_shared<StepHandlerFactory>([&](StepHandler& handler, size_t call) {
+        calls++;
+
+        if (call == 1) {
+            handler.waitForInput();
+            waiting = true;
+
+            // The record arrives before the handler returned
+            while (handler.received == 0) {
+                usleep(1000);
+            }
+
+            return false;
+        }
+
+        return handler.respond("input");
+    }));
+
+    server.start(1);
+
+    test::Client client(server.connect());
+
+    sendParams(client);
+
+    for (int i = 0; (i < 500) && !waiting; i++) {
+        usleep(10000);
+    }
+
+    CHECK(waiting);
+
+    // No more input follows, the handler must not wait for it
+    client.send(test::Client::record(FCGI_STDIN, 1, "data"));
+    checkResponse(client, "input");
+    CHECK(calls == 2);
+}
+
+int main()
+{
+    testSignalBeforeReturn();
+    testSignalAfterReturn();
+    testStaleSignal();
+    testInputDuringHandle();
+
+    return 0;
+}
@@ -0,0 +1,358 @@
+/**
+ * Test helpers: checks, an in-process FastCGI server and a minimal FastCGI client
+ */
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include <cstdlib>
+#include <cerrno>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "fastcgi.hpp"
+
+/**
+ * Abort the test with a message if the condition does not hold
+ */
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": Check failed: " << #condition << std::endl; \
+            std::exit(1); \
+        } \
+    } while (0)
+
+namespace test
+{
+    /**
+     * Handler answering every request with a fixed body
+     */
+    class StaticHandler : public fastcgi::RequestHandler
+    {
+        protected:
+            const std::string& body;
+
+        public:
+            inline StaticHandler(fastcgi::Request& request, const std::string& body) : fastcgi::RequestHandler(request),
+                    body(body)
+            {};
+
+            inline bool handle()
+            {
+                this->getRequest().getStdOut() << "Content-Type: text/plain\r\n\r\n" << this->body;
+                this->finish(0);
+
+                return true;
+            }
+    };
+
+    class StaticHandlerFactory : public fastcgi::HandlerFactory
+    {
+        protected:
+            std::string body;
+
+        public:
+            inline StaticHandlerFactory(const std::string& body) : body(body) {};
+
+            inline fastcgi::RequestHandlerPtr factory(fastcgi::Request& request)
+            {
+                return std::make_shared<StaticHandler>(request, this->body);
+            }
+    };
+
+    /**
+     * I/O handler listening on a unix socket in a temporary directory, run by a thread
+     * of its own
+     */
+    class Server : public fastcgi::IOHandler
+    {
+        protected:
+            std::string directory;
+            std::string path;
+            std::thread* thread;
+
+            static int listenUnix(const std::string& path)
+            {
+                sockaddr_un address;
+                int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+                memset(&address, 0, sizeof(address));
+                address.sun_family = AF_UNIX;
+                strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+                CHECK(fd >= 0);
+                CHECK(::bind(fd, (sockaddr*)&address, sizeof(address)) == 0);
+                CHECK(::listen(fd, 128) == 0);
+                CHECK(fastcgi::IOHandler::setNonBlocking(fd));
+
+                return fd;
+            }
+
+            static std::string createDirectory()
+            {
+                char name[] = "/tmp/gfsfcgi-test.XXXXXX";
+
+                CHECK(mkdtemp(name) != NULL);
+                return name;
+            }
+
+            static void eventStopCallback(evutil_socket_t /* fd */, short /* eventType */, void* ptr)
+            {
+                event_base_loopbreak((event_base*)ptr);
+            }
+
+            inline Server(const std::string& directory) : fastcgi::IOHandler(listenUnix(directory + "/fcgi.sock")),
+                    directory(directory),
+                    path(directory + "/fcgi.sock"),
+                    thread(NULL)
+            {};
+
+        public:
+            inline Server() : Server(createDirectory()) {};
+
+            inline ~Server()
+            {
+                this->stop();
+
+                unlink(this->path.c_str());
+                rmdir(this->directory.c_str());
+            }
+
+            inline void start(unsigned int workerCount = 2)
+            {
+                this->thread = new std::thread(&Server::run, this, workerCount);
+            }
+
+            /**
+             * Stop the event loop, the connections are closed on destruction
+             */
+            inline void stop()
+            {
+                if (this->thread == NULL) {
+                    return;
+                }
+
+                // Queued to the loop, so it also works before the loop started
+                event_base_once(this->eventBase, -1, EV_TIMEOUT, Server::eventStopCallback, this->eventBase, NULL);
+
+                this->thread->join();
+                delete this->thread;
+                this->thread = NULL;
+            }
+
+            /**
+             * Open a connection to the server
+             */
+            inline int connect() const
+            {
+                sockaddr_un address;
+                int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+
+                memset(&address, 0, sizeof(address));
+                address.sun_family = AF_UNIX;
+                strncpy(address.sun_path, this->path.c_str(), sizeof(address.sun_path) - 1);
+
+                CHECK(fd >= 0);
+                CHECK(::connect(fd, (sockaddr*)&address, sizeof(address)) == 0);
+
+                return fd;
+            }
+    };
+
+    /**
+     * Number of open file descriptors of this process
+     */
+    inline size_t countOpenFiles()
+    {
+        DIR* directory = opendir("/proc/self/fd");
+        size_t count = 0;
+
+        CHECK(directory != NULL);
+
+        while (readdir(directory) != NULL) {
+            count++;
+        }
+
+        closedir(directory);
+
+        // ., .. and the directory itself
+        return count - 3;
+    }
+
+    /**
+     * Minimal FastCGI client (blocking socket)
+     */
+    class Client
+    {
+        protected:
+            int fd;
+            std::string input;
+
+            /**
+             * Read until the input holds the given number of bytes
+             *
+             * @return false on EOF
+             */
+            inline bool fill(size_t size)
+            {
+                char buffer[65536];
+
+                while (this->input.size() < size) {
+                    ssize_t result = ::recv(this->fd, buffer, sizeof(buffer), 0);
+
+                    if (result == 0) {
+                        return false;
+                    }
+
+                    CHECK((result > 0) || (errno == EINTR));
+                    this->input.append(buffer, (result > 0)? result : 0);
+                }
+
+                return true;
+            }
+
+        public:
+            inline Client(int fd) : fd(fd)
+            {
+                // Fail instead of hanging if the server does not answer
+                timeval timeout = { 5, 0 };
+                setsockopt(this->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            };
+
+            inline ~Client()
+            {
+                this->close();
+            }
+
+            inline void close()
+            {
+                if (this->fd >= 0) {
+                    ::close(this->fd);
+                    this->fd = -1;
+                }
+            }
+
+            /**
+             * Send raw bytes
+             */
+            inline void send(const std::string& data)
+            {
+                size_t sent = 0;
+
+                while (sent < data.size()) {
+                    ssize_t result = ::send(this->fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+
+                    CHECK((result > 0) || (errno == EINTR));
+                    sent += (result > 0)? result : 0;
+                }
+            }
+
+            static std::string record(unsigned char type, uint16_t id, const std::string& content)
+            {
+                fastcgi::protocol::Header header = { FCGI_VERSION_1, type, id, (uint16_t)content.size(), 0, 0 };
+
+                header = fastcgi::protocol::encode(header);
+                return std::string((const char*)&header, sizeof(header)) + content;
+            }
+
+            /**
+             * BEGIN_REQUEST record of a responder request
+             */
+            static std::string beginRecord(uint16_t id, bool keepConnection)
+            {
+                fastcgi::protocol::BeginRequestBody body = { FCGI_RESPONDER, (unsigned char)(keepConnection? FCGI_KEEP_CONN : 0), { 0, 0, 0, 0, 0 } };
+
+                body = fastcgi::protocol::encode(body);
+                return record(FCGI_BEGIN_REQUEST, id, std::string((const char*)&body, sizeof(body)));
+            }
+
+            /**
+             * Send a complete responder request (BEGIN, PARAMS, empty PARAMS, empty STDIN)
+             */
+            inline void sendRequest(uint16_t id, bool keepConnection)
+            {
+                std::string params("\x0b\x02" "SCRIPT_NAME" "/x", 15);
+
+                this->send(beginRecord(id, keepConnection) + record(FCGI_PARAMS, id, params) + record(FCGI_PARAMS, id, "") +
+                    record(FCGI_STDIN, id, ""));
+            }
+
+            /**
+             * Read the next record
+             *
+             * @param[out] header   The decoded header
+             * @param[out] content  The content without padding
+             * @return false on EOF
+             */
+            inline bool readRecord(fastcgi::protocol::Header& header, std::string& content)
+            {
+                if (!this->fill(FCGI_HEADER_LEN)) {
+                    return false;
+                }
+
+                memcpy(&header, this->input.data(), sizeof(header));
+                header = fastcgi::protocol::decode(header);
+
+                size_t size = FCGI_HEADER_LEN + header.contentLength + header.paddingLength;
+
+                if (!this->fill(size)) {
+                    return false;
+                }
+
+                content = this->input.substr(FCGI_HEADER_LEN, header.contentLength);
+                this->input.erase(0, size);
+
+                return true;
+            }
+
+            /**
+             * Read the response of a request
+             *
+             * @param[out] output  The STDOUT content
+             * @param[out] status  The protocol status of END_REQUEST
+             * @return false if the connection was closed before END_REQUEST
+             */
+            inline bool readResponse(uint16_t id, std::string& output, unsigned char& status)
+            {
+                fastcgi::protocol::Header header;
+                std::string content;
+
+                output.clear();
+
+                while (this->readRecord(header, content)) {
+                    CHECK(header.requestId == id);
+
+                    if (header.type == FCGI_STDOUT) {
+                        output += content;
+                    } else if (header.type == FCGI_END_REQUEST) {
+                        fastcgi::protocol::EndRequestBody body;
+
+                        CHECK(content.size() == sizeof(body));
+                        memcpy(&body, content.data(), sizeof(body));
+                        status = body.protocolStatus;
+
+                        return true;
+                    }
+                }
+
+                return false;
+            }
+
+            /**
+             * Check if the server closed the connection (waits up to a second)
+             */
+            inline bool isClosed()
+            {
+                timeval timeout = { 1, 0 };
+                char byte;
+
+                setsockopt(this->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+                return (::recv(this->fd, &byte, 1, 0) == 0);
+            }
+    };
+}
@@ -0,0 +1,352 @@
+/**
+ * Work stealing deque and worker queue
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <vector>
+
+#include "test.hpp"
+
+using namespace fastcgi;
+
+static const size_t TASK_COUNT = 20000;
+static const size_t THREAD_COUNT = 4;
+
+/**
+ * Wait until the counter reached the given value (up to 10 seconds)
+ */
+static bool waitFor(const std::atomic<size_t>& counter, size_t value)
+{
+    for (int i = 0; i < 10000; i++) {
+        if (counter >= value) {
+            return true;
+        }
+
+        usleep(1000);
+    }
+
+    return false;
+}
+
+/**
+ * The owner pushes and pops while thieves steal, every item is taken exactly once
+ */
+static void testDeque()
+{
+    WorkStealingDeque<size_t*> deque(4);
+    std::vector<size_t> items(TASK_COUNT);
+    std::vector<std::atomic<unsigned>> taken(TASK_COUNT);
+    std::atomic<bool> done(false);
+    std::vector<std::thread> thieves;
+
+    for (size_t i = 0; i < TASK_COUNT; i++) {
+        items[i] = i;
+        taken[i] = 0;
+    }
+
+    for (size_t i = 0; i < THREAD_COUNT; i++) {
+        thieves.emplace_back([&]() {
+            while (!done || (deque.size() > 0)) {
+                size_t* item = deque.steal();
+
+                if (item != NULL) {
+                    taken[*item]++;
+                }
+            }
+        });
+    }
+
+    // Grows the array while thieves read from it
+    for (size_t i = 0; i < TASK_COUNT; i++) {
+        deque.push(&items[i]);
+
+        if ((i % 3) == 0) {
+            size_t* item = deque.pop();
+
+            if (item != NULL) {
+                taken[*item]++;
+            }
+        }
+    }
+
+    done = true;
+
+    for (auto& thief : thieves) {
+        thief.join();
+    }
+
+    for (size_t i = 0; i < TASK_COUNT; i++) {
+        CHECK(taken[i] == 1);
+    }
+}
+
+/**
+ * Callbacks pushed from outside run once, unfinished ones are pushed again
+ */
+static void testExternalPush()
+{
+    WorkerQueue queue;
+    std::atomic<size_t> runs(0);
+    std::atomic<size_t> completed(0);
+
+    queue.run(THREAD_COUNT);
+
+    for (size_t i = 0; i < TASK_COUNT; i++) {
+        WorkerCallbackPtr task = WorkerTask::create();
+        size_t steps = (i % 4) + 1;
+
+        task->callback = [&runs, &completed, steps]() mutable {
+            runs++;
+
+            if (--steps > 0) {
+                return false;
+            }
+
+            completed++;
+            return true;
+        };
+
+        queue.push(task);
+    }
+
+    CHECK(waitFor(completed, TASK_COUNT));
+    CHECK(runs == (TASK_COUNT / 4) * (1 + 2 + 3 + 4));
+}
+
+/**
+ * Callbacks pushed by a worker land on its own deque, idle workers steal them
+ */
+static void testStealing()
+{
+    WorkerQueue queue;
+    std::atomic<size_t> completed(0);
+    std::mutex mutex;
+    std::set<std::thread::id> workers;
+
+    queue.run(THREAD_COUNT);
+
+    WorkerCallbackPtr spawner = WorkerTask::create();
+
+    spawner->callback = [&]() {
+        for (size_t i = 0; i < TASK_COUNT; i++) {
+            WorkerCallbackPtr task = WorkerTask::create();
+
+            task->callback = [&]() {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    workers.insert(std::this_thread::get_id());
+                }
+
+                usleep(10);
+                completed++;
+                return true;
+            };
+
+            queue.push(task);
+        }
+
+        return true;
+    };
+
+    queue.push(spawner);
+
+    CHECK(waitFor(completed, TASK_COUNT));
+    CHECK(workers.size() > 1);
+}
+
+/**
+ * Callbacks still queued on termination are released
+ */
+static void testTerminate()
+{
+    std::vector<WorkerCallbackPtr> tasks;
+
+    {
+        WorkerQueue queue;
+        std::atomic<bool> release(false);
+        std::atomic<size_t> started(0);
+
+        queue.run(1);
+
+        for (size_t i = 0; i < 100; i++) {
+            WorkerCallbackPtr task = WorkerTask::create();
+
+            task->callback = [&]() {
+                started++;
+
+                while (!release) {
+                    usleep(100);
+                }
+
+                return false;
+            };
+
+            tasks.push_back(task);
+            queue.push(task);
+        }
+
+        CHECK(waitFor(started, 1));
+
+        queue.terminate();
+        release = true;
+    }
+
+    for (auto& task : tasks) {
+        CHECK(task.use_count() == 1);
+    }
+}
+
+/**
+ * A small response does not wait behind all running downloads
+ *
+ * One worker serves many bulk callbacks that send a lot per step. By FIFO an
+ * interactive callback would wait for a step of each of them.
+ */
+static void testFairness()
+{
+    const size_t bulkCount = 64;
+
+    WorkerQueue queue;
+    std::atomic<size_t> bulkSteps(0);
+    std::atomic<bool> stop(false);
+
+    queue.run(1);
+
+    for (size_t i = 0; i < bulkCount; i++) {
+        WorkerCallbackPtr task = WorkerTask::create();
+        WorkerTask* self = task.get();
+
+        task->serviceClass = ServiceClass::BULK;
+        task->callback = [&, self]() {
+            usleep(50);
+            self->cost = 1024 * 1024;
+            bulkSteps++;
+
+            return stop.load();
+        };
+
+        queue.push(task);
+    }
+
+    CHECK(waitFor(bulkSteps, bulkCount * 2));
+
+    size_t maxWait = 0;
+
+    for (size_t i = 0; i < 20; i++) {
+        std::atomic<size_t> completed(0);
+        size_t pushedAt = bulkSteps;
+        size_t ranAt = 0;
+        WorkerCallbackPtr task = WorkerTask::create();
+
+        task->callback = [&]() {
+            ranAt = bulkSteps;
+            completed++;
+            return true;
+        };
+
+        queue.push(task);
+        CHECK(waitFor(completed, 1));
+
+        maxWait = std::max(maxWait, ranAt - pushedAt);
+    }
+
+    stop = true;
+
+    // At most a batch of bulk steps runs before the interactive class gets its turn
+    CHECK(maxWait <= 2 * WorkerQueue::POP_BATCH);
+}
+
+/**
+ * Blocked workers are replaced up to the upper limit, idle ones retire again
+ */
+static void testElastic()
+{
+    // Workers take POP_BATCH callbacks at once, enough are left queued to grow to the limit
+    const size_t taskCount = 8 * WorkerQueue::POP_BATCH;
+
+    WorkerQueue queue;
+    std::atomic<bool> release(false);
+    std::atomic<size_t> completed(0);
+    WorkerQueue::Metrics metrics;
+
+    queue.setThreadLimits(1, 4);
+    queue.setTargetDelay(1000);
+    queue.run(1);
+
+    for (size_t i = 0; i < taskCount; i++) {
+        WorkerCallbackPtr task = WorkerTask::create();
+
+        // Like a handler waiting for the database
+        task->callback = [&]() {
+            while (!release) {
+                usleep(1000);
+            }
+
+            completed++;
+            return true;
+        };
+
+        queue.push(task);
+    }
+
+    for (int i = 0; i < 500; i++) {
+        metrics = queue.getMetrics();
+        CHECK(metrics.threads <= metrics.maxThreads);
+
+        if (metrics.threads == metrics.maxThreads) {
+            break;
+        }
+
+        usleep(10000);
+    }
+
+    CHECK(metrics.grown > 0);
+    CHECK(metrics.threads == 4);
+    CHECK(metrics.blocked > 0);
+
+    release = true;
+    CHECK(waitFor(completed, taskCount));
+
+    // Applies to the workers already sleeping
+    queue.setIdleTimeout(100);
+
+    for (int i = 0; i < 500; i++) {
+        metrics = queue.getMetrics();
+
+        if (metrics.threads == metrics.minThreads) {
+            break;
+        }
+
+        usleep(10000);
+    }
+
+    CHECK(metrics.threads == metrics.minThreads);
+    CHECK(metrics.retired > 0);
+    CHECK(metrics.retired == metrics.grown);
+    CHECK(metrics.queued == 0);
+
+    // The remaining worker still runs callbacks
+    WorkerCallbackPtr task = WorkerTask::create();
+
+    task->callback = [&]() {
+        completed++;
+        return true;
+    };
+
+    queue.push(task);
+    CHECK(waitFor(completed, taskCount + 1));
+}
+
+int main()
+{
+    testDeque();
+    testExternalPush();
+    testStealing();
+    testTerminate();
+    testFairness();
+    testElastic();
+
+    return 0;
+}